@@ -4,12 +4,13 @@
  * You may need to modify this file.
  */
 
-#include "kernel/sleepq.h"
 #include "kernel/interrupt.h"
 #include "kernel/config.h"
 #include "kernel/kmalloc.h"
 #include "kernel/assert.h"
-#include "vm/pagepool.h"
+#include "kernel/lock_cond.h"
+#include "kernel/slab.h"
+#include "vm/vmap.h"
 #include "drivers/gbd.h"
 #include "fs/vfs.h"
 #include "fs/pipe.h"
@@ -18,53 +19,78 @@
 /* Data structure for use internally in pipefs. We allocate space for this
  * dynamically during initialization */
 typedef struct {
-  semaphore_t *lock;
+  lock_t lock;
   pipe_t pipes[CONFIG_MAX_PIPES];
   int free_pipes;
 } pipefs_t;
 
+/* Release a pipe after reading or writing it. The last user of a
+ * removed pipe frees it. Must be called with the pipefs lock held. */
+static void pipe_put(pipefs_t *pfs, pipe_t *pipe)
+{
+  pipe->users--;
+  if (pipe->users == 0 && pipe->state == PIPE_REMOVED) {
+    pipe->state = PIPE_FREE;
+    vfree(pipe->buffer);
+    pfs->free_pipes++;
+  }
+}
+
+/* Find the pipe with the given id and register the caller as its
+ * user. Returns NULL if the pipe does not exist. */
+static pipe_t *pipe_get(pipefs_t *pfs, int fileid)
+{
+  pipe_t *pipe;
+  if (fileid < 0 || fileid >= CONFIG_MAX_PIPES) {
+    return NULL;
+  }
+  pipe = &pfs->pipes[fileid];
+  lock_acquire(&pfs->lock);
+  if (pipe->state != PIPE_OPEN) {
+    lock_release(&pfs->lock);
+    return NULL;
+  }
+  pipe->users++;
+  lock_release(&pfs->lock);
+  return pipe;
+}
+
 /***********************************
  * fs_t function implementations
  ***********************************/
 
-/* Initialize pipefs. We allocate one page of dynamic memory for the
- * fs_t and pipefs_t structures.  Note that, in contrast to other
+/* Initialize pipefs. The fs_t and pipefs_t structures are allocated
+ * together from the kernel object allocator; pipe buffers are
+ * allocated with vmalloc when pipes are created, so they can be in
+ * high memory and need no physically contiguous pages. Note that, in contrast to other
  * filesystems, we take no disk parameter.  You may want to extend
  * this function. */
 fs_t *pipe_init(void)
 {
-  uint32_t addr;
   fs_t *fs;
   pipefs_t *pipefs;
-  semaphore_t *sem;
-
-  /* check semaphore availability before memory allocation */
-  sem = semaphore_create(1);
-  if (sem == NULL) {
-    kprintf("pipe_init: could not create a new semaphore.\n");
-    return NULL;
-  }
+  int i;
 
-  addr = pagepool_get_phys_page();
-  if(addr == 0) {
-    semaphore_destroy(sem);
+  fs = (fs_t *)kmem_alloc(sizeof(fs_t) + sizeof(pipefs_t));
+  if(fs == NULL) {
     kprintf("pipe_init: could not allocate memory.\n");
     return NULL;
   }
-  addr = ADDR_PHYS_TO_KERNEL(addr);    /* transform to vm address */
-
-  /* Assert that one page is enough */
-  KERNEL_ASSERT(PAGE_SIZE >= (sizeof(pipefs_t)+sizeof(fs_t)));
+  pipefs = (pipefs_t *)(fs + 1);
 
-  /* fs_t, pipefs_t and all required structure will most likely fit
-     in one page, so obtain addresses for each structure and buffer
-     inside the allocated memory page. */
-  fs  = (fs_t *)addr;
-  pipefs = (pipefs_t *)(addr + sizeof(fs_t));
-
-  /* save semaphore to the pipefs_t */
-  pipefs->lock = sem;
+  lock_reset(&pipefs->lock);
   pipefs->free_pipes = CONFIG_MAX_PIPES;
+  /* The locks and condition variables of a pipe are only used while
+     the pipe has users, so they are initialized once here. */
+  for (i = 0; i < CONFIG_MAX_PIPES; i++) {
+    pipefs->pipes[i].state = PIPE_FREE;
+    pipefs->pipes[i].users = 0;
+    pipefs->pipes[i].buffer = NULL;
+    condition_init(&pipefs->pipes[i].readable);
+    condition_init(&pipefs->pipes[i].writable);
+    lock_reset(&pipefs->pipes[i].read_lock);
+    lock_reset(&pipefs->pipes[i].write_lock);
+  }
   fs->internal = (void *)pipefs;
 
   /* We always have this name. */
@@ -83,9 +109,6 @@ fs_t *pipe_init(void)
   return fs;
 }
 
-/* You have to implement the following functions.  Some of them may
-   just return an error.  You have to carefully consider what to do.*/
-
 int pipe_unmount(fs_t *fs)
 {
   fs=fs;
@@ -97,15 +120,16 @@ int pipe_open(fs_t *fs, char *filename)
   pipefs_t *pfs;
   pfs = (pipefs_t*) fs->internal;
   int i;
-  semaphore_P(pfs->lock);
+  lock_acquire(&pfs->lock);
   // Find matching pipe.
-  for (i = 0; i <= CONFIG_MAX_PIPES; i++) {
-    if (stringcmp(pfs->pipes[i].name,filename) == 0) {
-      semaphore_V(pfs->lock);
+  for (i = 0; i < CONFIG_MAX_PIPES; i++) {
+    if (pfs->pipes[i].state == PIPE_OPEN &&
+        stringcmp(pfs->pipes[i].name,filename) == 0) {
+      lock_release(&pfs->lock);
       return i;
     }
   }
-  semaphore_V(pfs->lock);
+  lock_release(&pfs->lock);
   return VFS_NOT_FOUND;
 }
 
@@ -118,224 +142,177 @@ int pipe_close(fs_t *fs, int fileid)
 
 int pipe_create(fs_t *fs, char *filename, int size)
 {
-  semaphore_t *read_sem;
-  semaphore_t *write_sem;
   pipefs_t *pfs;
   pfs = (pipefs_t*) fs->internal;
   size = size;
   int pid, i;
-  semaphore_P(pfs->lock);
+  char *buffer;
+  // vmalloc may sleep waiting for a purge, so the buffer is allocated
+  // before taking the lock all pipes share.
+  buffer = (char *)vmalloc(CONFIG_PIPE_BUFFER_SIZE);
+  if (buffer == NULL) {
+    return VFS_ERROR;
+  }
+  lock_acquire(&pfs->lock);
   pid = -1;
   // Find free pipe, return error if none left or one with same name exists.
-  for (i = 0; i <= CONFIG_MAX_PIPES; i++) {
-    if ((pfs->pipes[i].state != PIPE_FREE &&
+  for (i = 0; i < CONFIG_MAX_PIPES; i++) {
+    if ((pfs->pipes[i].state == PIPE_OPEN &&
          stringcmp(pfs->pipes[i].name,filename) == 0)) {
-      semaphore_V(pfs->lock);
-      return VFS_ERROR;
+      pid = -1;
+      break;
     }
     if (pid < 0 && pfs->pipes[i].state == PIPE_FREE){
       pid = i;
     }
   }
   if (pid < 0) {
-    semaphore_V(pfs->lock);
+    lock_release(&pfs->lock);
+    vfree(buffer);
     return VFS_ERROR;
   }
-  read_sem = semaphore_create(0);
-  write_sem = semaphore_create(0);
+  pfs->pipes[pid].buffer = buffer;
   stringcopy(pfs->pipes[pid].name,filename,CONFIG_PIPE_MAX_NAME);
-  pfs->pipes[pid].state = PIPE_OCCUPIED;
-  pfs->pipes[pid].offset = 0;
-  pfs->pipes[pid].write_sem = write_sem;
-  pfs->pipes[pid].read_sem = read_sem;
+  pfs->pipes[pid].state = PIPE_OPEN;
+  pfs->pipes[pid].head = 0;
+  pfs->pipes[pid].size = 0;
   pfs->free_pipes --;
-  semaphore_V(pfs->lock);
+  lock_release(&pfs->lock);
   return VFS_OK;
 }
 
 int pipe_remove(fs_t *fs, char *filename)
 {
   pipefs_t *pfs;
+  pipe_t *pipe;
   pfs = (pipefs_t*) fs->internal;
   int i;
-  semaphore_P(pfs->lock);
+  lock_acquire(&pfs->lock);
   // Find matching pipe.
-  for (i = 0; i <= CONFIG_MAX_PIPES; i++) {
-    if (stringcmp(pfs->pipes[i].name,filename)==0) {
-      pfs->pipes[i].state = PIPE_FREE;
-      pfs->free_pipes ++;
-      sleepq_wake_all(pfs->pipes[i].read_sem);
-      sleepq_wake_all(pfs->pipes[i].write_sem);
-      semaphore_V(pfs->pipes[i].read_sem);
-      semaphore_V(pfs->pipes[i].write_sem);
-      semaphore_V(pfs->lock);
+  for (i = 0; i < CONFIG_MAX_PIPES; i++) {
+    pipe = &pfs->pipes[i];
+    if (pipe->state == PIPE_OPEN && stringcmp(pipe->name,filename)==0) {
+      if (pipe->users == 0) {
+        pipe->state = PIPE_FREE;
+        vfree(pipe->buffer);
+        pfs->free_pipes ++;
+      } else {
+        // The last reader or writer to leave frees the pipe.
+        pipe->state = PIPE_REMOVED;
+        condition_broadcast(&pipe->readable);
+        condition_broadcast(&pipe->writable);
+      }
+      lock_release(&pfs->lock);
       return VFS_OK;
     }
   }
-  semaphore_V(pfs->lock);
+  lock_release(&pfs->lock);
   return VFS_ERROR;
 }
 
+/* Reads exactly bufsize bytes from the pipe, sleeping until a writer
+ * has provided them. Returns fewer bytes only if the pipe is removed
+ * during the read. The offset is ignored since pipes are streams. */
 int pipe_read(fs_t *fs, int fileid, void *buffer, int bufsize, int offset)
 {
   pipefs_t *pfs;
+  pipe_t *pipe;
+  int n, chunk, bytesread;
   pfs = (pipefs_t*) fs->internal;
-  interrupt_status_t intr_state;
-  int new_size, bytesread, bytes_remaining;
-  new_size = CONFIG_PIPE_BUFFER_SIZE;
+  offset = offset;
   bytesread = 0;
-  bytes_remaining = bufsize;
-  while (1) {
-    semaphore_P(pfs->lock);
-    switch (pfs->pipes[fileid].state) {
-      case PIPE_FREE:
-        return VFS_ERROR;
-      case PIPE_STREAMING:
-        pfs->pipes[fileid].state = PIPE_INUSE;
-        while ((pfs->pipes[fileid].state == PIPE_INUSE ||
-                pfs->pipes[fileid].state == PIPE_WRITE_OPEN) && bufsize > 0) {
-          semaphore_P(pfs->pipes[fileid].read_sem);
-          // Check if pipe has been removed.
-          if (pfs->pipes[fileid].state == PIPE_FREE){
-            continue;
-          }
-          new_size = CONFIG_PIPE_BUFFER_SIZE - pfs->pipes[fileid].offset;
-          // Make sure we dont copy more than the read requested.
-          if (bytes_remaining < CONFIG_PIPE_BUFFER_SIZE - pfs->pipes[fileid].offset) {
-            new_size = bytes_remaining;
-          }
-          // Make sure we dont copy more than there is in the buffer.
-          if (new_size > pfs->pipes[fileid].size) {
-            new_size = pfs->pipes[fileid].size;
-          }
-          memcopy(new_size, buffer+offset, pfs->pipes[fileid].buffer +
-                                           pfs->pipes[fileid].offset);
-          bytesread += new_size;
-          offset += new_size;
-          pfs->pipes[fileid].size -= new_size;
-          // If we are done reading the bufsize == bytesread
-          if (bufsize == bytesread) {
-            pfs->pipes[fileid].offset += new_size;
-            pfs->pipes[fileid].state = PIPE_STREAMING;
-            // If the pipe is finished writing as well, we set it to occupied.
-            if (pfs->pipes[fileid].size == 0) {
-              pfs->pipes[fileid].state = PIPE_OCCUPIED;
-              sleepq_wake(pfs->pipes[fileid].write_sem);
-            } else {
-              // else we want another process to be able to read.
-              semaphore_V(pfs->pipes[fileid].read_sem);
-              sleepq_wake(pfs->pipes[fileid].read_sem);
-            }
-            semaphore_V(pfs->lock);
-            return bytesread;
-          }
-          bytes_remaining -= new_size;
-          // If the pipe is finished writing we ask for another write.
-          if (pfs->pipes[fileid].size == 0) {
-            pfs->pipes[fileid].state = PIPE_WRITE_OPEN;
-            sleepq_wake(pfs->pipes[fileid].write_sem);
-            semaphore_V(pfs->lock);
-            continue;
-          }
-          // We open up for another write to the buffer.
-          semaphore_V(pfs->pipes[fileid].write_sem);
-        }
-        semaphore_V(pfs->lock);
-        return VFS_ERROR;
-      case PIPE_OCCUPIED:
-        // If it is occupied, it is set to listening, and wakes a writer.
-        pfs->pipes[fileid].state = PIPE_LISTENING;
-        sleepq_wake(pfs->pipes[fileid].write_sem);
-        break;
-      default:
-        break;
+
+  pipe = pipe_get(pfs, fileid);
+  if (pipe == NULL) {
+    return VFS_ERROR;
+  }
+
+  lock_acquire(&pipe->read_lock);
+  lock_acquire(&pfs->lock);
+  while (bytesread < bufsize) {
+    while (pipe->size == 0 && pipe->state == PIPE_OPEN) {
+      condition_wait(&pipe->readable, &pfs->lock);
+    }
+    if (pipe->state != PIPE_OPEN) {
+      break;
     }
-    // In the case that it is already in use we just put it to sleep.
-    intr_state = _interrupt_disable();
-    sleepq_add(pfs->pipes[fileid].read_sem);
-    _interrupt_set_state(intr_state);
-    semaphore_V(pfs->lock);
-    thread_switch();
+    n = MIN(pipe->size, bufsize - bytesread);
+    // Copy in at most two pieces, since the data may wrap around.
+    while (n > 0) {
+      chunk = MIN(n, CONFIG_PIPE_BUFFER_SIZE - pipe->head);
+      memcopy(chunk, (char *)buffer + bytesread, pipe->buffer + pipe->head);
+      pipe->head = (pipe->head + chunk) % CONFIG_PIPE_BUFFER_SIZE;
+      pipe->size -= chunk;
+      bytesread += chunk;
+      n -= chunk;
+    }
+    // Only the writer, if any, can make progress now.
+    condition_signal(&pipe->writable);
+  }
+  lock_release(&pfs->lock);
+  lock_release(&pipe->read_lock);
+
+  lock_acquire(&pfs->lock);
+  pipe_put(pfs, pipe);
+  lock_release(&pfs->lock);
+
+  if (bytesread == 0 && bufsize > 0) {
+    return VFS_ERROR;
   }
+  return bytesread;
 }
 
+/* Writes datasize bytes to the pipe, sleeping whenever the buffer is
+ * full. Returns fewer bytes only if the pipe is removed during the
+ * write. The offset is ignored since pipes are streams. */
 int pipe_write(fs_t *fs, int fileid, void *buffer, int datasize, int offset)
 {
   pipefs_t *pfs;
+  pipe_t *pipe;
+  int n, chunk, tail, written;
   pfs = (pipefs_t*) fs->internal;
-  interrupt_status_t intr_state;
-  int write_return, new_size;
-  new_size = CONFIG_PIPE_BUFFER_SIZE;
-  write_return = 0;
-  // As offset it handled internally we set this to 0.
-  offset = 0;
-  while (1) {
-    semaphore_P(pfs->lock);
-    switch (pfs->pipes[fileid].state) {
-      case PIPE_FREE:
-        semaphore_V(pfs->lock);
-        return VFS_ERROR;
-      case PIPE_LISTENING:
-        pfs->pipes[fileid].size = datasize;
-        pfs->pipes[fileid].state = PIPE_STREAMING;
-        sleepq_wake(pfs->pipes[fileid].read_sem);
-        while ((pfs->pipes[fileid].state == PIPE_STREAMING ||
-                pfs->pipes[fileid].state == PIPE_INUSE)) {
-          // we dont want to copy more than the buffer size, in the case
-          // where there is less than the buffer size going to be written.
-          if (datasize < CONFIG_PIPE_BUFFER_SIZE) {
-            new_size = datasize;
-          }
-          memcopy(new_size, pfs->pipes[fileid].buffer, buffer + offset);
-          pfs->pipes[fileid].offset = 0;
-          datasize -= new_size;
-          offset += new_size;
-          write_return += new_size;
-          semaphore_V(pfs->pipes[fileid].read_sem);
-          // if nothing is left to be written it returns the amount written.
-          if (datasize == 0){
-            semaphore_V(pfs->lock);
-            return write_return;
-          }
-          semaphore_P(pfs->pipes[fileid].write_sem);
-        }
-        semaphore_V(pfs->lock);
-        return VFS_ERROR;
-      case PIPE_OCCUPIED:
-        sleepq_wake(pfs->pipes[fileid].read_sem);
-        break;
-      case PIPE_WRITE_OPEN:
-        // This is for the case when a process is not done reading but
-        // a previous write did not write enough.
-        pfs->pipes[fileid].size = datasize;
-        pfs->pipes[fileid].state = PIPE_INUSE;
-        while (pfs->pipes[fileid].state == PIPE_INUSE) {
-          if (datasize < CONFIG_PIPE_BUFFER_SIZE) {
-            new_size = datasize;
-          }
-          memcopy(new_size, pfs->pipes[fileid].buffer, buffer + offset);
-          pfs->pipes[fileid].offset = 0;
-          datasize -= new_size;
-          offset += new_size;
-          write_return += new_size;
-          semaphore_V(pfs->pipes[fileid].read_sem);
-          if (datasize == 0){
-            semaphore_V(pfs->lock);
-            return write_return;
-          }
-          semaphore_P(pfs->pipes[fileid].write_sem);
-        }
-        semaphore_V(pfs->lock);
-        return VFS_ERROR;
-      default:
-        break;
+  offset = offset;
+  written = 0;
+
+  pipe = pipe_get(pfs, fileid);
+  if (pipe == NULL) {
+    return VFS_ERROR;
+  }
+
+  lock_acquire(&pipe->write_lock);
+  lock_acquire(&pfs->lock);
+  while (written < datasize) {
+    while (pipe->size == CONFIG_PIPE_BUFFER_SIZE &&
+           pipe->state == PIPE_OPEN) {
+      condition_wait(&pipe->writable, &pfs->lock);
+    }
+    if (pipe->state != PIPE_OPEN) {
+      break;
     }
-    intr_state = _interrupt_disable();
-    sleepq_add(pfs->pipes[fileid].write_sem);
-    semaphore_V(pfs->lock);
-    _interrupt_set_state(intr_state);
-    thread_switch();
+    n = MIN(CONFIG_PIPE_BUFFER_SIZE - pipe->size, datasize - written);
+    // Copy in at most two pieces, since the free space may wrap around.
+    while (n > 0) {
+      tail = (pipe->head + pipe->size) % CONFIG_PIPE_BUFFER_SIZE;
+      chunk = MIN(n, CONFIG_PIPE_BUFFER_SIZE - tail);
+      memcopy(chunk, pipe->buffer + tail, (char *)buffer + written);
+      pipe->size += chunk;
+      written += chunk;
+      n -= chunk;
+    }
+    // Only the reader, if any, can make progress now.
+    condition_signal(&pipe->readable);
+  }
+  lock_release(&pfs->lock);
+  lock_release(&pipe->write_lock);
+
+  lock_acquire(&pfs->lock);
+  pipe_put(pfs, pipe);
+  lock_release(&pfs->lock);
+
+  if (written == 0 && datasize > 0) {
+    return VFS_ERROR;
   }
+  return written;
 }
 
 int pipe_getfree(fs_t *fs)
@@ -343,9 +320,9 @@ int pipe_getfree(fs_t *fs)
   pipefs_t *pfs;
   pfs = (pipefs_t*) fs->internal;
   int retval;
-  semaphore_P(pfs->lock);
+  lock_acquire(&pfs->lock);
   retval = pfs->free_pipes;
-  semaphore_V(pfs->lock);
+  lock_release(&pfs->lock);
   return retval;
 }
 
@@ -356,9 +333,9 @@ int pipe_filecount(fs_t *fs, char *dirname)
   pipefs_t *pfs;
   pfs = (pipefs_t*) fs->internal;
   int retval;
-  semaphore_P(pfs->lock);
+  lock_acquire(&pfs->lock);
   retval = pfs->free_pipes;
-  semaphore_V(pfs->lock);
+  lock_release(&pfs->lock);
   return CONFIG_MAX_PIPES - retval;
 }
 
@@ -373,13 +350,14 @@ int pipe_file(fs_t *fs, char *dirname, int idx, char *buffer)
 
   pipefs_t *pfs;
   pfs = (pipefs_t*) fs->internal;
-  semaphore_P(pfs->lock);
-  if (pfs->pipes[idx].state == PIPE_FREE) {
+  lock_acquire(&pfs->lock);
+  if (pfs->pipes[idx].state != PIPE_OPEN) {
+    lock_release(&pfs->lock);
     return VFS_ERROR;
   }
 
   stringcopy(buffer, pfs->pipes[idx].name,CONFIG_PIPE_MAX_NAME);
-  semaphore_V(pfs->lock);
+  lock_release(&pfs->lock);
 
   return VFS_OK;
 }
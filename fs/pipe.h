@@ -10,24 +10,29 @@
 #include "fs/vfs.h"
 #include "lib/libc.h"
 #include "kernel/config.h"
+#include "kernel/lock_cond.h"
 
 typedef enum {
   PIPE_FREE, //The pipe has not been created.
-  PIPE_LISTENING, //The pipe is opened for writing.
-  PIPE_STREAMING, //The pipe is writing and will be set to PIPE_INUSE.
-  PIPE_OCCUPIED, //The pipe is not being read from or written to.
-  PIPE_INUSE, //The pipe is transmitting data.
-  PIPE_WRITE_OPEN //The pipe has consumed one writing process, and is ready for another.
+  PIPE_OPEN, //The pipe exists and can be read and written.
+  PIPE_REMOVED //The pipe is removed, but still has readers or writers.
 } pipe_state_t;
 
+/* A pipe is a ring buffer. Readers and writers are serialized with
+ * read_lock and write_lock, so that a single read or write is never
+ * interleaved with another one. The buffer itself is protected by the
+ * lock of the pipe filesystem. */
 typedef struct {
   char name[CONFIG_PIPE_MAX_NAME];
   pipe_state_t state;
-  int size;
-  int offset;
-  char buffer[CONFIG_PIPE_BUFFER_SIZE];
-  semaphore_t *read_sem;
-  semaphore_t *write_sem;
+  int users; //Number of threads reading or writing the pipe.
+  int head; //Index of the first unread byte in buffer.
+  int size; //Number of unread bytes in buffer.
+  char *buffer; //CONFIG_PIPE_BUFFER_SIZE bytes, allocated on create.
+  cond_t readable; //Signalled when data is added or the pipe is removed.
+  cond_t writable; //Signalled when data is consumed or the pipe is removed.
+  lock_t read_lock;
+  lock_t write_lock;
 } pipe_t;
 
 fs_t *pipe_init(void);
@@ -36,6 +36,7 @@
 
 #include "kernel/kmalloc.h"
 #include "kernel/assert.h"
+#include "kernel/slab.h"
 #include "vm/pagepool.h"
 #include "drivers/gbd.h"
 #include "fs/vfs.h"
@@ -53,7 +54,8 @@
 
 /* Data structure used internally by TFS filesystem. This data structure 
    is used by tfs-functions. it is initialized during tfs_init(). Also
-   memory for the buffers is reserved _dynamically_ during init.
+   memory for the buffers is reserved _dynamically_ during init, from
+   the kernel object allocator.
 
    Buffers are used when reading/writing system or data blocks from/to 
    disk.
@@ -76,8 +78,20 @@ typedef struct {
 } tfs_t;
 
 
+/* Frees the fs_t and tfs_t structures and the buffers allocated by
+ * tfs_init. Missing buffers are allowed. */
+static void tfs_free_memory(fs_t *fs)
+{
+    tfs_t *tfs = (tfs_t *)(fs + 1);
+
+    kmem_free(tfs->buffer_inode);
+    kmem_free(tfs->buffer_bat);
+    kmem_free(tfs->buffer_md);
+    kmem_free(fs);
+}
+
 /** 
- * Initialize trivial filesystem. Allocates 1 page of memory dynamically for
+ * Initialize trivial filesystem. Allocates memory dynamically for
  * filesystem data structure, tfs data structure and buffers needed.
  * Sets fs_t and tfs_t fields. If initialization is succesful, returns
  * pointer to fs_t data structure. Else NULL pointer is returned.
@@ -89,7 +103,6 @@ typedef struct {
  */
 fs_t * tfs_init(gbd_t *disk) 
 {
-    uint32_t addr;
     gbd_request_t req;
     char name[TFS_VOLUMENAME_MAX];
     fs_t *fs;
@@ -107,49 +120,47 @@ fs_t * tfs_init(gbd_t *disk)
         return NULL;
     }
 
-    addr = pagepool_get_phys_page();
-    if(addr == 0) {
+    /* fs_t and tfs_t are allocated together, the block buffers
+       separately so that they fit the block sized size class. */
+    fs = (fs_t *)kmem_alloc(sizeof(fs_t) + sizeof(tfs_t));
+    if(fs == NULL) {
+        semaphore_destroy(sem);
+        kprintf("tfs_init: could not allocate memory.\n");
+        return NULL;
+    }
+    tfs = (tfs_t *)(fs + 1);
+    tfs->buffer_inode = (tfs_inode_t *)kmem_alloc(TFS_BLOCK_SIZE);
+    tfs->buffer_bat   = (bitmap_t *)kmem_alloc(TFS_BLOCK_SIZE);
+    tfs->buffer_md    = (tfs_direntry_t *)kmem_alloc(TFS_BLOCK_SIZE);
+    if(tfs->buffer_inode == NULL || tfs->buffer_bat == NULL
+       || tfs->buffer_md == NULL) {
+        tfs_free_memory(fs);
         semaphore_destroy(sem);
         kprintf("tfs_init: could not allocate memory.\n");
         return NULL;
     }
-    addr = ADDR_PHYS_TO_KERNEL(addr);      /* transform to vm address */
-
-
-    /* Assert that one page is enough */
-    KERNEL_ASSERT(PAGE_SIZE >= (3*TFS_BLOCK_SIZE+sizeof(tfs_t)+sizeof(fs_t)));
 
     /* Read header block, and make sure this is tfs drive */
     req.block = 0;
     req.sem = NULL;
-    req.buf = ADDR_KERNEL_TO_PHYS(addr);   /* disk needs physical addr */
+    /* disk needs physical addr */
+    req.buf = ADDR_KERNEL_TO_PHYS((uint32_t)tfs->buffer_inode);
     r = disk->read_block(disk, &req);
     if(r == 0) {
+        tfs_free_memory(fs);
         semaphore_destroy(sem);
-        pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
         kprintf("tfs_init: Error during disk read. Initialization failed.\n");
         return NULL; 
     }
 
-    if(((uint32_t *)addr)[0] != TFS_MAGIC) {
+    if(((uint32_t *)tfs->buffer_inode)[0] != TFS_MAGIC) {
+        tfs_free_memory(fs);
         semaphore_destroy(sem);
-        pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS(addr));
         return NULL;
     }
 
     /* Copy volume name from header block. */
-    stringcopy(name, (char *)(addr+4), TFS_VOLUMENAME_MAX);
-
-    /* fs_t, tfs_t and all buffers in tfs_t fit in one page, so obtain
-       addresses for each structure and buffer inside the allocated
-       memory page. */
-    fs  = (fs_t *)addr;
-    tfs = (tfs_t *)(addr + sizeof(fs_t));
-    tfs->buffer_inode = (tfs_inode_t *)((uint32_t)tfs + sizeof(tfs_t));
-    tfs->buffer_bat  = (bitmap_t *)((uint32_t)tfs->buffer_inode + 
-            TFS_BLOCK_SIZE);
-    tfs->buffer_md   = (tfs_direntry_t *)((uint32_t)tfs->buffer_bat + 
-            TFS_BLOCK_SIZE);
+    stringcopy(name, (char *)tfs->buffer_inode + 4, TFS_VOLUMENAME_MAX);
 
     tfs->totalblocks = MIN(disk->total_blocks(disk), 8*TFS_BLOCK_SIZE);
     tfs->disk        = disk;
@@ -196,7 +207,7 @@ int tfs_unmount(fs_t *fs)
 
     /* free semaphore and allocated memory */
     semaphore_destroy(tfs->lock);
-    pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t)fs));
+    tfs_free_memory(fs);
     return VFS_OK;
 }
 
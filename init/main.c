@@ -49,13 +49,20 @@
 #include "kernel/kmalloc.h"
 #include "kernel/panic.h"
 #include "kernel/scheduler.h"
+#include "kernel/stats.h"
+#include "kernel/percpu.h"
+#include "kernel/slab.h"
 #include "kernel/synch.h"
 #include "kernel/thread.h"
+#include "kernel/timerwheel.h"
 #include "lib/debug.h"
 #include "lib/libc.h"
 #include "net/network.h"
+#include "proc/futex.h"
 #include "proc/process.h"
+#include "proc/syscall.h"
 #include "vm/vm.h"
+#include "vm/pagepool.h"
 
 /**
  * Fallback function for system startup. This function is executed
@@ -177,6 +184,12 @@ void init(void)
     kwrite("Initializing memory allocation system\n");
     kmalloc_init();
 
+    kwrite("Initializing per-CPU data\n");
+    percpu_init();
+
+    kwrite("Initializing statistics counters\n");
+    stats_init();
+
     kwrite("Reading boot arguments\n");
     bootargs_init();
 
@@ -201,6 +214,7 @@ void init(void)
 
     kwrite("Initializing user process system\n");
     process_init();
+    syscall_init();
 
     kwrite("Initializing sleep queue\n");
     sleepq_init();
@@ -208,9 +222,15 @@ void init(void)
     kwrite("Initializing semaphores\n");
     semaphore_init();
 
+    kwrite("Initializing futexes\n");
+    futex_init();
+
     kwrite("Initializing device drivers\n");
     device_init();
 
+    kwrite("Initializing timer wheel\n");
+    timerwheel_init();
+
     kprintf("Initializing virtual filesystem\n");
     vfs_init();
 
@@ -220,6 +240,15 @@ void init(void)
     kwrite("Initializing virtual memory\n");
     vm_init();
 
+    kwrite("Initializing kernel object allocator\n");
+    kmem_init();
+
+    kwrite("Starting page zeroing thread\n");
+    pagepool_start_zeroing();
+
+    kwrite("Starting memory reclaim thread\n");
+    pagepool_start_reclaim();
+
     kprintf("Creating initialization thread\n");
     startup_thread = thread_create(&init_startup_thread, 0);
     thread_run(startup_thread);
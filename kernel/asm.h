@@ -43,4 +43,14 @@
         mfc0	reg, PRId, 0; \
 	srl	reg, reg, 24;
 
+/* Get the address of the per-CPU data block (percpu_t) of this cpu
+ * into register reg, using tmp as scratch. Needs kernel/percpu.h. */
+#define _FETCH_PERCPU(reg, tmp) \
+        .set	macro; \
+        la	reg, percpu_area; \
+        .set	nomacro; \
+        _FETCH_CPU_NUM(tmp) \
+        sll	tmp, tmp, PERCPU_SHIFT; \
+        addu	reg, reg, tmp;
+
 #endif /* KERNEL_ASM_H */
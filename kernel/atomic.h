@@ -0,0 +1,15 @@
+/*
+ * Atomic memory operations.
+ */
+
+#ifndef BUENOS_KERNEL_ATOMIC_H
+#define BUENOS_KERNEL_ATOMIC_H
+
+#include "lib/types.h"
+
+/* All operations return the previous value of the word. */
+uint32_t _atomic_cas(uint32_t *ptr, uint32_t old, uint32_t new);
+uint32_t _atomic_swap(uint32_t *ptr, uint32_t value);
+uint32_t _atomic_add(uint32_t *ptr, int delta);
+
+#endif /* BUENOS_KERNEL_ATOMIC_H */
@@ -123,4 +123,31 @@
  */
 #define CONFIG_PIPE_BUFFER_SIZE 3
 
+/* Size of a CPU cache line in bytes. Data written by different CPUs
+ * is kept in separate cache lines to avoid false sharing.
+ */
+#define CONFIG_CACHE_LINE_SIZE 32
+
+/* Maximum number of statistics counters.
+ * Range from 16 to 1024
+ */
+#define CONFIG_MAX_STATS 64
+
+/* Number of pages in the kernel virtual mapping area (vmap) in KSEG2.
+ * Range from 2 to 262144, must be even.
+ */
+#define CONFIG_VMAP_PAGES 4096
+
+/* Uncomment to build instrumented spinlocks which record per-lock
+ * acquisition, contention and hold time statistics. The statistics
+ * are printed at shutdown and can be read with SYSCALL_LOCKSTAT.
+ */
+/* #define CONFIG_SPINLOCK_PROFILE */
+
+/* Maximum number of distinct lock names tracked by the spinlock
+ * profiler. Locks beyond this are not profiled.
+ * Range from 16 to 1024
+ */
+#define CONFIG_SPINLOCK_PROFILE_MAX 64
+
 #endif /* BUENOS_CONFIG_H */
@@ -34,6 +34,8 @@
  *
  */
 #include "kernel/halt.h"
+#include "kernel/spinlock.h"
+#include "kernel/stats.h"
 #include "drivers/metadev.h"
 #include "lib/libc.h"
 #include "fs/vfs.h"
@@ -46,6 +48,11 @@ void halt_kernel(void)
 
     kprintf("Kernel: System shutdown started...\n");
 
+    stats_report();
+
+    /* Prints nothing unless built with CONFIG_SPINLOCK_PROFILE */
+    spinlock_profile_report();
+
     /* Unmount all filesystems */
     vfs_deinit();
 
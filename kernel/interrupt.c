@@ -42,6 +42,9 @@
 #include "kernel/interrupt.h"
 #include "drivers/polltty.h"
 #include "kernel/thread.h"
+#include "kernel/timerwheel.h"
+#include "kernel/stats.h"
+#include "kernel/percpu.h"
 #include "lib/libc.h"
 #include "vm/tlb.h"
 
@@ -51,14 +54,12 @@
 #define INTERRUPT_VECTOR_ADDRESS3 0x80000200
 #define INTERRUPT_VECTOR_LENGTH  8
 
-extern TID_t scheduler_current_thread[CONFIG_MAX_CPUS];
-
-/* Pointers to interrupt stack for each processor */
-uint32_t interrupt_stacks[CONFIG_MAX_CPUS];
-
 /* Table for the registered interrupt handlers */
 static interrupt_entry_t interrupt_handlers[CONFIG_MAX_DEVICES];
 
+/* Statistics counter for handled interrupts */
+static stat_id_t interrupt_stat_count;
+
 
 /** Initializes interrupt handling. Allocates interrupt stacks for
  * each processor, initializes the interrupt vectors and initializes
@@ -81,7 +82,7 @@ void interrupt_init(int num_cpus) {
         ret = (uint32_t)kmalloc(PAGE_SIZE);
         if (ret == 0)
             KERNEL_PANIC("Unable to allocate interrupt stacks");
-        interrupt_stacks[i] = ret+PAGE_SIZE-4;
+        percpu_of(i)->interrupt_stack = ret+PAGE_SIZE-4;
     }
 
     /* Copy the interrupt vector code to its positions.All vectors
@@ -99,6 +100,8 @@ void interrupt_init(int num_cpus) {
 	interrupt_handlers[i].irq = 0;
 	interrupt_handlers[i].handler = NULL;
     }
+
+    interrupt_stat_count = stats_register("interrupts");
 }
 
 
@@ -140,10 +143,11 @@ void interrupt_register(uint32_t irq,
 
 /** Handles an interrupt (exception code 0). All interrupt handlers
  * that are registered for any of the occured interrupts (hardware
- * 0-5, software 0-1) are called. The scheduler is called if a timer
- * interrupt (hardware 5) or a context switch request (software
- * interrupt 0) occured, or if the currently running thread for the
- * processor is the idle thread.
+ * 0-5, software 0-1) are called. On a timer interrupt (hardware 5)
+ * expired kernel timers are run. The scheduler is called if a timer
+ * interrupt or a context switch request (software interrupt 0)
+ * occured, or if the currently running thread for the processor is
+ * the idle thread.
  *
  * @param cause The Cause register from CP0
  */
@@ -156,6 +160,8 @@ void interrupt_handle(uint32_t cause) {
 
     this_cpu = _interrupt_getcpu();
 
+    stats_inc(interrupt_stat_count);
+
     /* Exceptions should be handled elsewhere: */
     if((cause  & 0x0000007c) != 0) {
 	kprintf("Caught exception, cause %.8x, CPU %i\n", cause, this_cpu);
@@ -179,12 +185,22 @@ void interrupt_handle(uint32_t cause) {
     }
 
 
+    /* The CP0 timer is shared between the scheduler and the timer
+     * wheel, so a timer interrupt may mean either has work to do.
+     */
+    if (cause & INTERRUPT_CAUSE_HARDWARE_5)
+        timerwheel_run();
+
+    /* Another CPU may have interrupted this one to shoot down TLB
+       entries (see tlb_shootdown). */
+    tlb_shootdown_handle();
+
     /* Timer interrupt (HW5) or requested context switch (SW0)
      * Also call scheduler if we're running the idle thread.
      */
     if((cause & (INTERRUPT_CAUSE_SOFTWARE_0 |
 		    INTERRUPT_CAUSE_HARDWARE_5)) ||
-        scheduler_current_thread[this_cpu] == IDLE_THREAD_TID) {
+        percpu_of(this_cpu)->current_thread == IDLE_THREAD_TID) {
       scheduler_schedule();
       tlb_fill(thread_get_current_thread_entry()->pagetable);
     }
@@ -136,7 +136,8 @@ void kmalloc_init(void)
     
     system_memory_size = kmalloc_get_numpages() * PAGE_SIZE;
 
-    memory_end = 0x80000000 + system_memory_size;
+    /* Only the memory reachable through KSEG0 can be used here */
+    memory_end = 0x80000000 + MIN(system_memory_size, 0x20000000);
 
     free_area_start = (uint32_t) &KERNEL_ENDS_HERE;
 
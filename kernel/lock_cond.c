@@ -0,0 +1,174 @@
+/*
+ * Locks and condition variables.
+ */
+
+#include "kernel/lock_cond.h"
+#include "kernel/thread.h"
+#include "kernel/interrupt.h"
+#include "kernel/sleepq.h"
+#include "kernel/assert.h"
+
+/** @name Locks and condition variables
+ *
+ * Locks are mutual exclusion locks which put the waiting threads to
+ * sleep instead of spinning. Condition variables allow a thread
+ * holding a lock to atomically release the lock and sleep until the
+ * condition it is waiting for may have become true.
+ *
+ * Both are implemented with the sleep queue, using the address of the
+ * lock or condition variable as the resource. Because the waiting
+ * thread is added to the sleep queue before the lock protecting the
+ * condition is released, a signal sent after the release can not be
+ * lost.
+ *
+ * @{
+ */
+
+/**
+ * Initializes the given lock to the unlocked state.
+ *
+ * @param lock The lock to initialize
+ */
+void lock_reset(lock_t *lock)
+{
+    spinlock_reset(&lock->slock);
+    lock->locked = 0;
+    lock->owner = -1;
+}
+
+/**
+ * Acquires the given lock. If the lock is held by another thread, the
+ * calling thread sleeps until the lock is released. Locks are not
+ * recursive. Must not be called from interrupt handlers.
+ *
+ * @param lock The lock to acquire
+ */
+void lock_acquire(lock_t *lock)
+{
+    interrupt_status_t intr_status;
+    TID_t me = thread_get_current_thread();
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&lock->slock);
+
+    KERNEL_ASSERT(!lock->locked || lock->owner != me);
+
+    while (lock->locked) {
+        sleepq_add(lock);
+        spinlock_release(&lock->slock);
+        thread_switch();
+        spinlock_acquire(&lock->slock);
+    }
+
+    lock->locked = 1;
+    lock->owner = me;
+
+    spinlock_release(&lock->slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Releases the given lock and wakes up one thread waiting for it.
+ * The lock must be held by the calling thread.
+ *
+ * @param lock The lock to release
+ */
+void lock_release(lock_t *lock)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&lock->slock);
+
+    KERNEL_ASSERT(lock->locked && lock->owner == thread_get_current_thread());
+
+    lock->locked = 0;
+    lock->owner = -1;
+    sleepq_wake(lock);
+
+    spinlock_release(&lock->slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Initializes the given condition variable.
+ *
+ * @param cond The condition variable to initialize
+ */
+void condition_init(cond_t *cond)
+{
+    cond->waiters = 0;
+}
+
+/**
+ * Atomically releases the given lock and puts the calling thread to
+ * sleep until the condition is signalled. The lock is re-acquired
+ * before returning. The condition must be re-checked after return,
+ * since another thread may have changed it before the lock was
+ * re-acquired.
+ *
+ * @param cond The condition variable to wait on
+ *
+ * @param lock The lock protecting the condition, held by the caller
+ */
+void condition_wait(cond_t *cond, lock_t *lock)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+
+    cond->waiters++;
+    sleepq_add(cond);
+    lock_release(lock);
+    thread_switch();
+
+    _interrupt_set_state(intr_status);
+
+    lock_acquire(lock);
+    cond->waiters--;
+}
+
+/**
+ * Like condition_wait(), but the condition is protected by a
+ * spinlock. Interrupts must be disabled and the spinlock held when
+ * calling this function. Both are true again when it returns.
+ *
+ * @param cond The condition variable to wait on
+ *
+ * @param slock The spinlock protecting the condition
+ */
+void condition_wait_slock(cond_t *cond, spinlock_t *slock)
+{
+    cond->waiters++;
+    sleepq_add(cond);
+    spinlock_release(slock);
+    thread_switch();
+    spinlock_acquire(slock);
+    cond->waiters--;
+}
+
+/**
+ * Wakes up one thread waiting on the condition variable. The lock
+ * protecting the condition must be held by the caller.
+ *
+ * @param cond The condition variable to signal
+ */
+void condition_signal(cond_t *cond)
+{
+    if (cond->waiters > 0)
+        sleepq_wake(cond);
+}
+
+/**
+ * Wakes up all threads waiting on the condition variable. The lock
+ * protecting the condition must be held by the caller.
+ *
+ * @param cond The condition variable to broadcast
+ */
+void condition_broadcast(cond_t *cond)
+{
+    if (cond->waiters > 0)
+        sleepq_wake_all(cond);
+}
+
+/** @} */
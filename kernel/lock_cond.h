@@ -0,0 +1,35 @@
+/*
+ * Locks and condition variables.
+ */
+
+#ifndef BUENOS_KERNEL_LOCK_COND_H
+#define BUENOS_KERNEL_LOCK_COND_H
+
+#include "kernel/spinlock.h"
+
+/* A sleeping mutual exclusion lock. This header is included by
+ * proc/process.h, so it must not depend on kernel/thread.h. */
+typedef struct {
+    spinlock_t slock;
+    int locked;
+    int owner; /* TID of the holding thread, -1 if not held */
+} lock_t;
+
+/* A condition variable. Every condition variable is used together
+ * with a lock (or a spinlock) protecting the condition, and that lock
+ * must be held when waiting on or signalling the condition. */
+typedef struct {
+    int waiters;
+} cond_t;
+
+void lock_reset(lock_t *lock);
+void lock_acquire(lock_t *lock);
+void lock_release(lock_t *lock);
+
+void condition_init(cond_t *cond);
+void condition_wait(cond_t *cond, lock_t *lock);
+void condition_wait_slock(cond_t *cond, spinlock_t *slock);
+void condition_signal(cond_t *cond);
+void condition_broadcast(cond_t *cond);
+
+#endif /* BUENOS_KERNEL_LOCK_COND_H */
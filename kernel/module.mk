@@ -6,7 +6,9 @@ MODULE := kernel
 
 FILES := cswitch.S panic.c kmalloc.c interrupt.c thread.c \
          scheduler.c _interrupt.S _spinlock.S idle.S sleepq.c semaphore.c \
-         exception.c halt.c
+         exception.c halt.c lock_cond.c timerwheel.c \
+         spinlock_profile.c _atomic.S mpscq.c \
+         stats.c percpu.c slab.c
 
 SRC += $(patsubst %, $(MODULE)/%, $(FILES))
 
@@ -0,0 +1,87 @@
+/*
+ * Lock-free multiple producer, single consumer queue.
+ */
+
+#include "kernel/mpscq.h"
+#include "kernel/atomic.h"
+
+/** @name MPSC queue
+ *
+ * A queue any number of CPUs can push to without locks, and which
+ * one consumer empties in a single operation. Producers push nodes
+ * onto a singly linked stack with an LL/SC compare-and-swap of the
+ * head. The consumer swaps the whole stack out and reverses it, so
+ * nodes are handed out in the order they were pushed.
+ *
+ * Since the consumer never removes single nodes, a node cannot be
+ * removed and pushed again between a producer's read of the head and
+ * its compare-and-swap, so the queue is free of the ABA problem. A
+ * node must not be pushed again before the consumer has taken it.
+ *
+ * @{
+ */
+
+/**
+ * Initializes the queue to empty.
+ *
+ * @param queue The queue
+ */
+void mpscq_init(mpscq_t *queue)
+{
+    queue->head = NULL;
+}
+
+/**
+ * Adds a node to the queue. Safe to call from any CPU, also from
+ * interrupt handlers.
+ *
+ * @param queue The queue
+ *
+ * @param node The node to add, not currently in any queue
+ *
+ * @return 1 if the queue was empty before the push, 0 otherwise.
+ */
+int mpscq_push(mpscq_t *queue, mpscq_node_t *node)
+{
+    mpscq_node_t *head;
+
+    do {
+        head = queue->head;
+        node->next = head;
+    } while ((mpscq_node_t *)_atomic_cas((uint32_t *)&queue->head,
+                                         (uint32_t)head,
+                                         (uint32_t)node) != head);
+
+    return head == NULL;
+}
+
+/**
+ * Removes all nodes from the queue. Must only be called by the
+ * consumer of the queue.
+ *
+ * @param queue The queue
+ *
+ * @return The removed nodes in push order linked through next, or
+ * NULL if the queue was empty.
+ */
+mpscq_node_t *mpscq_take_all(mpscq_t *queue)
+{
+    mpscq_node_t *node, *next, *list = NULL;
+
+    if (queue->head == NULL)
+        return NULL;
+
+    node = (mpscq_node_t *)_atomic_swap((uint32_t *)&queue->head, 0);
+
+    /* Reverse the stack into push order */
+    while (node != NULL) {
+        next = node->next;
+        node->next = list;
+        list = node;
+        node = next;
+    }
+
+    return list;
+}
+
+/** @} */
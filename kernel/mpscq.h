@@ -0,0 +1,23 @@
+/*
+ * Lock-free multiple producer, single consumer queue.
+ */
+
+#ifndef BUENOS_KERNEL_MPSCQ_H
+#define BUENOS_KERNEL_MPSCQ_H
+
+#include "lib/types.h"
+
+/* Queue link, embedded in the queued object */
+typedef struct mpscq_node_struct {
+    struct mpscq_node_struct *next;
+} mpscq_node_t;
+
+typedef struct {
+    mpscq_node_t *head; /* most recently pushed node */
+} mpscq_t;
+
+void mpscq_init(mpscq_t *queue);
+int mpscq_push(mpscq_t *queue, mpscq_node_t *node);
+mpscq_node_t *mpscq_take_all(mpscq_t *queue);
+
+#endif /* BUENOS_KERNEL_MPSCQ_H */
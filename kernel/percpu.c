@@ -0,0 +1,50 @@
+/*
+ * Per-CPU data area.
+ */
+
+#include "kernel/percpu.h"
+#include "kernel/assert.h"
+
+/** @name Per-CPU data
+ *
+ * Data used by one CPU only is kept in a per-CPU data block instead
+ * of in arrays indexed by the CPU number. Arrays of words pack the
+ * slots of all CPUs into one cache line, so every CPU updating its
+ * own slot (e.g. the current thread on each context switch) would
+ * invalidate the line in the caches of all other CPUs. The blocks are
+ * aligned to their own size, which is a power of two and a multiple
+ * of the cache line size, so no two CPUs ever share a cache line.
+ * Within a block, the queues other CPUs push to are on a separate
+ * line from the fields only the owner writes.
+ *
+ * The block of the running CPU is found by shifting the CPU number
+ * from the CP0 PRId register; see _FETCH_PERCPU in kernel/asm.h.
+ *
+ * @{
+ */
+
+percpu_t percpu_area[CONFIG_MAX_CPUS];
+
+/**
+ * Initializes the per-CPU data blocks of all CPUs. Called once at
+ * boot before any other subsystem uses them.
+ */
+void percpu_init(void)
+{
+    int i;
+
+    /* kernel/cswitch.S indexes the blocks with a shift and knows
+       the offsets of the first fields. */
+    KERNEL_ASSERT(sizeof(percpu_t) == PERCPU_SIZE);
+    KERNEL_ASSERT((uint32_t)&percpu_area[0].interrupt_stack
+                  - (uint32_t)&percpu_area[0] == PERCPU_INTERRUPT_STACK);
+
+    for (i = 0; i < CONFIG_MAX_CPUS; i++) {
+        percpu_area[i].current_thread = 0;
+        percpu_area[i].interrupt_stack = 0;
+        mpscq_init(&percpu_area[i].wake_queue);
+        mpscq_init(&percpu_area[i].work_queue);
+    }
+}
+
+/** @} */
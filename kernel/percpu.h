@@ -0,0 +1,72 @@
+/*
+ * Per-CPU data area.
+ */
+
+#ifndef BUENOS_KERNEL_PERCPU_H
+#define BUENOS_KERNEL_PERCPU_H
+
+#include "kernel/config.h"
+
+/* Each CPU has a block of 2^PERCPU_SHIFT bytes, big enough for a
+ * cache line of scheduling data, a cache line of queues and the
+ * statistics counters. The assembly code finds the block of the
+ * running CPU by shifting the CPU number. */
+#define PERCPU_DATA_SIZE (2 * CONFIG_CACHE_LINE_SIZE + CONFIG_MAX_STATS * 4)
+#if PERCPU_DATA_SIZE <= 256
+#define PERCPU_SHIFT 8
+#elif PERCPU_DATA_SIZE <= 512
+#define PERCPU_SHIFT 9
+#elif PERCPU_DATA_SIZE <= 1024
+#define PERCPU_SHIFT 10
+#elif PERCPU_DATA_SIZE <= 2048
+#define PERCPU_SHIFT 11
+#else
+#define PERCPU_SHIFT 13
+#endif
+
+#define PERCPU_SIZE (1 << PERCPU_SHIFT)
+
+/* Offsets of the fields used by kernel/cswitch.S */
+#define PERCPU_CURRENT_THREAD 0
+#define PERCPU_INTERRUPT_STACK 4
+
+#ifndef __ASSEMBLER__
+
+#include "lib/types.h"
+#include "kernel/thread.h"
+#include "kernel/mpscq.h"
+#include "kernel/interrupt.h"
+
+typedef struct {
+    /* Thread currently running on this CPU. Written by this CPU only,
+       other CPUs read it to find idle CPUs (see scheduler_wake). */
+    TID_t current_thread;
+    /* Top of the interrupt stack of this CPU */
+    uint32_t interrupt_stack;
+
+    /* Threads woken on this CPU, waiting to be put on the ready list.
+       Other CPUs push to the queues, so they are on a cache line of
+       their own, away from the fields above. */
+    mpscq_t wake_queue __attribute__((aligned(CONFIG_CACHE_LINE_SIZE)));
+    /* Work deferred to this CPU */
+    mpscq_t work_queue;
+
+    /* Statistics counter slots of this CPU, on their own cache lines */
+    uint32_t stats[CONFIG_MAX_STATS]
+        __attribute__((aligned(CONFIG_CACHE_LINE_SIZE)));
+} __attribute__((aligned(PERCPU_SIZE))) percpu_t;
+
+extern percpu_t percpu_area[CONFIG_MAX_CPUS];
+
+/* Per-CPU data block of the given CPU */
+#define percpu_of(cpu) (&percpu_area[(cpu)])
+
+/* Per-CPU data block of the running CPU. Interrupts must be disabled,
+ * or the thread may move to another CPU while using the block. */
+#define percpu_this() percpu_of(_interrupt_getcpu())
+
+void percpu_init(void);
+
+#endif /* __ASSEMBLER__ */
+
+#endif /* BUENOS_KERNEL_PERCPU_H */
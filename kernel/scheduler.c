@@ -34,6 +34,7 @@
  *
  */
 
+#include "kernel/scheduler.h"
 #include "kernel/thread.h"
 #include "kernel/spinlock.h"
 #include "kernel/assert.h"
@@ -41,7 +42,14 @@
 #include "kernel/interrupt.h"
 #include "lib/libc.h"
 #include "kernel/config.h"
+#include "kernel/timerwheel.h"
+#include "kernel/atomic.h"
+#include "kernel/stats.h"
+#include "kernel/percpu.h"
 #include "drivers/timer.h"
+#include "drivers/device.h"
+#include "drivers/metadev.h"
+#include "drivers/yams.h"
 
 /** @name Scheduler
  *
@@ -53,22 +61,31 @@
 extern spinlock_t thread_table_slock;
 extern thread_table_t thread_table[CONFIG_MAX_THREADS];
 
-/** Currently running thread on each CPU */
-TID_t scheduler_current_thread[CONFIG_MAX_CPUS];
-
 /** List of threads ready to be run. */
 static struct {
     TID_t head; /* the first thread in ready to run queue, negative if none */
     TID_t tail; /* the last thread in ready to run queue, negative if none */
 } scheduler_ready_to_run = {-1, -1};
 
+/** Statistics counters */
+static stat_id_t scheduler_stat_switches;
+static stat_id_t scheduler_stat_wakeups;
+static stat_id_t scheduler_stat_wake_ipis;
+
+/** Number of CPUs in the system */
+static int scheduler_num_cpus;
+
 /**
- * Initializes the scheduler current thread table to 0 for each processor.
+ * Initializes the scheduler. The current thread, wake-up queue and
+ * deferred work queue of each processor live in its per-CPU data
+ * block and are initialized by percpu_init.
  */
 void scheduler_init(void) {
-    int i;
-    for (i=0; i<CONFIG_MAX_CPUS; i++)
-	scheduler_current_thread[i] = 0;
+    scheduler_num_cpus = cpustatus_count();
+
+    scheduler_stat_switches = stats_register("context switches");
+    scheduler_stat_wakeups = stats_register("wake-ups");
+    scheduler_stat_wake_ipis = stats_register("wake-up interrupts");
 }
 
 /**
@@ -103,7 +120,8 @@ void scheduler_add_to_ready_list(TID_t t)
 
 /**
  * Removes the thread from the ready to run list with the lowest deadline
- * and returns it. if the list was empty, returns the idle thread (TID 0).
+ * and returns it. Background threads are only chosen if no other
+ * thread is ready. if the list was empty, returns the idle thread (TID 0).
  * It is assumed that interrupts are disabled and thread table spinlock
  * is held when this function is called.
  *
@@ -117,17 +135,28 @@ static TID_t scheduler_remove_by_deadline(void)
   TID_t urgent_t;
   TID_t prev;
   TID_t new_prev;
+  TID_t background_t;
+  TID_t background_prev;
   prev = -1;
   new_prev = -1;
+  urgent_t = -1;
+  background_t = -1;
+  background_prev = -1;
   t = scheduler_ready_to_run.head;
-  urgent_t = t;
   // Idle thread should never be on the ready list.
   KERNEL_ASSERT(t != IDLE_THREAD_TID);
   // Loop through the threads in ready queue, and find most urgent
   while (t >= 0) {
     KERNEL_ASSERT(thread_table[t].state == THREAD_READY);
-    if (thread_table[t].deadline >= 0 &&
-        thread_table[urgent_t].deadline > thread_table[t].deadline){
+    if (thread_table[t].background) {
+      // Remember the first background thread in case nothing else is ready.
+      if (background_t < 0) {
+        background_t = t;
+        background_prev = prev;
+      }
+    } else if (urgent_t < 0 ||
+               (thread_table[t].deadline >= 0 &&
+                thread_table[urgent_t].deadline > thread_table[t].deadline)){
       urgent_t = t;
       // We need the previous one in the list so we can link it together
       // if we take something that is not at either the head or tail.
@@ -137,17 +166,21 @@ static TID_t scheduler_remove_by_deadline(void)
     t = thread_table[t].next;
   }
 
+  if (urgent_t < 0) {
+    urgent_t = background_t;
+    new_prev = background_prev;
+  }
+
   if (urgent_t < 0) return IDLE_THREAD_TID;
 
-  if (urgent_t == scheduler_ready_to_run.head) {
-    scheduler_ready_to_run.head = thread_table[scheduler_ready_to_run.head].next;
-  }
-  if  (urgent_t == scheduler_ready_to_run.tail) {
-    scheduler_ready_to_run.tail = new_prev;
-    if (new_prev >= 0) thread_table[new_prev].next = -1;
+  if (new_prev < 0) {
+    scheduler_ready_to_run.head = thread_table[urgent_t].next;
   } else {
     thread_table[new_prev].next = thread_table[urgent_t].next;
   }
+  if (urgent_t == scheduler_ready_to_run.tail) {
+    scheduler_ready_to_run.tail = new_prev;
+  }
   return urgent_t;
 }
 
@@ -215,6 +248,126 @@ void scheduler_add_ready(TID_t t)
 }
 
 
+/* Chooses the CPU whose wake-up queue gets a woken thread: this CPU
+ * if it is idle, otherwise an idle CPU, which is interrupted so that
+ * it schedules right away, otherwise this CPU. If no CPU is idle the
+ * thread waits for the next timer interrupt of this CPU, as any other
+ * CPU would have to finish a timeslice first as well. The idle state
+ * is read without locks: a CPU which has just picked a thread drains
+ * the queue at its next scheduling instead. Interrupts must be
+ * disabled. */
+static int scheduler_wake_target(void)
+{
+    int this_cpu, i;
+
+    this_cpu = _interrupt_getcpu();
+    if (percpu_of(this_cpu)->current_thread == IDLE_THREAD_TID)
+	return this_cpu;
+
+    for (i = 0; i < scheduler_num_cpus; i++) {
+	if (i != this_cpu &&
+	    *(volatile TID_t *)&percpu_of(i)->current_thread
+	    == IDLE_THREAD_TID)
+	    return i;
+    }
+
+    return this_cpu;
+}
+
+/**
+ * Makes a sleeping thread runnable. The caller must have removed the
+ * thread from the sleep queue and cleared its sleeps_on field. The
+ * thread is pushed to the wake-up queue of a CPU without taking any
+ * locks, and is moved to the ready list the next time the scheduler
+ * runs on that CPU. An idle CPU is preferred and is interrupted to
+ * run the scheduler at once (see scheduler_wake_target). A thread
+ * which has not yet switched away (is still running) simply continues
+ * when the scheduler sees its sleeps_on cleared. Interrupts must be
+ * disabled.
+ *
+ * @param t The thread to wake up
+ */
+void scheduler_wake(TID_t t)
+{
+    int cpu;
+
+    /* A thread already in a wake-up queue is handled when that queue
+       is drained, since its sleeps_on has been cleared by now. */
+    stats_inc(scheduler_stat_wakeups);
+
+    if (_atomic_swap(&thread_table[t].wake_queued, 1) != 0)
+	return;
+
+    cpu = scheduler_wake_target();
+    mpscq_push(&percpu_of(cpu)->wake_queue, &thread_table[t].wake_node);
+
+    /* An idle CPU runs the scheduler on any interrupt */
+    if (cpu != _interrupt_getcpu()) {
+	cpustatus_generate_irq(device_get(YAMS_TYPECODE_CPUSTATUS, cpu));
+	stats_inc(scheduler_stat_wake_ipis);
+    }
+}
+
+/**
+ * Requests work->func(work->arg) to be called by the scheduler of the
+ * given CPU, the next time it runs. The call is made with interrupts
+ * disabled and no locks held. The work item must not be queued again
+ * before the call has been made. Can be called from anywhere,
+ * including interrupt handlers.
+ *
+ * @param cpu The CPU to run the work on
+ *
+ * @param work The work item
+ */
+void scheduler_defer_work(int cpu, deferred_work_t *work)
+{
+    KERNEL_ASSERT(cpu >= 0 && cpu < CONFIG_MAX_CPUS);
+    mpscq_push(&percpu_of(cpu)->work_queue, &work->node);
+}
+
+/* Runs the deferred work of this CPU. */
+static void scheduler_run_deferred_work(int this_cpu)
+{
+    mpscq_node_t *node, *next;
+    deferred_work_t *work;
+
+    node = mpscq_take_all(&percpu_of(this_cpu)->work_queue);
+    while (node != NULL) {
+	/* The item may be queued again by the call */
+	next = node->next;
+	work = (deferred_work_t *)node;
+	work->func(work->arg);
+	node = next;
+    }
+}
+
+/* Moves the threads woken on this CPU to the ready list. The thread
+ * table spinlock must be held. */
+static void scheduler_drain_wake_queue(int this_cpu)
+{
+    mpscq_node_t *node, *next;
+    TID_t t;
+
+    node = mpscq_take_all(&percpu_of(this_cpu)->wake_queue);
+    while (node != NULL) {
+	next = node->next;
+	t = (TID_t)(((uint32_t)node - (uint32_t)&thread_table[0].wake_node)
+		    / sizeof(thread_table_t));
+
+	/* Clear the flag before checking the state: a wake-up after
+	   this point queues the thread again. */
+	thread_table[t].wake_queued = 0;
+
+	if (thread_table[t].state == THREAD_SLEEPING
+	    && thread_table[t].sleeps_on == 0) {
+	    thread_table[t].state = THREAD_READY;
+	    scheduler_add_to_ready_list(t);
+	}
+
+	node = next;
+    }
+}
+
 /**
  * Select next thread for running. Removes the currently running
  * thread running on this CPU and selects new running thread.
@@ -225,11 +378,13 @@ void scheduler_add_ready(TID_t t)
  * Scheduler also handles thread table row freeing when thread is
  * DYING and removes threads wishing to sleep (sleeps_on != 0) from
  * ready status and places them SLEEPING. Syncronizes access to thread
- * table by acquiring the thread table spinlock.
+ * table by acquiring the thread table spinlock. Before selecting the
+ * next thread, the deferred work of this CPU is run and the threads
+ * woken on this CPU are put on the ready list.
  *
  * After selecting new thread for running the scheduler will reset the
  * CP0 timer to cause timer interrupt after thread's timeslice is
- * over.
+ * over, or earlier if a kernel timer expires before that.
  *
  */
 
@@ -237,21 +392,27 @@ void scheduler_schedule(void)
 {
     TID_t t;
     thread_table_t *current_thread;
+    percpu_t *percpu;
     int this_cpu;
 
     this_cpu = _interrupt_getcpu();
+    percpu = percpu_of(this_cpu);
+
+    scheduler_run_deferred_work(this_cpu);
 
     spinlock_acquire(&thread_table_slock);
 
-    current_thread = &(thread_table[scheduler_current_thread[this_cpu]]);
+    scheduler_drain_wake_queue(this_cpu);
+
+    current_thread = &(thread_table[percpu->current_thread]);
 
     if(current_thread->state == THREAD_DYING) {
 	current_thread->state = THREAD_FREE;
     } else if(current_thread->sleeps_on != 0) {
 	current_thread->state = THREAD_SLEEPING;
     } else {
-	if(scheduler_current_thread[this_cpu] != IDLE_THREAD_TID)
-	    scheduler_add_to_ready_list(scheduler_current_thread[this_cpu]);
+	if(percpu->current_thread != IDLE_THREAD_TID)
+	    scheduler_add_to_ready_list(percpu->current_thread);
 	current_thread->state = THREAD_READY;
     }
 
@@ -260,9 +421,14 @@ void scheduler_schedule(void)
 
     spinlock_release(&thread_table_slock);
 
-    scheduler_current_thread[this_cpu] = t;
+    if (t != percpu->current_thread)
+	stats_inc(scheduler_stat_switches);
+
+    percpu->current_thread = t;
 
-    /* Schedule timer interrupt to occur after thread timeslice is spent */
-    timer_set_ticks(_get_rand(CONFIG_SCHEDULER_TIMESLICE) + 
-                    CONFIG_SCHEDULER_TIMESLICE / 2);
+    /* Schedule timer interrupt to occur after thread timeslice is
+       spent or when the next kernel timer is due */
+    timer_set_ticks(timerwheel_next_ticks(
+                        _get_rand(CONFIG_SCHEDULER_TIMESLICE) +
+                        CONFIG_SCHEDULER_TIMESLICE / 2));
 }
@@ -38,10 +38,20 @@
 #define BUENOS_KERNEL_SCHEDULER_H
 
 #include "kernel/thread.h"
+#include "kernel/mpscq.h"
+
+/* A function call deferred to the scheduler of a given CPU */
+typedef struct {
+    mpscq_node_t node;
+    void (*func)(uint32_t);
+    uint32_t arg;
+} deferred_work_t;
 
 /* function definitions */
 void scheduler_init(void);
 void scheduler_add_ready(TID_t t);
+void scheduler_wake(TID_t t);
+void scheduler_defer_work(int cpu, deferred_work_t *work);
 void scheduler_schedule(void);
 
 #endif /* BUENOS_KERNEL_SCHEDULER_H */
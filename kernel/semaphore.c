@@ -40,6 +40,7 @@
 #include "kernel/config.h"
 #include "kernel/assert.h"
 #include "lib/libc.h"
+#include "vm/pagepool.h"
 
 /** @name Semaphores
  *
@@ -48,10 +49,17 @@
  * @{
  */
 
-/** Table containing all semaphores in the system */
+/** Table containing the initial semaphores of the system. More are
+ * allocated from the page pool when these run out. */
 static semaphore_t semaphore_table[CONFIG_MAX_SEMAPHORES];
 
-/** Lock which must be held before accessing the semaphore_table */
+/** Number of semaphores that fit in one page from the page pool */
+#define SEMAPHORES_PER_PAGE (PAGE_SIZE / sizeof(semaphore_t))
+
+/** Free semaphores, linked through next_free */
+static semaphore_t *semaphore_free_list;
+
+/** Lock which must be held before accessing the free list */
 static spinlock_t semaphore_table_slock;
 
 /**
@@ -64,17 +72,59 @@ void semaphore_init(void)
     int i;
 
     spinlock_reset(&semaphore_table_slock);
-    for(i = 0; i < CONFIG_MAX_SEMAPHORES; i++)
+    semaphore_free_list = NULL;
+    for(i = CONFIG_MAX_SEMAPHORES - 1; i >= 0; i--) {
         semaphore_table[i].creator = -1;
+        semaphore_table[i].next_free = semaphore_free_list;
+        semaphore_free_list = &semaphore_table[i];
+    }
 }
 
 /**
- * Creates a semaphore. The actual creation is done by reserving
- * a semaphore from the semaphore table.
+ * Adds a page worth of semaphores to the free list. The pages are
+ * never returned to the page pool.
+ *
+ * @return 1 on success, 0 if the page pool is exhausted.
+ */
+
+static int semaphore_grow(void)
+{
+    interrupt_status_t intr_status;
+    semaphore_t *page;
+    uint32_t phys;
+    int i;
+
+    phys = pagepool_get_phys_page();
+    if (phys == 0)
+        return 0;
+
+    page = (semaphore_t *)ADDR_PHYS_TO_KERNEL(phys);
+    for (i = 0; i < (int)SEMAPHORES_PER_PAGE - 1; i++) {
+        page[i].creator = -1;
+        page[i].next_free = &page[i + 1];
+    }
+    page[i].creator = -1;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&semaphore_table_slock);
+
+    page[i].next_free = semaphore_free_list;
+    semaphore_free_list = page;
+
+    spinlock_release(&semaphore_table_slock);
+    _interrupt_set_state(intr_status);
+
+    return 1;
+}
+
+/**
+ * Creates a semaphore. The actual creation is done by taking a
+ * semaphore from the free list, which is refilled from the page pool
+ * when it runs empty.
  *
  * @param value Initial value of the created semaphore
  *
- * @return Pointer to the created semaphore
+ * @return Pointer to the created semaphore, NULL if out of memory
  *
  * @see semaphore_destroy
  */
@@ -82,49 +132,77 @@ void semaphore_init(void)
 semaphore_t *semaphore_create(int value)
 {
     interrupt_status_t intr_status;
-    static int next = 0;
-    int i;
-    int sem_id;
+    semaphore_t *sem;
 
     KERNEL_ASSERT(value >= 0);
 
-    intr_status = _interrupt_disable();
-    spinlock_acquire(&semaphore_table_slock);
+    for (;;) {
+        intr_status = _interrupt_disable();
+        spinlock_acquire(&semaphore_table_slock);
 
-    /* Find free semaphore from semaphore table */
-    for(i = 0; i < CONFIG_MAX_SEMAPHORES; i++) {
-        sem_id = next;
-        next = (next + 1) % CONFIG_MAX_SEMAPHORES;
-        if (semaphore_table[sem_id].creator == -1) {
-            semaphore_table[sem_id].creator = thread_get_current_thread();
-            break;
+        sem = semaphore_free_list;
+        if (sem != NULL) {
+            semaphore_free_list = sem->next_free;
+            sem->creator = thread_get_current_thread();
         }
-    }
 
-    spinlock_release(&semaphore_table_slock);
-    _interrupt_set_state(intr_status);
+        spinlock_release(&semaphore_table_slock);
+        _interrupt_set_state(intr_status);
 
-    if (i == CONFIG_MAX_SEMAPHORES) {
-	/* semaphore table does not have any free semaphores, creation fails */
-        return NULL;
+        if (sem != NULL)
+            break;
+
+        /* Free list is empty, add a page of semaphores and retry */
+        if (!semaphore_grow())
+            return NULL;
     }
 
-    semaphore_table[sem_id].value = value;
-    spinlock_reset(&semaphore_table[sem_id].slock);
+    sem->value = value;
+    sem->handoffs = 0;
+    sem->next_free = NULL;
+    spinlock_reset(&sem->slock);
 
-    return &semaphore_table[sem_id];
+    return sem;
 }
 
 /**
  * Free given semaphore. Semaphore sem is freed for later
- * re-creation by semaphore_create.
+ * re-creation by semaphore_create. A semaphore which has threads
+ * waiting on it is not freed.
  *
  * @param sem Semaphore to free (destroy)
+ *
+ * @return 0 if the semaphore was freed, -1 if threads are waiting
+ * on it.
  */
 
-void semaphore_destroy(semaphore_t *sem)
+int semaphore_destroy(semaphore_t *sem)
 {
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&sem->slock);
+
+    /* Timed out waiters which have not yet withdrawn count too */
+    if (sem->value < 0 || sem->handoffs > 0) {
+        spinlock_release(&sem->slock);
+        _interrupt_set_state(intr_status);
+        return -1;
+    }
+
     sem->creator = -1;
+    spinlock_release(&sem->slock);
+
+    /* The lock word is reset when the semaphore is reused, so it must
+       not be held once the semaphore is on the free list */
+    spinlock_acquire(&semaphore_table_slock);
+    sem->next_free = semaphore_free_list;
+    semaphore_free_list = sem;
+    spinlock_release(&semaphore_table_slock);
+
+    _interrupt_set_state(intr_status);
+
+    return 0;
 }
 
 /**
@@ -157,6 +235,52 @@ void semaphore_P(semaphore_t *sem)
     _interrupt_set_state(intr_status);
 }
 
+/**
+ * Like semaphore_P, but gives up if the semaphore could not be
+ * lowered within msec milliseconds. This function must not be called
+ * by interrupt handlers.
+ *
+ * @param sem Semaphore to lower by one.
+ *
+ * @param msec Maximum time to wait in milliseconds.
+ *
+ * @return 1 if the semaphore was lowered, 0 on timeout.
+ */
+
+int semaphore_P_timeout(semaphore_t *sem, uint32_t msec)
+{
+    interrupt_status_t intr_status;
+    int acquired = 1;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&sem->slock);
+
+    sem->value--;
+    if (sem->value < 0) {
+        sleepq_add_timeout(sem, msec);
+        spinlock_release(&sem->slock);
+        thread_switch();
+
+        if (sleepq_timeout_expired()) {
+            spinlock_acquire(&sem->slock);
+            /* A V which found no sleeper was meant for a waiter that
+               timed out, take it instead of withdrawing. */
+            if (sem->handoffs > 0) {
+                sem->handoffs--;
+            } else {
+                sem->value++;
+                acquired = 0;
+            }
+            spinlock_release(&sem->slock);
+        }
+    } else {
+        spinlock_release(&sem->slock);
+    }
+    _interrupt_set_state(intr_status);
+
+    return acquired;
+}
+
 /**
  * Increases the value of the semaphore sem by one. Wakes up
  * one waiter, if needed. 
@@ -177,7 +301,9 @@ void semaphore_V(semaphore_t *sem)
 
     sem->value++;
     if (sem->value <= 0) {
-        sleepq_wake(sem);
+        /* No sleeper means a waiter timed out but has not withdrawn */
+        if (!sleepq_wake(sem))
+            sem->handoffs++;
     }
 
     spinlock_release(&sem->slock);
@@ -40,16 +40,23 @@
 #include "kernel/spinlock.h"
 #include "kernel/thread.h"
 
-typedef struct {
+typedef struct semaphore_struct {
     spinlock_t slock;
     int value;
+    /* Creating thread, -1 if the semaphore is free */
     TID_t creator;
+    /* Next semaphore in the free list */
+    struct semaphore_struct *next_free;
+    /* V operations handed to timed out waiters which have not yet
+       withdrawn from the semaphore */
+    int handoffs;
 } semaphore_t;
 
 void semaphore_init(void);
 semaphore_t *semaphore_create(int value);
-void semaphore_destroy(semaphore_t *sem);
+int semaphore_destroy(semaphore_t *sem);
 void semaphore_P(semaphore_t *sem);
+int semaphore_P_timeout(semaphore_t *sem, uint32_t msec);
 void semaphore_V(semaphore_t *sem);
 
 #endif /* BUENOS_KERNEL_SEMAPHORE_H */
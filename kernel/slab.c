@@ -0,0 +1,468 @@
+/*
+ * Slab allocator for kernel objects.
+ */
+
+#include "kernel/slab.h"
+#include "kernel/interrupt.h"
+#include "kernel/assert.h"
+#include "kernel/atomic.h"
+#include "kernel/scheduler.h"
+#include "vm/pagepool.h"
+#include "drivers/metadev.h"
+#include "lib/libc.h"
+
+/** @name Slab allocator
+ *
+ * Allocation of small kernel objects after kmalloc has been disabled
+ * by vm_init. Objects of one size are grouped in a cache, and the
+ * cache carves pages from the page pool into slabs of equal sized
+ * objects. A slab is one page with a header in its beginning, so the
+ * slab of an object is found by rounding its address down to the
+ * page boundary.
+ *
+ * Each CPU keeps a few free objects of every cache, so most
+ * allocations and frees only disable interrupts and touch the data
+ * of the local CPU. Only when the CPU runs out of free objects, or has
+ * too many, is the cache locked and a batch of objects moved between
+ * the CPU and the slabs.
+ *
+ * Under memory pressure the page pool asks the caches for their empty
+ * slabs, see kmem_shrink. New slabs are allocated with no locks held,
+ * since the page pool may have to reclaim memory to find a page, so
+ * the allocators must not be called with spinlocks held.
+ *
+ * kmem_alloc and kmem_free serve arbitrary sizes up to a page from a
+ * set of power of two size classes. Requests bigger than the largest
+ * class get a whole page.
+ *
+ * The returned memory is in KSEG0, so ADDR_KERNEL_TO_PHYS gives its
+ * physical address, e.g. for disk buffers.
+ *
+ * @{
+ */
+
+/* Header in the beginning of each slab page */
+typedef struct kmem_slab_struct {
+    kmem_cache_t *cache;
+    /* Links in the partial list of the cache */
+    struct kmem_slab_struct *next;
+    struct kmem_slab_struct *prev;
+    /* Free objects, linked through their first word */
+    void *free;
+    /* Number of allocated objects, including those held by CPUs */
+    int inuse;
+} kmem_slab_t;
+
+/* Offset of the first object in a slab, keeps objects 8 byte aligned */
+#define KMEM_SLAB_HEADER ((sizeof(kmem_slab_t) + 7) & ~7)
+
+#define KMEM_SLAB_OF(obj) \
+    ((kmem_slab_t *)((uint32_t)(obj) & ~(PAGE_SIZE - 1)))
+
+/* Size classes of kmem_alloc: 16, 32, ..., 1024 bytes */
+#define KMEM_MIN_SHIFT 4
+#define KMEM_CLASSES 7
+#define KMEM_MAX_SIZE (1 << (KMEM_MIN_SHIFT + KMEM_CLASSES - 1))
+
+static kmem_cache_t kmem_classes[KMEM_CLASSES];
+
+static const char *kmem_class_names[KMEM_CLASSES] = {
+    "kmem-16", "kmem-32", "kmem-64", "kmem-128",
+    "kmem-256", "kmem-512", "kmem-1024"
+};
+
+/* All caches, for the shrinker */
+static kmem_cache_t *kmem_caches = NULL;
+static spinlock_t kmem_caches_slock;
+
+static int kmem_shrink(int pages);
+static void kmem_drain_cpu(uint32_t cpu);
+
+/* Requests to return the free objects held by a CPU to their slabs,
+   run by the scheduler of that CPU (see kmem_shrink). pending is 1
+   while the request is queued. */
+static struct {
+    deferred_work_t work;
+    uint32_t pending;
+} kmem_drains[CONFIG_MAX_CPUS];
+
+static int kmem_num_cpus;
+
+/* Empty slabs are cheap to give back, they only cost a new page and
+   building the free list when the cache grows again. */
+static pagepool_shrinker_t kmem_shrinker = { "slab caches", 1, &kmem_shrink, NULL };
+
+/**
+ * Initializes an object cache. No memory is allocated until the
+ * first object is.
+ *
+ * @param cache Storage for the cache
+ *
+ * @param name Name of the cache, must stay valid forever
+ *
+ * @param size Size of the objects in bytes
+ */
+void kmem_cache_init(kmem_cache_t *cache, const char *name, int size)
+{
+    interrupt_status_t intr_status;
+    int i;
+
+    /* Free objects hold the free list link */
+    if (size < (int)sizeof(void *))
+        size = sizeof(void *);
+    size = (size + 3) & ~3;
+
+    KERNEL_ASSERT(size <= (int)(PAGE_SIZE - KMEM_SLAB_HEADER));
+
+    cache->name = name;
+    cache->size = size;
+    cache->per_slab = (PAGE_SIZE - KMEM_SLAB_HEADER) / size;
+
+    spinlock_reset(&cache->slock);
+    cache->partial = NULL;
+    cache->empty_slabs = 0;
+
+    for (i = 0; i < CONFIG_MAX_CPUS; i++)
+        cache->cpu[i].count = 0;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&kmem_caches_slock);
+    cache->next = kmem_caches;
+    kmem_caches = cache;
+    spinlock_release(&kmem_caches_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/* Links the slab to the head of the partial list. */
+static void kmem_slab_link(kmem_cache_t *cache, kmem_slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = cache->partial;
+    if (slab->next != NULL)
+        slab->next->prev = slab;
+    cache->partial = slab;
+}
+
+/* Unlinks the slab from the partial list. */
+static void kmem_slab_unlink(kmem_cache_t *cache, kmem_slab_t *slab)
+{
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        cache->partial = slab->next;
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+}
+
+/* Builds a new slab in the given physical page and puts it on the
+ * partial list. The cache must be locked. */
+static void kmem_slab_create(kmem_cache_t *cache, uint32_t phys)
+{
+    kmem_slab_t *slab;
+    uint32_t obj;
+    int i;
+
+    slab = (kmem_slab_t *)ADDR_PHYS_TO_KERNEL(phys);
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free = NULL;
+
+    /* Build the free list so that objects are handed out in address
+       order */
+    for (i = cache->per_slab - 1; i >= 0; i--) {
+        obj = (uint32_t)slab + KMEM_SLAB_HEADER + i * cache->size;
+        *(void **)obj = slab->free;
+        slab->free = (void *)obj;
+    }
+
+    kmem_slab_link(cache, slab);
+    cache->empty_slabs++;
+}
+
+/* Moves up to count objects from the slabs to the cache of the given
+ * CPU. Stops early if the slabs run out of free objects. The cache
+ * must be locked. */
+static void kmem_cache_refill(kmem_cache_t *cache, kmem_cpu_cache_t *cpu,
+                              int count)
+{
+    kmem_slab_t *slab;
+    void *obj;
+
+    while (count-- > 0) {
+        slab = cache->partial;
+        if (slab == NULL)
+            return;
+
+        obj = slab->free;
+        slab->free = *(void **)obj;
+        if (slab->inuse++ == 0)
+            cache->empty_slabs--;
+        if (slab->free == NULL)
+            kmem_slab_unlink(cache, slab);
+
+        cpu->objects[cpu->count++] = obj;
+    }
+}
+
+/* Returns count objects from the cache of the given CPU to their
+ * slabs. Empty slabs beyond the first are given back to the page
+ * pool. Returns the number of slabs given back. The cache must be
+ * locked. */
+static int kmem_cache_drain(kmem_cache_t *cache, kmem_cpu_cache_t *cpu,
+                            int count)
+{
+    kmem_slab_t *slab;
+    void *obj;
+    int freed = 0;
+
+    while (count-- > 0) {
+        obj = cpu->objects[--cpu->count];
+        slab = KMEM_SLAB_OF(obj);
+
+        if (slab->free == NULL)
+            kmem_slab_link(cache, slab);
+        *(void **)obj = slab->free;
+        slab->free = obj;
+
+        if (--slab->inuse == 0) {
+            if (cache->empty_slabs > 0) {
+                kmem_slab_unlink(cache, slab);
+                pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t)slab));
+                freed++;
+            } else {
+                cache->empty_slabs++;
+            }
+        }
+    }
+
+    return freed;
+}
+
+/**
+ * Allocates an object from the cache.
+ *
+ * @param cache The cache
+ *
+ * @return The object, or NULL if out of memory. The contents of the
+ * object are undefined.
+ */
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    interrupt_status_t intr_status;
+    kmem_cpu_cache_t *cpu;
+    uint32_t phys;
+    void *obj;
+
+    intr_status = _interrupt_disable();
+    cpu = &cache->cpu[_interrupt_getcpu()];
+
+    while (cpu->count == 0) {
+        spinlock_acquire(&cache->slock);
+        kmem_cache_refill(cache, cpu, KMEM_CPU_BATCH);
+        spinlock_release(&cache->slock);
+        if (cpu->count > 0)
+            break;
+
+        /* Out of slabs. Getting a page may reclaim memory, which runs
+           the shrinkers, so it is done with interrupts restored. The
+           thread may then be running on another CPU, or another
+           thread may have taken the objects of the new slab, hence
+           the loop. */
+        _interrupt_set_state(intr_status);
+        phys = pagepool_get_phys_page();
+        if (phys == 0)
+            return NULL;
+
+        intr_status = _interrupt_disable();
+        spinlock_acquire(&cache->slock);
+        kmem_slab_create(cache, phys);
+        spinlock_release(&cache->slock);
+        cpu = &cache->cpu[_interrupt_getcpu()];
+    }
+
+    obj = cpu->objects[--cpu->count];
+
+    _interrupt_set_state(intr_status);
+
+    return obj;
+}
+
+/**
+ * Frees an object allocated from the cache.
+ *
+ * @param cache The cache the object was allocated from
+ *
+ * @param obj The object
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+    interrupt_status_t intr_status;
+    kmem_cpu_cache_t *cpu;
+
+    KERNEL_ASSERT(KMEM_SLAB_OF(obj)->cache == cache);
+
+    intr_status = _interrupt_disable();
+    cpu = &cache->cpu[_interrupt_getcpu()];
+
+    if (cpu->count == KMEM_CPU_CACHE_SIZE) {
+        spinlock_acquire(&cache->slock);
+        kmem_cache_drain(cache, cpu, KMEM_CPU_BATCH);
+        spinlock_release(&cache->slock);
+    }
+
+    cpu->objects[cpu->count++] = obj;
+
+    _interrupt_set_state(intr_status);
+}
+
+/* Deferred work which returns the free objects held by a CPU to
+   their slabs, queued by kmem_shrink. The empty slabs left behind are
+   given back to the page pool by the drain, all but one per cache. */
+static void kmem_drain_cpu(uint32_t arg)
+{
+    kmem_cache_t *cache;
+    kmem_cpu_cache_t *cpu;
+
+    kmem_drains[arg].pending = 0;
+
+    spinlock_acquire(&kmem_caches_slock);
+    for (cache = kmem_caches; cache != NULL; cache = cache->next) {
+        cpu = &cache->cpu[arg];
+        if (cpu->count == 0)
+            continue;
+        spinlock_acquire(&cache->slock);
+        kmem_cache_drain(cache, cpu, cpu->count);
+        spinlock_release(&cache->slock);
+    }
+    spinlock_release(&kmem_caches_slock);
+}
+
+/* Shrinker of the slab caches. Returns the free objects held by this
+   CPU to their slabs and gives the empty slabs back to the page
+   pool. The objects held by other CPUs can only be touched by their
+   owners, so the other CPUs are queued to drain their caches in their
+   schedulers; the pages freed by those drains are not included in the
+   count returned. */
+static int kmem_shrink(int pages)
+{
+    interrupt_status_t intr_status;
+    kmem_cache_t *cache;
+    kmem_cpu_cache_t *cpu;
+    kmem_slab_t *slab;
+    int freed = 0;
+    int i, this_cpu;
+
+    intr_status = _interrupt_disable();
+    this_cpu = _interrupt_getcpu();
+
+    for (i = 0; i < kmem_num_cpus; i++) {
+        if (i == this_cpu)
+            continue;
+        if (_atomic_cas(&kmem_drains[i].pending, 0, 1) == 0)
+            scheduler_defer_work(i, &kmem_drains[i].work);
+    }
+
+    spinlock_acquire(&kmem_caches_slock);
+
+    for (cache = kmem_caches; cache != NULL && freed < pages;
+         cache = cache->next) {
+        cpu = &cache->cpu[this_cpu];
+
+        spinlock_acquire(&cache->slock);
+
+        /* The drain frees all empty slabs but one */
+        freed += kmem_cache_drain(cache, cpu, cpu->count);
+
+        if (cache->empty_slabs > 0) {
+            for (slab = cache->partial; slab != NULL; slab = slab->next)
+                if (slab->inuse == 0)
+                    break;
+            KERNEL_ASSERT(slab != NULL);
+            kmem_slab_unlink(cache, slab);
+            cache->empty_slabs--;
+            pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t)slab));
+            freed++;
+        }
+
+        spinlock_release(&cache->slock);
+    }
+
+    spinlock_release(&kmem_caches_slock);
+    _interrupt_set_state(intr_status);
+
+    return freed;
+}
+
+/**
+ * Initializes the size class caches used by kmem_alloc, and registers
+ * the caches with the page pool for reclaim.
+ */
+void kmem_init(void)
+{
+    int i;
+
+    spinlock_reset(&kmem_caches_slock);
+
+    kmem_num_cpus = cpustatus_count();
+    for (i = 0; i < CONFIG_MAX_CPUS; i++) {
+        kmem_drains[i].work.func = &kmem_drain_cpu;
+        kmem_drains[i].work.arg = i;
+        kmem_drains[i].pending = 0;
+    }
+
+    for (i = 0; i < KMEM_CLASSES; i++)
+        kmem_cache_init(&kmem_classes[i], kmem_class_names[i],
+                        1 << (KMEM_MIN_SHIFT + i));
+
+    pagepool_register_shrinker(&kmem_shrinker);
+}
+
+/**
+ * Allocates kernel memory. Can be used only after vm_init, since the
+ * memory comes from the page pool.
+ *
+ * @param bytes Number of bytes to allocate, at most PAGE_SIZE
+ *
+ * @return The allocated memory, or NULL if out of memory.
+ */
+void *kmem_alloc(int bytes)
+{
+    uint32_t phys;
+    int i;
+
+    KERNEL_ASSERT(bytes >= 0 && bytes <= PAGE_SIZE);
+
+    if (bytes > KMEM_MAX_SIZE) {
+        phys = pagepool_get_phys_page();
+        if (phys == 0)
+            return NULL;
+        return (void *)ADDR_PHYS_TO_KERNEL(phys);
+    }
+
+    for (i = 0; (1 << (KMEM_MIN_SHIFT + i)) < bytes; i++)
+        ;
+
+    return kmem_cache_alloc(&kmem_classes[i]);
+}
+
+/**
+ * Frees memory allocated with kmem_alloc.
+ *
+ * @param ptr The memory to free, or NULL
+ */
+void kmem_free(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    /* Objects in slabs are never page aligned, because of the slab
+       header. */
+    if (((uint32_t)ptr & (PAGE_SIZE - 1)) == 0) {
+        pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t)ptr));
+        return;
+    }
+
+    kmem_cache_free(KMEM_SLAB_OF(ptr)->cache, ptr);
+}
+
+/** @} */
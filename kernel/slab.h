@@ -0,0 +1,53 @@
+/*
+ * Slab allocator for kernel objects.
+ */
+
+#ifndef BUENOS_KERNEL_SLAB_H
+#define BUENOS_KERNEL_SLAB_H
+
+#include "lib/types.h"
+#include "kernel/config.h"
+#include "kernel/spinlock.h"
+
+/* Number of free objects each CPU can hold per cache, and the number
+ * moved between a CPU and the slabs at a time. */
+#define KMEM_CPU_CACHE_SIZE 8
+#define KMEM_CPU_BATCH (KMEM_CPU_CACHE_SIZE / 2)
+
+/* Free objects held by one CPU, on its own cache line */
+typedef struct {
+    void *objects[KMEM_CPU_CACHE_SIZE];
+    int count;
+} __attribute__((aligned(CONFIG_CACHE_LINE_SIZE))) kmem_cpu_cache_t;
+
+/* A cache of objects of one size. The storage is owned by the caller
+ * and must stay valid forever (a static variable). */
+typedef struct kmem_cache_struct {
+    const char *name;
+    /* Object size in bytes, rounded up to a word */
+    int size;
+    /* Number of objects in one slab */
+    int per_slab;
+
+    /* Protects the slab list */
+    spinlock_t slock;
+    /* Slabs with free objects */
+    struct kmem_slab_struct *partial;
+    /* Number of slabs on the partial list with no objects in use */
+    int empty_slabs;
+
+    kmem_cpu_cache_t cpu[CONFIG_MAX_CPUS];
+
+    /* Next cache in the list of all caches */
+    struct kmem_cache_struct *next;
+} kmem_cache_t;
+
+void kmem_cache_init(kmem_cache_t *cache, const char *name, int size);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+void kmem_init(void);
+void *kmem_alloc(int bytes);
+void kmem_free(void *ptr);
+
+#endif /* BUENOS_KERNEL_SLAB_H */
@@ -36,10 +36,12 @@
 
 #include "kernel/sleepq.h"
 #include "kernel/thread.h"
+#include "kernel/scheduler.h"
 #include "kernel/spinlock.h"
 #include "kernel/config.h"
 #include "kernel/interrupt.h"
 #include "kernel/assert.h"
+#include "kernel/timerwheel.h"
 
 /** @name Sleep queue
  *
@@ -60,13 +62,17 @@
 #define SLEEPQ_HASHTABLE_SIZE 127
 
 extern thread_table_t thread_table[CONFIG_MAX_THREADS];
-extern spinlock_t thread_table_slock;
 
 /* spinlock for synchronizing sleep queue table access */
 static spinlock_t sleepq_slock;
 /* the sleep queue hashtable itself */
 static TID_t sleepq_hashtable[SLEEPQ_HASHTABLE_SIZE];
 
+/* timers for sleeps with a timeout, one for each thread */
+static ktimer_t sleepq_timers[CONFIG_MAX_THREADS];
+/* whether the last timed sleep of each thread ended by a timeout */
+static int sleepq_timed_out[CONFIG_MAX_THREADS];
+
 
 /* Hash function used to index the sleep queue table */
 #define SLEEPQ_HASH(res) ((uint32_t)(res) % SLEEPQ_HASHTABLE_SIZE)
@@ -135,17 +141,16 @@ void sleepq_add(void *resource)
     spinlock_release(&sleepq_slock);
 }
 
-/* Import prototype for unsafe function from scheduler.c */
-void scheduler_add_to_ready_list(TID_t t);
-
-
 /** Wake the first thread waiting for given resource from the sleep
  * queue. If such a thread exists, it is removed from the sleep queue
  * and placed on the scheduler's ready-to-run list.
  *
  * @param resource Wake the first thread waiting for this resource
+ *
+ * @return 1 if a thread was woken, 0 if nobody was waiting for
+ * the resource.
  */
-void sleepq_wake(void *resource)
+int sleepq_wake(void *resource)
 {
     uint32_t hash;
     interrupt_status_t intr_state;
@@ -176,24 +181,18 @@ void sleepq_wake(void *resource)
 	    thread_table[prev].next = thread_table[first].next;
 	}
 
-	/* Clear the sleeps_on field and add the thread to the ready
-	 * list (if necessary)
+	/* Clear the sleeps_on field and hand the thread to the
+	 * scheduler
 	 */
-	spinlock_acquire(&thread_table_slock);
-
 	thread_table[first].sleeps_on = 0;
 	thread_table[first].next = -1;
-	
-	if (thread_table[first].state == THREAD_SLEEPING) {
-	    thread_table[first].state = THREAD_READY;
-	    scheduler_add_to_ready_list(first);
-	}
-
-	spinlock_release(&thread_table_slock);
+	scheduler_wake(first);
     }
 
     spinlock_release(&sleepq_slock);
     _interrupt_set_state(intr_state);
+
+    return (first > 0);
 }
 
 
@@ -241,20 +240,12 @@ void sleepq_wake_all(void *resource)
 		first = thread_table[prev].next = thread_table[wake].next;
 	    }
 
-	    /* Clear the sleeps_on field and add the thread to the ready
-	     * list (if necessary)
+	    /* Clear the sleeps_on field and hand the thread to the
+	     * scheduler
 	     */
-	    spinlock_acquire(&thread_table_slock);
-
 	    thread_table[wake].sleeps_on = 0;
 	    thread_table[wake].next      = -1;
-	
-	    if (thread_table[wake].state == THREAD_SLEEPING) {
-		thread_table[wake].state = THREAD_READY;
-		scheduler_add_to_ready_list(wake);
-	    }
-
-	    spinlock_release(&thread_table_slock);
+	    scheduler_wake(wake);
 	}
     }
 
@@ -262,4 +253,82 @@ void sleepq_wake_all(void *resource)
     _interrupt_set_state(intr_state);
 }
 
+/* Timer callback for sleepq_add_timeout(). Removes the thread from
+ * the sleep queue if it is still there and makes it runnable. Called
+ * with interrupts disabled.
+ */
+static void sleepq_timeout(uint32_t arg)
+{
+    TID_t tid = (TID_t)arg;
+    TID_t prev, cur;
+    uint32_t hash;
+
+    spinlock_acquire(&sleepq_slock);
+
+    /* Already woken up by sleepq_wake(_all) */
+    if (thread_table[tid].sleeps_on == 0) {
+	spinlock_release(&sleepq_slock);
+	return;
+    }
+
+    hash = SLEEPQ_HASH(thread_table[tid].sleeps_on);
+
+    prev = -1;
+    cur = sleepq_hashtable[hash];
+    while (cur > 0 && cur != tid) {
+	prev = cur;
+	cur = thread_table[cur].next;
+    }
+    KERNEL_ASSERT(cur == tid);
+
+    if (prev <= 0) {
+	sleepq_hashtable[hash] = thread_table[tid].next;
+    } else {
+	thread_table[prev].next = thread_table[tid].next;
+    }
+
+    thread_table[tid].sleeps_on = 0;
+    thread_table[tid].next = -1;
+    sleepq_timed_out[tid] = 1;
+    scheduler_wake(tid);
+
+    spinlock_release(&sleepq_slock);
+}
+
+/** Like sleepq_add(), but the thread is also woken up if nobody
+ * wakes it within 'msec' milliseconds. After waking up the thread
+ * must call sleepq_timeout_expired() before sleeping again.
+ *
+ * Note that interrupts must be disabled before calling this function.
+ *
+ * @param resource The resource to wait for
+ *
+ * @param msec Maximum time to sleep in milliseconds
+ */
+void sleepq_add_timeout(void *resource, uint32_t msec)
+{
+    TID_t my_tid = thread_get_current_thread();
+
+    sleepq_add(resource);
+    sleepq_timed_out[my_tid] = 0;
+    timerwheel_add(&sleepq_timers[my_tid], msec,
+		   &sleepq_timeout, (uint32_t)my_tid);
+}
+
+/** Finishes a sleep started with sleepq_add_timeout(). Stops the
+ * timer if it is still pending.
+ *
+ * @return 1 if the sleep ended because of the timeout, 0 if the
+ * thread was woken up by sleepq_wake or sleepq_wake_all.
+ */
+int sleepq_timeout_expired(void)
+{
+    TID_t my_tid = thread_get_current_thread();
+
+    if (timerwheel_cancel(&sleepq_timers[my_tid]))
+	return 0;
+
+    return sleepq_timed_out[my_tid];
+}
+
 /** @} */
@@ -37,10 +37,53 @@
 #ifndef BUENOS_KERNEL_SPINLOCK_H
 #define BUENOS_KERNEL_SPINLOCK_H
 
+#include "lib/types.h"
+#include "kernel/config.h"
+
+/* Maximum length of a lock name in the contention statistics */
+#define SPINLOCK_NAME_LENGTH 32
+
+/* Contention statistics of one lock, or of all locks sharing a
+ * name. Times are in CP0 Count ticks. */
+typedef struct {
+    char name[SPINLOCK_NAME_LENGTH];
+    uint32_t acquisitions;
+    uint32_t contended;
+    uint32_t spin_cycles;
+    uint32_t max_hold;
+} spinlock_stat_t;
+
+#ifdef CONFIG_SPINLOCK_PROFILE
+
+typedef struct spinlock_profile_struct spinlock_profile_t;
+
+typedef struct {
+    /* The lock word, must be first (used by the assembler routines) */
+    int lock;
+    /* Statistics record shared by all locks with the same name */
+    spinlock_profile_t *profile;
+    /* CP0 Count when the lock was acquired */
+    uint32_t hold_start;
+} spinlock_t;
+
+/* Locks are named after the expression used to reset them, so all
+ * locks reset by the same line of code share one statistics record. */
+#define spinlock_reset(slock) spinlock_reset_named((slock), #slock)
+
+void spinlock_reset_named(spinlock_t *slock, const char *name);
+
+#else /* CONFIG_SPINLOCK_PROFILE */
+
 typedef int spinlock_t;
 
 void spinlock_reset(spinlock_t *slock);
+
+#endif /* CONFIG_SPINLOCK_PROFILE */
+
 void spinlock_acquire(spinlock_t *slock);
 void spinlock_release(spinlock_t *slock);
 
+int spinlock_profile_get(spinlock_stat_t *stats, int max);
+void spinlock_profile_report(void);
+
 #endif /* BUENOS_KERNEL_SPINLOCK_H */
@@ -0,0 +1,229 @@
+/*
+ * Spinlock contention profiler.
+ */
+
+#include "kernel/spinlock.h"
+#include "kernel/interrupt.h"
+#include "lib/libc.h"
+
+/** @name Spinlock profiler
+ *
+ * When the kernel is built with CONFIG_SPINLOCK_PROFILE, spinlocks
+ * record how often they are acquired, how often the first attempt
+ * finds the lock held (contention), how long the acquirer spins and
+ * the longest time the lock is held. Statistics are kept per lock
+ * name; a lock is named by the expression passed to spinlock_reset,
+ * so e.g. all semaphore locks share one record.
+ *
+ * The counters are kept per CPU, so that updating them needs no
+ * synchronization even when several locks share a record.
+ *
+ * @{
+ */
+
+#ifdef CONFIG_SPINLOCK_PROFILE
+
+/* Raw lock routines from _spinlock.S */
+void _spinlock_release(int *lock);
+int _spinlock_try(int *lock);
+void _spinlock_acquire(int *lock);
+uint32_t _spinlock_get_count(void);
+
+struct spinlock_profile_struct {
+    const char *name;
+    struct {
+        uint32_t acquisitions;
+        uint32_t contended;
+        uint32_t spin_cycles;
+        uint32_t max_hold;
+    } cpu[CONFIG_MAX_CPUS];
+};
+
+/* Statistics records, allocated on first reset of each name */
+static spinlock_profile_t spinlock_profiles[CONFIG_SPINLOCK_PROFILE_MAX];
+static int spinlock_profile_count = 0;
+/* Raw lock word protecting record allocation */
+static int spinlock_profile_lock = 0;
+
+/* Finds or allocates the statistics record for the given name.
+ * Returns NULL if the table is full. */
+static spinlock_profile_t *spinlock_profile_find(const char *name)
+{
+    spinlock_profile_t *profile = NULL;
+    interrupt_status_t intr_status;
+    int i;
+
+    /* Locks are named by the reset expression, so skip the address
+       operator most of them start with */
+    if (name[0] == '&')
+        name++;
+
+    intr_status = _interrupt_disable();
+    _spinlock_acquire(&spinlock_profile_lock);
+
+    for (i = 0; i < spinlock_profile_count; i++) {
+        if (spinlock_profiles[i].name == name
+            || stringcmp(spinlock_profiles[i].name, name) == 0) {
+            profile = &spinlock_profiles[i];
+            break;
+        }
+    }
+
+    if (profile == NULL
+        && spinlock_profile_count < CONFIG_SPINLOCK_PROFILE_MAX) {
+        profile = &spinlock_profiles[spinlock_profile_count++];
+        profile->name = name;
+    }
+
+    _spinlock_release(&spinlock_profile_lock);
+    _interrupt_set_state(intr_status);
+
+    return profile;
+}
+
+/**
+ * Initializes the spinlock to the free state and attaches it to the
+ * statistics record of the given name. Use through the
+ * spinlock_reset macro.
+ *
+ * @param slock The spinlock to initialize
+ *
+ * @param name Name of the lock
+ */
+void spinlock_reset_named(spinlock_t *slock, const char *name)
+{
+    slock->lock = 0;
+    slock->hold_start = 0;
+    slock->profile = spinlock_profile_find(name);
+}
+
+/**
+ * Acquires the spinlock, recording whether it was contended and how
+ * long the acquisition spun.
+ *
+ * @param slock The spinlock to acquire
+ */
+void spinlock_acquire(spinlock_t *slock)
+{
+    uint32_t start;
+    int cpu;
+
+    if (slock->profile == NULL) {
+        _spinlock_acquire(&slock->lock);
+        return;
+    }
+
+    cpu = _interrupt_getcpu();
+
+    if (!_spinlock_try(&slock->lock)) {
+        start = _spinlock_get_count();
+        _spinlock_acquire(&slock->lock);
+        slock->profile->cpu[cpu].contended++;
+        slock->profile->cpu[cpu].spin_cycles +=
+            _spinlock_get_count() - start;
+    }
+
+    slock->profile->cpu[cpu].acquisitions++;
+    slock->hold_start = _spinlock_get_count();
+}
+
+/**
+ * Releases the spinlock, recording the time it was held.
+ *
+ * @param slock The spinlock to release
+ */
+void spinlock_release(spinlock_t *slock)
+{
+    uint32_t hold;
+    int cpu;
+
+    if (slock->profile != NULL) {
+        cpu = _interrupt_getcpu();
+        hold = _spinlock_get_count() - slock->hold_start;
+        if (hold > slock->profile->cpu[cpu].max_hold)
+            slock->profile->cpu[cpu].max_hold = hold;
+    }
+
+    _spinlock_release(&slock->lock);
+}
+
+/* Sums the per-CPU counters of a record into stat. */
+static void spinlock_profile_sum(spinlock_profile_t *profile,
+                                 spinlock_stat_t *stat)
+{
+    int cpu;
+
+    stringcopy(stat->name, profile->name, SPINLOCK_NAME_LENGTH);
+    stat->acquisitions = 0;
+    stat->contended = 0;
+    stat->spin_cycles = 0;
+    stat->max_hold = 0;
+
+    for (cpu = 0; cpu < CONFIG_MAX_CPUS; cpu++) {
+        stat->acquisitions += profile->cpu[cpu].acquisitions;
+        stat->contended += profile->cpu[cpu].contended;
+        stat->spin_cycles += profile->cpu[cpu].spin_cycles;
+        stat->max_hold = MAX(stat->max_hold, profile->cpu[cpu].max_hold);
+    }
+}
+
+/**
+ * Copies the statistics of at most max lock names to stats, summed
+ * over all CPUs.
+ *
+ * @param stats Buffer for the statistics
+ *
+ * @param max Number of entries that fit in stats
+ *
+ * @return The number of entries copied, or -1 if the kernel was not
+ * built with CONFIG_SPINLOCK_PROFILE.
+ */
+int spinlock_profile_get(spinlock_stat_t *stats, int max)
+{
+    int i, count;
+
+    count = MIN(max, spinlock_profile_count);
+    for (i = 0; i < count; i++)
+        spinlock_profile_sum(&spinlock_profiles[i], &stats[i]);
+
+    return count;
+}
+
+/**
+ * Prints the statistics of all profiled locks to the console.
+ */
+void spinlock_profile_report(void)
+{
+    spinlock_stat_t stat;
+    int i;
+
+    kprintf("Spinlock profile (times in CP0 Count ticks):\n");
+    kprintf("%-32s %10s %10s %10s %10s\n",
+            "lock", "acquired", "contended", "spin", "max hold");
+
+    for (i = 0; i < spinlock_profile_count; i++) {
+        spinlock_profile_sum(&spinlock_profiles[i], &stat);
+        if (stat.acquisitions == 0)
+            continue;
+        kprintf("%-32s %10u %10u %10u %10u\n", stat.name,
+                stat.acquisitions, stat.contended,
+                stat.spin_cycles, stat.max_hold);
+    }
+}
+
+#else /* CONFIG_SPINLOCK_PROFILE */
+
+int spinlock_profile_get(spinlock_stat_t *stats, int max)
+{
+    stats = stats;
+    max = max;
+    return -1;
+}
+
+void spinlock_profile_report(void)
+{
+}
+
+#endif /* CONFIG_SPINLOCK_PROFILE */
+
+/** @} */
@@ -0,0 +1,143 @@
+/*
+ * Per-CPU statistics counters.
+ */
+
+#include "kernel/stats.h"
+#include "kernel/config.h"
+#include "kernel/spinlock.h"
+#include "kernel/interrupt.h"
+#include "kernel/assert.h"
+#include "kernel/percpu.h"
+#include "lib/libc.h"
+
+/** @name Statistics
+ *
+ * Named event counters which are cheap to update on any CPU. Every
+ * CPU has its own row of counter slots in its per-CPU data block and
+ * only ever writes to its own row, so updates need no locks and no
+ * atomic operations. The blocks are aligned to whole cache lines, so
+ * CPUs updating their counters do not steal cache lines from each
+ * other.
+ * Reading a counter sums the slots of all CPUs.
+ *
+ * Counters are registered once, typically when their subsystem is
+ * initialized, and can not be unregistered.
+ *
+ * @{
+ */
+
+/* Counter names, indexed by stat_id_t */
+static const char *stats_names[CONFIG_MAX_STATS];
+static int stats_count = 0;
+
+/* Protects registration */
+static spinlock_t stats_slock;
+
+/**
+ * Initializes the statistics system. Must be called before any
+ * counters are registered.
+ */
+void stats_init(void)
+{
+    spinlock_reset(&stats_slock);
+}
+
+/**
+ * Registers a new counter with initial value 0.
+ *
+ * @param name Name of the counter, must stay valid forever (a string
+ * constant)
+ *
+ * @return Identifier of the counter, used to update and read it.
+ */
+stat_id_t stats_register(const char *name)
+{
+    interrupt_status_t intr_status;
+    stat_id_t id;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&stats_slock);
+
+    KERNEL_ASSERT(stats_count < CONFIG_MAX_STATS);
+    id = stats_count++;
+    stats_names[id] = name;
+
+    spinlock_release(&stats_slock);
+    _interrupt_set_state(intr_status);
+
+    return id;
+}
+
+/**
+ * Adds amount to the counter on the current CPU. Only interrupts are
+ * disabled for the update, no locks are taken.
+ *
+ * @param id The counter
+ *
+ * @param amount Amount to add
+ */
+void stats_add(stat_id_t id, uint32_t amount)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    percpu_this()->stats[id] += amount;
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Returns the value of the counter summed over all CPUs. Updates
+ * made concurrently may or may not be included.
+ *
+ * @param id The counter
+ *
+ * @return The value of the counter
+ */
+uint32_t stats_get(stat_id_t id)
+{
+    uint32_t sum = 0;
+    int cpu;
+
+    KERNEL_ASSERT(id >= 0 && id < stats_count);
+
+    for (cpu = 0; cpu < CONFIG_MAX_CPUS; cpu++)
+        sum += percpu_of(cpu)->stats[id];
+
+    return sum;
+}
+
+/**
+ * Copies the names and values of at most max counters to entries.
+ *
+ * @param entries Buffer for the counters
+ *
+ * @param max Number of entries that fit in the buffer
+ *
+ * @return The number of counters copied.
+ */
+int stats_get_all(stat_entry_t *entries, int max)
+{
+    int i, count;
+
+    count = MIN(max, stats_count);
+    for (i = 0; i < count; i++) {
+        stringcopy(entries[i].name, stats_names[i], STATS_NAME_LENGTH);
+        entries[i].value = stats_get(i);
+    }
+
+    return count;
+}
+
+/**
+ * Prints all counters to the console.
+ */
+void stats_report(void)
+{
+    int i;
+
+    kprintf("Kernel statistics:\n");
+    for (i = 0; i < stats_count; i++)
+        kprintf("%-32s %10u\n", stats_names[i], stats_get(i));
+}
+
+/** @} */
@@ -0,0 +1,30 @@
+/*
+ * Per-CPU statistics counters.
+ */
+
+#ifndef BUENOS_KERNEL_STATS_H
+#define BUENOS_KERNEL_STATS_H
+
+#include "lib/types.h"
+
+/* Maximum length of a counter name */
+#define STATS_NAME_LENGTH 32
+
+/* Counter identifier returned by stats_register */
+typedef int stat_id_t;
+
+/* Name and value of one counter, as returned by stats_get_all */
+typedef struct {
+    char name[STATS_NAME_LENGTH];
+    uint32_t value;
+} stat_entry_t;
+
+void stats_init(void);
+stat_id_t stats_register(const char *name);
+void stats_add(stat_id_t id, uint32_t amount);
+#define stats_inc(id) stats_add((id), 1)
+uint32_t stats_get(stat_id_t id);
+int stats_get_all(stat_entry_t *entries, int max);
+void stats_report(void);
+
+#endif /* BUENOS_KERNEL_STATS_H */
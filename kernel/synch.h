@@ -41,5 +41,6 @@
 #include "kernel/spinlock.h"
 #include "kernel/sleepq.h"
 #include "kernel/semaphore.h"
+#include "kernel/lock_cond.h"
 
 #endif /* BUENOS_KERNEL_SYNCH_H */
@@ -43,6 +43,8 @@
 #include "kernel/config.h"
 #include "kernel/interrupt.h"
 #include "kernel/idle.h"
+#include "kernel/sleepq.h"
+#include "kernel/percpu.h"
 
 /** @name Thread library
  *
@@ -60,9 +62,6 @@ thread_table_t thread_table[CONFIG_MAX_THREADS];
 /* Thread stack areas for kernel threads */
 char thread_stack_areas[CONFIG_THREAD_STACKSIZE * CONFIG_MAX_THREADS];
 
-/* Import running thread id table from scheduler */
-extern TID_t scheduler_current_thread[CONFIG_MAX_CPUS];
-
 /** Initializes the threading system. Does this by setting all thread
  *  table entry states to THREAD_FREE. Called only once before any
  *  threads are created.
@@ -92,6 +91,8 @@ void thread_table_init(void)
 	thread_table[i].pagetable    = NULL;
 	thread_table[i].process_id   = -1;	
 	thread_table[i].next         = -1;	
+	thread_table[i].wake_queued  = 0;
+	thread_table[i].background   = 0;
     }
 
     thread_table[IDLE_THREAD_TID].context->cpu_regs[MIPS_REGISTER_SP] =
@@ -173,6 +174,7 @@ TID_t thread_create(void (*func)(uint32_t), uint32_t arg)
     thread_table[tid].next         = -1;
     // Setting deadline to -1 in the case that no deadline is provided.
     thread_table[tid].deadline     = -1;
+    thread_table[tid].background   = 0;
 
     /* Make sure that we always have a valid back reference on context chain */
     thread_table[tid].context->prev_context = thread_table[tid].context;
@@ -221,6 +223,27 @@ TID_t thread_create_deadline(void (*func)(uint32_t), uint32_t arg, uint32_t dead
 
   return new_thread;
 }
+
+/** Creates a background thread, which is scheduled only when no
+ * other thread is ready to run. Used for housekeeping that can make
+ * use of idle CPU time, such as zeroing free pages.
+ *
+ * @param func Function pointer to the threads 'main' function.
+ * @param arg Argument to pass to 'func'.
+ *
+ * @return The thread ID of the created thread, or negative if
+ * creation failed (thread table is full).
+ */
+TID_t thread_create_background(void (*func)(uint32_t), uint32_t arg)
+{
+    TID_t new_thread;
+
+    new_thread = thread_create(func, arg);
+    if (new_thread >= 0)
+        thread_table[new_thread].background = 1;
+
+    return new_thread;
+}
 /** Run a thread. The given thread is added to the scheduler's
  * ready-to-run list. This is really just a wrapper for
  * scheduler_add_ready().
@@ -250,6 +273,33 @@ void thread_switch(void)
       _interrupt_set_state(intr_status);
 }
 
+/** Put the calling thread to sleep for at least msec milliseconds.
+ * The CPU is given to other threads while sleeping.
+ *
+ * @param msec The time to sleep in milliseconds.
+ */
+void thread_sleep(uint32_t msec)
+{
+    interrupt_status_t intr_status;
+    TID_t me;
+
+    if (msec == 0) {
+        thread_switch();
+        return;
+    }
+
+    intr_status = _interrupt_disable();
+
+    /* Nobody else sleeps on our thread table entry, so only the
+       timeout can wake us up. */
+    me = thread_get_current_thread();
+    sleepq_add_timeout(&thread_table[me], msec);
+    thread_switch();
+    sleepq_timeout_expired();
+
+    _interrupt_set_state(intr_status);
+}
+
 /**
  * Return the TID of the calling thread. 
  * Finds out what is the TID of the thread calling this function.
@@ -264,7 +314,7 @@ TID_t thread_get_current_thread(void)
       
     intr_status = _interrupt_disable();
 
-    t = scheduler_current_thread[_interrupt_getcpu()];
+    t = percpu_this()->current_thread;
 
     _interrupt_set_state(intr_status);
 
@@ -286,7 +336,7 @@ thread_table_t *thread_get_current_thread_entry(void)
       
     intr_status = _interrupt_disable();
 
-    t = scheduler_current_thread[_interrupt_getcpu()];
+    t = percpu_this()->current_thread;
 
     _interrupt_set_state(intr_status);
 
@@ -41,6 +41,7 @@
 #include "kernel/cswitch.h"
 #include "vm/pagetable.h"
 #include "proc/process.h"
+#include "kernel/mpscq.h"
 
 /* Thread ID data type (index in thread table) */
 typedef int TID_t;
@@ -77,9 +78,16 @@ typedef struct {
     TID_t next;
 
     int32_t deadline;
+    /* 1 if the thread only runs when no other thread is ready */
+    uint32_t background;
 
-    /* pad to 64 bytes, one less than handout since deadline added */
-    uint32_t dummy_alignment_fill[8];
+    /* link in a CPU's wake-up queue, and whether the thread is in one
+       (see scheduler_wake) */
+    mpscq_node_t wake_node;
+    uint32_t wake_queued;
+
+    /* pad to 64 bytes */
+    uint32_t dummy_alignment_fill[5];
 } thread_table_t;
 
 /* function prototypes */
@@ -88,6 +96,7 @@ TID_t thread_create(void (*func)(uint32_t), uint32_t arg);
 
 /* Added this to enable deadlines */
 TID_t thread_create_deadline(void (*func)(uint32_t), uint32_t arg, uint32_t deadline);
+TID_t thread_create_background(void (*func)(uint32_t), uint32_t arg);
 void thread_run(TID_t t);
 
 TID_t thread_get_current_thread(void);
@@ -96,6 +105,8 @@ thread_table_t *thread_get_current_thread_entry(void);
 void thread_switch(void);
 #define thread_yield thread_switch
 
+void thread_sleep(uint32_t msec);
+
 void thread_goto_userland(context_t *usercontext);
 
 void thread_finish(void);
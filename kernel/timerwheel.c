@@ -0,0 +1,313 @@
+/*
+ * Hierarchical timer wheel.
+ */
+
+#include "kernel/timerwheel.h"
+#include "kernel/spinlock.h"
+#include "kernel/interrupt.h"
+#include "kernel/assert.h"
+#include "drivers/metadev.h"
+
+/** @name Timer wheel
+ *
+ * Kernel timers with millisecond resolution. Pending timers are kept
+ * in a hierarchical timer wheel: level 0 has one slot per
+ * millisecond for the next 64 milliseconds, and each following level
+ * has slots 64 times as wide. Timers on the higher levels are moved
+ * (cascaded) to the lower levels as their expiry time approaches, so
+ * adding and cancelling a timer are O(1) and expiring one costs at
+ * most one move per level.
+ *
+ * There is no separate clock interrupt for the wheel. It is run from
+ * the CP0 timer interrupt, which the scheduler programs to fire at
+ * the end of the current time slice or at the next timer expiry,
+ * whichever comes first.
+ *
+ * @{
+ */
+
+/* Shortest interval the CP0 timer is programmed for, in cycles */
+#define TIMERWHEEL_MIN_TICKS 200
+
+/* Longest supported timeout in milliseconds */
+#define TIMERWHEEL_MAX_DELTA \
+    ((1 << (TIMERWHEEL_SLOT_BITS * TIMERWHEEL_LEVELS)) - 1)
+
+static struct {
+    spinlock_t slock;
+    /* The last millisecond whose timers have been expired */
+    uint32_t current;
+    /* Lower bound for the expiry time of the earliest pending timer */
+    uint32_t next;
+    /* Number of pending timers */
+    int pending;
+    /* CPU cycles per millisecond */
+    uint32_t cycles_per_msec;
+    ktimer_t *slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+} timerwheel;
+
+/**
+ * Initializes the timer wheel. Must be called after the device
+ * drivers are initialized, since the wheel uses the real time clock.
+ */
+void timerwheel_init(void)
+{
+    int i, j;
+
+    spinlock_reset(&timerwheel.slock);
+    timerwheel.current = rtc_get_msec();
+    timerwheel.next = timerwheel.current;
+    timerwheel.pending = 0;
+    timerwheel.cycles_per_msec = rtc_get_clockspeed() / 1000;
+    if (timerwheel.cycles_per_msec == 0)
+        timerwheel.cycles_per_msec = 1;
+
+    for (i = 0; i < TIMERWHEEL_LEVELS; i++)
+        for (j = 0; j < TIMERWHEEL_SLOTS; j++)
+            timerwheel.slots[i][j] = NULL;
+}
+
+/* Links the timer to the slot matching its expiry time, relative to
+ * the time 'base'. The timer must not expire before 'base'. */
+static void timerwheel_insert(ktimer_t *timer, uint32_t base)
+{
+    uint32_t delta = timer->expires - base;
+    int level = 0;
+    int slot;
+
+    while (level < TIMERWHEEL_LEVELS - 1
+           && delta >= (1U << (TIMERWHEEL_SLOT_BITS * (level + 1))))
+        level++;
+
+    slot = (timer->expires >> (TIMERWHEEL_SLOT_BITS * level))
+        & (TIMERWHEEL_SLOTS - 1);
+
+    timer->prev = NULL;
+    timer->next = timerwheel.slots[level][slot];
+    if (timer->next != NULL)
+        timer->next->prev = timer;
+    timerwheel.slots[level][slot] = timer;
+}
+
+/* Unlinks the timer from its slot. */
+static void timerwheel_unlink(ktimer_t *timer)
+{
+    int level, slot;
+
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        /* First in its slot, find the slot by searching for it. */
+        for (level = 0; level < TIMERWHEEL_LEVELS; level++) {
+            slot = (timer->expires >> (TIMERWHEEL_SLOT_BITS * level))
+                & (TIMERWHEEL_SLOTS - 1);
+            if (timerwheel.slots[level][slot] == timer) {
+                timerwheel.slots[level][slot] = timer->next;
+                break;
+            }
+        }
+        KERNEL_ASSERT(level < TIMERWHEEL_LEVELS);
+    }
+
+    if (timer->next != NULL)
+        timer->next->prev = timer->prev;
+
+    timer->next = timer->prev = NULL;
+}
+
+/**
+ * Starts a timer. After 'msec' milliseconds, 'func' is called with
+ * 'arg' as its argument from the timer interrupt. The callback runs
+ * with interrupts disabled and the wheel locked, so it must be short
+ * and must not add or cancel timers. The timer must not already be
+ * pending.
+ *
+ * @param timer Storage for the timer
+ *
+ * @param msec Timeout in milliseconds
+ *
+ * @param func Function to call on expiry
+ *
+ * @param arg Argument passed to func
+ */
+void timerwheel_add(ktimer_t *timer, uint32_t msec,
+                    void (*func)(uint32_t), uint32_t arg)
+{
+    interrupt_status_t intr_status;
+    uint32_t now = rtc_get_msec();
+
+    if (msec > TIMERWHEEL_MAX_DELTA)
+        msec = TIMERWHEEL_MAX_DELTA;
+
+    timer->func = func;
+    timer->arg = arg;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&timerwheel.slock);
+
+    KERNEL_ASSERT(!timer->pending);
+
+    timer->expires = now + msec;
+    /* Expire at the next tick at the earliest */
+    if ((int)(timer->expires - timerwheel.current) <= 0)
+        timer->expires = timerwheel.current + 1;
+
+    timerwheel_insert(timer, timerwheel.current);
+    timer->pending = 1;
+
+    if (timerwheel.pending++ == 0
+        || (int)(timer->expires - timerwheel.next) < 0)
+        timerwheel.next = timer->expires;
+
+    spinlock_release(&timerwheel.slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Stops a pending timer. Since callbacks run with the wheel locked,
+ * the callback of the timer is guaranteed not to be running when
+ * this function returns.
+ *
+ * @param timer The timer to stop
+ *
+ * @return 1 if the timer was pending, 0 if it had already expired
+ * (or was never started).
+ */
+int timerwheel_cancel(ktimer_t *timer)
+{
+    interrupt_status_t intr_status;
+    int was_pending;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&timerwheel.slock);
+
+    was_pending = timer->pending;
+    if (was_pending) {
+        timerwheel_unlink(timer);
+        timer->pending = 0;
+        timerwheel.pending--;
+    }
+
+    spinlock_release(&timerwheel.slock);
+    _interrupt_set_state(intr_status);
+
+    return was_pending;
+}
+
+/* Moves the timers of one slot on a higher level down the wheel.
+ * Called when the wheel reaches time 't'. */
+static void timerwheel_cascade(int level, uint32_t t)
+{
+    int slot = (t >> (TIMERWHEEL_SLOT_BITS * level)) & (TIMERWHEEL_SLOTS - 1);
+    ktimer_t *timer = timerwheel.slots[level][slot];
+    ktimer_t *next;
+
+    timerwheel.slots[level][slot] = NULL;
+
+    while (timer != NULL) {
+        next = timer->next;
+        timerwheel_insert(timer, t);
+        timer = next;
+    }
+}
+
+/* Expires the timers of level 0 slot for time 't'. */
+static void timerwheel_expire(uint32_t t)
+{
+    int slot = t & (TIMERWHEEL_SLOTS - 1);
+    ktimer_t *timer = timerwheel.slots[0][slot];
+    ktimer_t *next;
+
+    timerwheel.slots[0][slot] = NULL;
+
+    while (timer != NULL) {
+        next = timer->next;
+        timer->next = timer->prev = NULL;
+        timer->pending = 0;
+        timerwheel.pending--;
+        timer->func(timer->arg);
+        timer = next;
+    }
+}
+
+/**
+ * Expires all timers which are due. Called from the interrupt
+ * handler on timer interrupts with interrupts disabled.
+ */
+void timerwheel_run(void)
+{
+    uint32_t now, t;
+    int level, i;
+
+    now = rtc_get_msec();
+
+    /* Unlocked peek: nothing to do within the same millisecond */
+    if (now == timerwheel.current)
+        return;
+
+    spinlock_acquire(&timerwheel.slock);
+
+    while ((int)(now - timerwheel.current) > 0) {
+        if (timerwheel.pending == 0) {
+            timerwheel.current = now;
+            break;
+        }
+
+        t = timerwheel.current + 1;
+
+        for (level = 1; level < TIMERWHEEL_LEVELS; level++) {
+            if ((t & ((1U << (TIMERWHEEL_SLOT_BITS * level)) - 1)) != 0)
+                break;
+            timerwheel_cascade(level, t);
+        }
+
+        timerwheel_expire(t);
+        timerwheel.current = t;
+    }
+
+    /* Find the next expiry on level 0, or else the next cascade */
+    t = timerwheel.current;
+    timerwheel.next = ((t >> TIMERWHEEL_SLOT_BITS) + 1) << TIMERWHEEL_SLOT_BITS;
+    for (i = 1; i <= TIMERWHEEL_SLOTS; i++) {
+        if (timerwheel.slots[0][(t + i) & (TIMERWHEEL_SLOTS - 1)] != NULL) {
+            timerwheel.next = t + i;
+            break;
+        }
+    }
+
+    spinlock_release(&timerwheel.slock);
+}
+
+/**
+ * Returns the number of CPU cycles until the wheel needs to be run
+ * again, but at most max_ticks. Used by the scheduler to program the
+ * CP0 timer.
+ *
+ * @param max_ticks The length of the time slice in cycles
+ *
+ * @return Cycles until the next timer interrupt is needed
+ */
+uint32_t timerwheel_next_ticks(uint32_t max_ticks)
+{
+    int delta;
+    uint32_t ticks;
+
+    /* Unlocked read, a stale value only causes an extra interrupt */
+    if (timerwheel.pending == 0)
+        return max_ticks;
+
+    delta = (int)(timerwheel.next - rtc_get_msec());
+    if (delta <= 0)
+        return TIMERWHEEL_MIN_TICKS;
+
+    if ((uint32_t)delta > max_ticks / timerwheel.cycles_per_msec)
+        return max_ticks;
+
+    ticks = delta * timerwheel.cycles_per_msec;
+    if (ticks < TIMERWHEEL_MIN_TICKS)
+        ticks = TIMERWHEEL_MIN_TICKS;
+
+    return ticks < max_ticks ? ticks : max_ticks;
+}
+
+/** @} */
@@ -0,0 +1,37 @@
+/*
+ * Hierarchical timer wheel.
+ */
+
+#ifndef BUENOS_KERNEL_TIMERWHEEL_H
+#define BUENOS_KERNEL_TIMERWHEEL_H
+
+#include "lib/types.h"
+
+/* Number of wheel levels and slots per level. Level n has a
+ * resolution of 64^n milliseconds, so four levels cover about 4.6
+ * hours; longer timeouts are clamped to that. */
+#define TIMERWHEEL_LEVELS 4
+#define TIMERWHEEL_SLOT_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_SLOT_BITS)
+
+/* A timer. The storage is owned by the caller, must be zeroed before
+ * its first use and must stay valid while the timer is pending. */
+typedef struct ktimer_struct {
+    struct ktimer_struct *next;
+    struct ktimer_struct *prev;
+    /* Expiry time in milliseconds (rtc_get_msec() time base) */
+    uint32_t expires;
+    /* Called with interrupts disabled and the wheel locked */
+    void (*func)(uint32_t);
+    uint32_t arg;
+    int pending;
+} ktimer_t;
+
+void timerwheel_init(void);
+void timerwheel_add(ktimer_t *timer, uint32_t msec,
+                    void (*func)(uint32_t), uint32_t arg);
+int timerwheel_cancel(ktimer_t *timer);
+void timerwheel_run(void);
+uint32_t timerwheel_next_ticks(uint32_t max_ticks);
+
+#endif /* BUENOS_KERNEL_TIMERWHEEL_H */
@@ -0,0 +1,161 @@
+/*
+ * Userland futexes.
+ */
+
+#include "proc/futex.h"
+#include "kernel/thread.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleepq.h"
+#include "kernel/interrupt.h"
+#include "vm/vm.h"
+#include "vm/pagepool.h"
+#include "proc/process.h"
+
+/** @name Futexes
+ *
+ * A futex is a userland word on which threads may sleep. Userland
+ * implements its synchronization primitives with atomic operations on
+ * the word and only enters the kernel when it has to wait for or wake
+ * other threads.
+ *
+ * A futex is identified by the physical address of the word, so the
+ * same futex is found from every address space that maps the page,
+ * e.g. a parent and its children sharing pages from process_shmem.
+ * Waiters sleep in the sleep queue using the physical address as the
+ * resource. Physical addresses never collide with the kernel virtual
+ * addresses used as resources elsewhere in the kernel.
+ *
+ * The check of the futex word and the addition to the sleep queue are
+ * done while holding the spinlock of the futex's hash bucket, and
+ * wakers take the same spinlock, so a wake-up cannot be lost between
+ * the check and the sleep.
+ *
+ * @{
+ */
+
+/* Number of futex hash buckets (prime number) */
+#define FUTEX_HASHTABLE_SIZE 31
+
+#define FUTEX_HASH(key) (((key) >> 2) % FUTEX_HASHTABLE_SIZE)
+
+/* Spinlocks serializing the waiters and wakers of each bucket */
+static spinlock_t futex_slocks[FUTEX_HASHTABLE_SIZE];
+
+/** Initializes the futex system. */
+void futex_init(void)
+{
+    int i;
+
+    for (i = 0; i < FUTEX_HASHTABLE_SIZE; i++)
+        spinlock_reset(&futex_slocks[i]);
+}
+
+/**
+ * Finds the key (physical address) of the futex at the given user
+ * address in the current thread's address space.
+ *
+ * @param uaddr Userland address of the futex word
+ *
+ * @return The physical address of the futex word, or 0 if the address
+ * is not an aligned userland word in the address space.
+ */
+static uint32_t futex_key(uint32_t *uaddr)
+{
+    pagetable_t *pagetable;
+    uint32_t key;
+
+    if ((uint32_t)uaddr & 0x3 || (uint32_t)uaddr >= 0x80000000)
+        return 0;
+
+    pagetable = thread_get_current_thread_entry()->pagetable;
+    if (pagetable == NULL)
+        return 0;
+
+    /* The word may be on a demand paged page which is not mapped
+       yet. */
+    key = vm_translate(pagetable, (uint32_t)uaddr);
+    if (key == 0 && process_page_fault((uint32_t)uaddr) > 0)
+        key = vm_translate(pagetable, (uint32_t)uaddr);
+
+    return key;
+}
+
+/**
+ * Puts the calling thread to sleep on the futex at uaddr if the futex
+ * word still contains val. The thread sleeps until another thread
+ * calls futex_wake() on the same futex.
+ *
+ * @param uaddr Userland address of the futex word
+ *
+ * @param val The value the futex word is expected to contain
+ *
+ * @return FUTEX_OK after a wake-up, FUTEX_EAGAIN if the word did not
+ * contain val or FUTEX_EFAULT if uaddr is invalid.
+ */
+int futex_wait(uint32_t *uaddr, uint32_t val)
+{
+    interrupt_status_t intr_status;
+    uint32_t key;
+    spinlock_t *slock;
+
+    key = futex_key(uaddr);
+    if (key == 0)
+        return FUTEX_EFAULT;
+
+    slock = &futex_slocks[FUTEX_HASH(key)];
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(slock);
+
+    /* Read the word through the unmapped kernel segment, so that no
+       TLB exception can occur while the spinlock is held. */
+    if (*(uint32_t *)ADDR_PHYS_TO_KERNEL(key) != val) {
+        spinlock_release(slock);
+        _interrupt_set_state(intr_status);
+        return FUTEX_EAGAIN;
+    }
+
+    sleepq_add((void *)key);
+    spinlock_release(slock);
+    thread_switch();
+
+    _interrupt_set_state(intr_status);
+    return FUTEX_OK;
+}
+
+/**
+ * Wakes up at most count threads sleeping on the futex at uaddr.
+ *
+ * @param uaddr Userland address of the futex word
+ *
+ * @param count Maximum number of threads to wake
+ *
+ * @return The number of threads woken, or FUTEX_EFAULT if uaddr is
+ * invalid.
+ */
+int futex_wake(uint32_t *uaddr, int count)
+{
+    interrupt_status_t intr_status;
+    uint32_t key;
+    spinlock_t *slock;
+    int woken = 0;
+
+    key = futex_key(uaddr);
+    if (key == 0)
+        return FUTEX_EFAULT;
+
+    slock = &futex_slocks[FUTEX_HASH(key)];
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(slock);
+
+    while (woken < count && sleepq_wake((void *)key))
+        woken++;
+
+    spinlock_release(slock);
+    _interrupt_set_state(intr_status);
+
+    return woken;
+}
+
+/** @} */
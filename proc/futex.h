@@ -0,0 +1,25 @@
+/*
+ * Userland futexes.
+ */
+
+#ifndef BUENOS_PROC_FUTEX
+#define BUENOS_PROC_FUTEX
+
+#include "lib/types.h"
+
+/* Return values of the futex operations. Non-negative values mean
+ * success. */
+#define FUTEX_OK      0
+#define FUTEX_EAGAIN -1 /* The futex word did not hold the expected value */
+#define FUTEX_EFAULT -2 /* The address is not a mapped, aligned user word */
+
+void futex_init(void);
+
+/* Sleep until woken if *uaddr == val. */
+int futex_wait(uint32_t *uaddr, uint32_t val);
+
+/* Wake at most count threads sleeping on uaddr. Returns the number of
+ * threads woken. */
+int futex_wake(uint32_t *uaddr, int count);
+
+#endif
@@ -44,7 +44,9 @@
 #include "drivers/yams.h"
 #include "vm/vm.h"
 #include "vm/pagepool.h"
-#include "kernel/sleepq.h"
+#include "kernel/lock_cond.h"
+#include "kernel/stats.h"
+#include "proc/usersem.h"
 
 
 /** @name Process startup
@@ -56,12 +58,36 @@ process_table_t process_table[PROCESS_MAX_PROCESSES];
 
 spinlock_t process_table_slock;
 
+extern thread_table_t thread_table[CONFIG_MAX_THREADS];
+
+/* Userland context a forked child starts in, indexed by PID. Filled
+   by process_fork before the child's thread runs. */
+static context_t process_fork_context[PROCESS_MAX_PROCESSES];
+
+/* Number of pages loaded from the executable by one page fault: the
+   faulting page and the following file-backed pages of its region. */
+#define PROCESS_READAHEAD_PAGES 4
+
+static stat_id_t process_stat_loaded;
+static stat_id_t process_stat_readahead;
+static stat_id_t process_stat_copied;
+
 void process_reset(process_id_t pid)
 {
+    int i;
+
     process_table[pid].state         = PROCESS_FREE;
     process_table[pid].executable[0] = 0;
     process_table[pid].retval        = 0;
     process_table[pid].cFiles        = 0;
+    process_table[pid].exec_file     = -1;
+    condition_init(&process_table[pid].exited);
+    for (i = 0; i < PROCESS_MAX_SEMAPHORES; i++)
+        process_table[pid].semaphores[i] = NULL;
+    process_table[pid].heap_start    = 0;
+    process_table[pid].heap_end      = 0;
+    process_table[pid].heap_max      = 0;
+    process_table[pid].resident_pages = 0;
 }
 
 /* Initialize process table and spinlock */
@@ -69,8 +95,12 @@ void process_init()
 {
     int i;
     spinlock_reset(&process_table_slock);
-    for (i = 0; i <= PROCESS_MAX_PROCESSES; ++i)
+    for (i = 0; i < PROCESS_MAX_PROCESSES; ++i)
         process_reset(i);
+
+    process_stat_loaded = stats_register("pages loaded on fault");
+    process_stat_readahead = stats_register("pages read ahead");
+    process_stat_copied = stats_register("pages copied on write");
 }
 
 /* Find a free slot in the process table. Returns PROCESS_MAX_PROCESSES
@@ -82,7 +112,7 @@ process_id_t alloc_process_id()
 
     intr_status = _interrupt_disable();
     spinlock_acquire(&process_table_slock);
-    for (i = 0; i <= PROCESS_MAX_PROCESSES; ++i)
+    for (i = 0; i < PROCESS_MAX_PROCESSES; ++i)
     {
         if (process_table[i].state == PROCESS_FREE)
         {
@@ -95,13 +125,27 @@ process_id_t alloc_process_id()
     return i;
 }
 
+/* Give back a slot taken with alloc_process_id which was never used
+ * by a running process. */
+static void free_process_id(process_id_t pid)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&process_table_slock);
+    process_reset(pid);
+    spinlock_release(&process_table_slock);
+    _interrupt_set_state(intr_status);
+}
+
 
 /**
  * Starts one userland process. The thread calling this function will
  * be used to run the process and will therefore never return from
- * this function. This function asserts that no errors occur in
- * process startup (the executable file exists and is a valid ecoff
- * file, enough memory is available, file operations succeed...).
+ * this function. Running out of memory for the pagetable terminates
+ * the process with return value -1, but otherwise this function
+ * asserts that no errors occur in process startup (the executable
+ * file exists and is a valid ecoff file, file operations succeed...).
  * Therefore this function is not suitable to allow startup of
  * arbitrary processes.
  *
@@ -112,15 +156,12 @@ void process_start(process_id_t pid)
 {
     thread_table_t *my_entry;
     pagetable_t *pagetable;
-    uint32_t phys_page;
     context_t user_context;
-    uint32_t stack_bottom;
     elf_info_t elf;
+    uint32_t heap_start;
     openfile_t file;
     char *executable;
 
-    int i;
-
     interrupt_status_t intr_status;
 
     my_entry = thread_get_current_thread_entry();
@@ -133,14 +174,21 @@ void process_start(process_id_t pid)
     KERNEL_ASSERT(my_entry->pagetable == NULL);
 
     pagetable = vm_create_pagetable(thread_get_current_thread());
-    KERNEL_ASSERT(pagetable != NULL);
+    if (pagetable == NULL) {
+        /* Out of memory even after reclaim. The process exits before
+           it has started, and its parent gets -1 from the join. */
+        kprintf("Out of memory for the pagetable of %s, "
+                "terminating process\n", executable);
+        process_finish(-1);
+    }
 
     intr_status = _interrupt_disable();
     my_entry->pagetable = pagetable;
 
-    /* Update TLB to allow access to the virtual addresses of the
-       segments. */
-    _tlb_set_asid(thread_get_current_thread());
+    /* Switch the TLB to the new address space. An earlier thread
+       with the same ASID may have left entries for pages which are
+       now used by somebody else, tlb_fill invalidates them. */
+    tlb_fill(pagetable);
 
     _interrupt_set_state(intr_status);
 
@@ -152,68 +200,49 @@ void process_start(process_id_t pid)
     /* Trivial and naive sanity check for entry point: */
     KERNEL_ASSERT(elf.entry_point >= PAGE_SIZE);
 
-    /* Calculate the number of pages needed by the whole process
-       (including userland stack). Since we don't have proper tlb
-       handling code, all these pages must fit into TLB. */
-    KERNEL_ASSERT(elf.ro_pages + elf.rw_pages + CONFIG_USERLAND_STACK_SIZE
-            <= _tlb_get_maxindex() + 1);
-
-    /* Allocate and map stack */
-    for(i = 0; i < CONFIG_USERLAND_STACK_SIZE; i++) {
-        phys_page = pagepool_get_phys_page();
-        KERNEL_ASSERT(phys_page != 0);
-        vm_map(my_entry->pagetable, phys_page,
-                (USERLAND_STACK_TOP & PAGE_SIZE_MASK) - i*PAGE_SIZE, 1);
-    }
-
-    /* Allocate and map pages for the segments. We assume that
-       segments begin at page boundary. (The linker script in tests
-       directory creates this kind of segments) */
-    for(i = 0; i < (int)elf.ro_pages; i++) {
-        phys_page = pagepool_get_phys_page();
-        KERNEL_ASSERT(phys_page != 0);
-        vm_map(my_entry->pagetable, phys_page,
-                elf.ro_vaddr + i*PAGE_SIZE, 1);
-    }
-
-    for(i = 0; i < (int)elf.rw_pages; i++) {
-        phys_page = pagepool_get_phys_page();
-        KERNEL_ASSERT(phys_page != 0);
-        vm_map(my_entry->pagetable, phys_page,
-                elf.rw_vaddr + i*PAGE_SIZE, 1);
-    }
-
-    /* Zero the pages. */
-    memoryset((void *)elf.ro_vaddr, 0, elf.ro_pages*PAGE_SIZE);
-    memoryset((void *)elf.rw_vaddr, 0, elf.rw_pages*PAGE_SIZE);
-
-    stack_bottom = (USERLAND_STACK_TOP & PAGE_SIZE_MASK) -
-        (CONFIG_USERLAND_STACK_SIZE-1)*PAGE_SIZE;
-    memoryset((void *)stack_bottom, 0, CONFIG_USERLAND_STACK_SIZE*PAGE_SIZE);
-
-    /* Copy segments */
-
-    if (elf.ro_size > 0) {
+    /* Nothing is loaded here: all of the address space is demand
+       paged. The segments are loaded from the executable when their
+       pages are first touched (see process_page_fault), so startup
+       time depends on the pages used, not on the size of the
+       executable. Untouched stack and BSS pages cost nothing. We
+       assume that segments begin at page boundary. (The linker script
+       in tests directory creates this kind of segments) */
+    process_table[pid].exec_file = file;
+
+    KERNEL_ASSERT(vm_reserve(my_entry->pagetable,
+                             (USERLAND_STACK_TOP & PAGE_SIZE_MASK)
+                             - (CONFIG_USERLAND_STACK_SIZE - 1)*PAGE_SIZE,
+                             (USERLAND_STACK_TOP & PAGE_SIZE_MASK)
+                             + PAGE_SIZE, 1) == 0);
+
+    if (elf.ro_pages > 0) {
         /* Make sure that the segment is in proper place. */
         KERNEL_ASSERT(elf.ro_vaddr >= PAGE_SIZE);
-        KERNEL_ASSERT(vfs_seek(file, elf.ro_location) == VFS_OK);
-        KERNEL_ASSERT(vfs_read(file, (void *)elf.ro_vaddr, elf.ro_size)
-                == (int)elf.ro_size);
+        KERNEL_ASSERT(vm_reserve_file(my_entry->pagetable, elf.ro_vaddr,
+                                      elf.ro_vaddr + elf.ro_pages*PAGE_SIZE,
+                                      0, elf.ro_location,
+                                      elf.ro_size) == 0);
     }
 
-    if (elf.rw_size > 0) {
+    if (elf.rw_pages > 0) {
         /* Make sure that the segment is in proper place. */
         KERNEL_ASSERT(elf.rw_vaddr >= PAGE_SIZE);
-        KERNEL_ASSERT(vfs_seek(file, elf.rw_location) == VFS_OK);
-        KERNEL_ASSERT(vfs_read(file, (void *)elf.rw_vaddr, elf.rw_size)
-                == (int)elf.rw_size);
+        KERNEL_ASSERT(vm_reserve_file(my_entry->pagetable, elf.rw_vaddr,
+                                      elf.rw_vaddr + elf.rw_pages*PAGE_SIZE,
+                                      1, elf.rw_location,
+                                      elf.rw_size) == 0);
     }
 
-
-    /* Set the dirty bit to zero (read-only) on read-only pages. */
-    for(i = 0; i < (int)elf.ro_pages; i++) {
-        vm_set_dirty(my_entry->pagetable, elf.ro_vaddr + i*PAGE_SIZE, 0);
-    }
+    /* The heap starts empty at the first page after the segments. It
+       may grow up to the guard page below the stack. */
+    if (elf.rw_pages > 0)
+        heap_start = elf.rw_vaddr + elf.rw_pages*PAGE_SIZE;
+    else
+        heap_start = elf.ro_vaddr + elf.ro_pages*PAGE_SIZE;
+    process_table[pid].heap_start = heap_start;
+    process_table[pid].heap_end = heap_start;
+    process_table[pid].heap_max = (USERLAND_STACK_TOP & PAGE_SIZE_MASK)
+        - CONFIG_USERLAND_STACK_SIZE*PAGE_SIZE;
 
     /* Initialize the user context. (Status register is handled by
        thread_goto_userland) */
@@ -258,6 +287,98 @@ process_id_t process_spawn_deadline(const char *executable, int deadline){
     thread_run(thread);
     return pid;
 }
+/* Thread function of a forked child: returns to userland where the
+ * parent made the fork syscall. */
+static void process_fork_start(process_id_t pid)
+{
+    thread_table_t *my_entry = thread_get_current_thread_entry();
+
+    /* process_fork could not copy the address space. A created thread
+       can only be given back by finishing it. */
+    if (my_entry->pagetable == NULL) {
+        free_process_id(pid);
+        thread_finish();
+    }
+
+    /* The TLB was switched to the new address space when the thread
+       was scheduled */
+    thread_goto_userland(&process_fork_context[pid]);
+
+    KERNEL_PANIC("thread_goto_userland failed.");
+}
+
+/**
+ * Creates a copy of the current process, like POSIX fork. The child
+ * gets a copy of the address space and continues from the same
+ * syscall, where it sees 0 as the return value. Nothing is copied up
+ * front: the pages are shared copy-on-write (see vm_copy_pagetable
+ * and process_write_fault), so forking costs the pagetable copy only.
+ * The child opens the executable for its own demand paging and gets
+ * handles to the semaphores of the parent (see usersem_fork). Open
+ * files are not inherited.
+ *
+ * @param user_context The userland context of the fork syscall
+ *
+ * @return The PID of the child, or a negative value on error.
+ */
+process_id_t process_fork(context_t *user_context)
+{
+    thread_table_t *my_entry = thread_get_current_thread_entry();
+    process_table_t *parent = process_get_current_process_entry();
+    process_table_t *child;
+    pagetable_t *pagetable;
+    process_id_t pid;
+    openfile_t file;
+    TID_t thread;
+
+    pid = alloc_process_id();
+    if (pid == PROCESS_MAX_PROCESSES)
+        return PROCESS_PTABLE_FULL;
+    child = &process_table[pid];
+
+    file = vfs_open(parent->executable);
+    if (file < 0) {
+        free_process_id(pid);
+        return PROCESS_FORK_FAILED;
+    }
+
+    thread = thread_create((void (*)(uint32_t))(&process_fork_start), pid);
+    if (thread < 0) {
+        vfs_close(file);
+        free_process_id(pid);
+        return PROCESS_PTABLE_FULL;
+    }
+
+    /* The thread ID is the ASID, as in process_start */
+    pagetable = vm_copy_pagetable(my_entry->pagetable, thread);
+    if (pagetable == NULL) {
+        /* process_fork_start gives the slot and the thread back */
+        vfs_close(file);
+        thread_run(thread);
+        return PROCESS_FORK_FAILED;
+    }
+
+    stringcopy(child->executable, parent->executable, PROCESS_MAX_FILELENGTH);
+    child->parent         = process_get_current_process();
+    child->exec_file      = file;
+    child->heap_start     = parent->heap_start;
+    child->heap_end       = parent->heap_end;
+    child->heap_max       = parent->heap_max;
+    child->resident_pages = parent->resident_pages;
+    usersem_fork(child);
+
+    /* The child returns 0 from the syscall */
+    memcopy(sizeof(context_t), &process_fork_context[pid], user_context);
+    process_fork_context[pid].cpu_regs[MIPS_REGISTER_V0] = 0;
+    process_fork_context[pid].pc += 4;
+
+    thread_table[thread].process_id = pid;
+    thread_table[thread].pagetable = pagetable;
+    thread_run(thread);
+
+    return pid;
+}
+
 process_id_t process_get_current_process(void)
 {
     return thread_get_current_thread_entry()->process_id;
@@ -281,14 +402,8 @@ int process_join(process_id_t pid)
     intr_status = _interrupt_disable();
     spinlock_acquire(&process_table_slock);
 
-    /* The thread could be zombie even though it wakes us (maybe). */
     while (process_table[pid].state != PROCESS_ZOMBIE)
-    {
-        sleepq_add(&process_table[pid]);
-        spinlock_release(&process_table_slock);
-        thread_switch();
-        spinlock_acquire(&process_table_slock);
-    }
+        condition_wait_slock(&process_table[pid].exited, &process_table_slock);
 
     retval = process_table[pid].retval;
     process_reset(pid);
@@ -304,23 +419,320 @@ void process_finish(int retval)
     process_id_t cur = process_get_current_process();
     thread_table_t *thread = thread_get_current_thread_entry();
 
+    usersem_cleanup();
+
+    if (process_table[cur].exec_file >= 0) {
+        vfs_close(process_table[cur].exec_file);
+        process_table[cur].exec_file = -1;
+    }
+
     intr_status = _interrupt_disable();
+
+    /* Give back all pages of the address space, and make sure they
+       can not be reached through the TLB any more. A process which
+       failed to start has no address space. */
+    if (thread->pagetable != NULL) {
+        vm_release_pages(thread->pagetable);
+        tlb_flush_asid(thread->pagetable->ASID);
+    }
+
     spinlock_acquire(&process_table_slock);
 
     process_table[cur].state  = PROCESS_ZOMBIE;
     process_table[cur].retval = retval;
+    process_table[cur].resident_pages = 0;
 
     /* Remember to destroy the pagetable! */
-    vm_destroy_pagetable(thread->pagetable);
-    thread->pagetable = NULL;
+    if (thread->pagetable != NULL) {
+        vm_destroy_pagetable(thread->pagetable);
+        thread->pagetable = NULL;
+    }
 
-    sleepq_wake_all(&process_table[cur]);
+    condition_broadcast(&process_table[cur].exited);
 
     spinlock_release(&process_table_slock);
     _interrupt_set_state(intr_status);
     thread_finish();
 }
 
+/**
+ * Moves the end of the heap of the current process, like brk. Growing
+ * the heap only reserves the address range as a zero-fill region, the
+ * pages are allocated and mapped when first touched (see
+ * process_page_fault). Shrinking the heap unmaps the pages above the
+ * new end and gives them back to the page pool.
+ *
+ * @param heap_end The new end of the heap, or 0 to query the current
+ * end
+ *
+ * @return The new end of the heap, or 0 if heap_end is below the
+ * start of the heap or above the largest possible heap.
+ */
+uint32_t process_memlimit(uint32_t heap_end)
+{
+    process_table_t *process = process_get_current_process_entry();
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    uint32_t old_pages, new_pages;
+
+    if (heap_end == 0)
+        return process->heap_end;
+
+    if (heap_end < process->heap_start || heap_end > process->heap_max)
+        return 0;
+
+    /* The region covers every page with a byte of the heap */
+    old_pages = (process->heap_end + PAGE_SIZE - 1) & PAGE_SIZE_MASK;
+    new_pages = (heap_end + PAGE_SIZE - 1) & PAGE_SIZE_MASK;
+
+    if (new_pages > old_pages) {
+        if (vm_reserve(pagetable, old_pages, new_pages, 1) < 0)
+            return 0;
+    } else if (new_pages < old_pages) {
+        if (vm_unreserve(pagetable, new_pages, old_pages) < 0)
+            return 0;
+        process->resident_pages -=
+            vm_unmap_range(pagetable, new_pages, old_pages);
+    }
+
+    process->heap_end = heap_end;
+    return heap_end;
+}
+
+/**
+ * Maps a range of zeroed pages which stays shared with the children
+ * of the current process when it forks, instead of becoming
+ * copy-on-write. Processes can synchronize through futexes in the
+ * range, since the futexes of the parent and the children are on the
+ * same physical pages. The range is taken from the top of the room
+ * left for the heap, and all of its pages are mapped right away so
+ * that every page is shared by a fork.
+ *
+ * @param pages Number of pages in the range
+ *
+ * @return Address of the range, or 0 if pages is not positive, there
+ * is no room for the range or no memory for its pages.
+ */
+uint32_t process_shmem(int pages)
+{
+    process_table_t *process = process_get_current_process_entry();
+    pagetable_t *pagetable = thread_get_current_thread_entry()->pagetable;
+    uint32_t start, vaddr, phys;
+
+    if (pages <= 0
+        || (uint32_t)pages > (process->heap_max - process->heap_end) / PAGE_SIZE)
+        return 0;
+
+    start = process->heap_max - pages*PAGE_SIZE;
+    if (vm_reserve_shared(pagetable, start, start + pages*PAGE_SIZE) < 0)
+        return 0;
+
+    for (vaddr = start; vaddr < start + pages*PAGE_SIZE; vaddr += PAGE_SIZE) {
+        phys = pagepool_get_zeroed_page();
+        if (phys == 0 || vm_map(pagetable, phys, vaddr, 1) < 0) {
+            if (phys != 0)
+                pagepool_free_phys_page(phys);
+            process->resident_pages -=
+                vm_unmap_range(pagetable, start, vaddr);
+            vm_unreserve(pagetable, start, start + pages*PAGE_SIZE);
+            return 0;
+        }
+        process->resident_pages++;
+    }
+
+    /* The heap may not grow into the range */
+    process->heap_max = start;
+    return start;
+}
+
+/* Allocates and maps the page at vaddr in the given region of the
+ * current process, loading its part of the file-backed data from the
+ * executable. Returns 1 on success and -1 if no memory was available
+ * or the executable could not be read. */
+static int process_load_page(process_table_t *process,
+                             pagetable_t *pagetable,
+                             pagetable_region_t *region, uint32_t vaddr)
+{
+    uint32_t phys_page = 0;
+    uint32_t offset = vaddr - region->start;
+    int length = 0;
+
+    if (offset < region->filesize)
+        length = MIN(region->filesize - offset, PAGE_SIZE);
+
+    /* A page full of file data needs no zeroing */
+    if (length == PAGE_SIZE)
+        phys_page = pagepool_get_phys_page();
+    if (phys_page == 0)
+        phys_page = pagepool_get_zeroed_page();
+    if (phys_page == 0)
+        return -1;
+
+    if (length > 0) {
+        /* The page is not mapped yet, so it is filled through its
+           kernel address. */
+        if (vfs_seek(process->exec_file, region->offset + offset) != VFS_OK
+            || vfs_read(process->exec_file,
+                        (void *)ADDR_PHYS_TO_KERNEL(phys_page),
+                        length) != length) {
+            pagepool_free_phys_page(phys_page);
+            return -1;
+        }
+        stats_inc(process_stat_loaded);
+    }
+
+    if (vm_map(pagetable, phys_page, vaddr, region->dirty) < 0) {
+        pagepool_free_phys_page(phys_page);
+        return -1;
+    }
+    process->resident_pages++;
+
+    return 1;
+}
+
+/**
+ * Handles a TLB miss on an address which is not mapped in the
+ * pagetable. If the address is in a demand paged region of the
+ * current process, a page is mapped there: segments of the executable
+ * are loaded from the file, the stack, BSS and heap get zeroed pages.
+ * Since code and data are mostly used in order, a fault on a
+ * file-backed page also loads the next few unmapped pages of the
+ * region. Called from the TLB exception handlers with interrupts
+ * disabled. Loading from the executable sleeps on file system locks,
+ * see process_prefault.
+ *
+ * @param vaddr The faulting address
+ *
+ * @return 1 if a page was mapped, 0 if the address is not reserved
+ * and -1 if the page could not be allocated or loaded.
+ */
+int process_page_fault(uint32_t vaddr)
+{
+    thread_table_t *thread = thread_get_current_thread_entry();
+    process_table_t *process;
+    pagetable_region_t *region;
+    uint32_t page;
+    int i;
+
+    if (thread->process_id < 0 || thread->pagetable == NULL)
+        return 0;
+
+    region = vm_find_region(thread->pagetable, vaddr);
+    if (region == NULL)
+        return 0;
+
+    process = &process_table[thread->process_id];
+    page = vaddr & PAGE_SIZE_MASK;
+
+    if (process_load_page(process, thread->pagetable, region, page) < 0)
+        return -1;
+
+    for (i = 1; i < PROCESS_READAHEAD_PAGES; i++) {
+        page += PAGE_SIZE;
+        if (page >= region->end || page - region->start >= region->filesize)
+            break;
+        if (vm_translate(thread->pagetable, page) != 0)
+            continue;
+        /* Read ahead is optional, a failure only stops it */
+        if (process_load_page(process, thread->pagetable, region, page) < 0)
+            break;
+        stats_inc(process_stat_readahead);
+    }
+
+    return 1;
+}
+
+/**
+ * Handles a write to a page whose TLB entry is not dirty. If the page
+ * is in a writable region of the current process, it is a page shared
+ * copy-on-write after a fork, and the process gets its own copy of it
+ * (see vm_copy_on_write). Called from the TLB modified exception
+ * handler.
+ *
+ * @param vaddr The faulting address
+ *
+ * @return 1 if the page is writable now, 0 if the page is read-only
+ * and -1 if no memory was available for the copy.
+ */
+int process_write_fault(uint32_t vaddr)
+{
+    thread_table_t *thread = thread_get_current_thread_entry();
+    pagetable_region_t *region;
+    uint32_t phys;
+    int result;
+
+    if (thread->process_id < 0 || thread->pagetable == NULL)
+        return 0;
+
+    region = vm_find_region(thread->pagetable, vaddr);
+    if (region == NULL || !region->dirty)
+        return 0;
+
+    phys = vm_translate(thread->pagetable, vaddr);
+    result = vm_copy_on_write(thread->pagetable, vaddr);
+    if (result > 0 && vm_translate(thread->pagetable, vaddr) != phys)
+        stats_inc(process_stat_copied);
+
+    return result;
+}
+
+/**
+ * Maps the pages of a userland buffer by touching each of them.
+ * Syscalls call this before passing the buffer to code which holds
+ * locks while accessing it, like the file system and the TTY
+ * driver: faulting on a page of the executable there could need the
+ * same locks to load the page. A buffer the kernel writes to is also
+ * written here, so that copy-on-write pages are copied first.
+ *
+ * @param buffer Start of the buffer in the current address space
+ *
+ * @param length Length of the buffer in bytes
+ *
+ * @param write 1 if the kernel writes to the buffer, 0 if it only
+ * reads it
+ */
+void process_prefault(const void *buffer, int length, int write)
+{
+    uint32_t addr = (uint32_t)buffer;
+    uint32_t end = addr + length;
+    volatile uint8_t *p;
+
+    if (length <= 0)
+        return;
+
+    while (addr < end) {
+        p = (volatile uint8_t *)addr;
+        if (write)
+            *p = *p;
+        else
+            (void)*p;
+        addr = (addr & PAGE_SIZE_MASK) + PAGE_SIZE;
+    }
+}
+
+/**
+ * Returns the resident set size of a process, i.e. the number of
+ * physical pages mapped in its address space. Pages are counted when
+ * they are mapped, so pages of the heap which have not been touched
+ * yet are not included. A process which has exited has no resident
+ * pages.
+ *
+ * @param pid The process, or -1 for the current process
+ *
+ * @return The number of resident pages, or -1 if there is no such
+ * process.
+ */
+int process_get_rss(process_id_t pid)
+{
+    if (pid == -1)
+        pid = process_get_current_process();
+
+    if (pid < 0 || pid >= PROCESS_MAX_PROCESSES
+        || process_table[pid].state == PROCESS_FREE)
+        return -1;
+
+    return process_table[pid].resident_pages;
+}
+
 int process_add_file(openfile_t fd)
 {
     interrupt_status_t intr_status;
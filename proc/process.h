@@ -38,15 +38,19 @@
 #define BUENOS_PROC_PROCESS
 
 #include "lib/types.h"
+#include "kernel/lock_cond.h"
+#include "kernel/cswitch.h"
 
 #define USERLAND_STACK_TOP 0x7fffeffc
 
 #define PROCESS_PTABLE_FULL  -1
 #define PROCESS_ILLEGAL_JOIN -2
+#define PROCESS_FORK_FAILED  -3
 
 #define PROCESS_MAX_FILELENGTH 256
 #define PROCESS_MAX_PROCESSES  128
 #define PROCESS_MAX_FILES      10
+#define PROCESS_MAX_SEMAPHORES 16
 
 typedef int process_id_t;
 
@@ -61,9 +65,30 @@ typedef struct {
     process_state_t state;
     int retval;
     process_id_t parent;
+    /* Signalled when the process becomes a zombie */
+    cond_t exited;
 
     uint32_t cFiles;
     int files[PROCESS_MAX_FILES];
+
+    /* The executable, kept open for loading pages on demand. Not in
+       files, so userland can not close it. -1 if not open. */
+    int exec_file;
+
+    /* Semaphores of the process, indexed by handle. A forked child
+       gets the same semaphores (see usersem.c). */
+    struct usersem_struct *semaphores[PROCESS_MAX_SEMAPHORES];
+
+    /* The heap is [heap_start, heap_end), right above the RW segment.
+       It is a demand paged region of the pagetable, so its pages are
+       mapped on first touch. heap_max is the highest
+       end the address space has room for. */
+    uint32_t heap_start;
+    uint32_t heap_end;
+    uint32_t heap_max;
+
+    /* Number of physical pages mapped in the address space */
+    int resident_pages;
 } process_table_t;
 
 /* Initialize the process table */
@@ -76,6 +101,11 @@ process_id_t process_spawn(const char *executable);
 process_id_t process_spawn_deadline(const char *executable, int deadline);
 
 
+/* Copy the current process into a new one, sharing its pages
+ * copy-on-write. Returns the PID of the child, which returns 0 from
+ * the syscall. */
+process_id_t process_fork(context_t *user_context);
+
 process_id_t process_get_current_process(void);
 process_table_t *process_get_current_process_entry(void);
 
@@ -87,6 +117,32 @@ void process_finish(int retval);
  * Only works on child processes */
 int process_join(process_id_t pid);
 
+/* Set the end of the heap of the current process (0 to query it).
+ * Returns the new end, or 0 on error. */
+uint32_t process_memlimit(uint32_t heap_end);
+
+/* Map the given number of pages which stay shared with forked
+ * children. Returns their address, or 0 on error. */
+uint32_t process_shmem(int pages);
+
+/* Map a page for a fault at vaddr in a demand paged region of the
+ * current process. Returns 1 if mapped, 0 if vaddr is not reserved and
+ * -1 if the page could not be allocated or loaded. */
+int process_page_fault(uint32_t vaddr);
+
+/* Handle a write to a non-dirty page of the current process, copying
+ * a copy-on-write page. Returns 1 if the page is writable now, 0 if
+ * it is read-only and -1 if no memory was available for the copy. */
+int process_write_fault(uint32_t vaddr);
+
+/* Map the pages of a userland buffer before it is used with locks
+ * held. write is 1 if the kernel writes to the buffer. */
+void process_prefault(const void *buffer, int length, int write);
+
+/* Number of pages mapped by the given process (-1 for the current
+ * one), or -1 if there is no such process. */
+int process_get_rss(process_id_t pid);
+
 /* Add a file to the current process's file list. Returns negative value on
  * error. */
 int process_add_file(int fd);
@@ -39,12 +39,25 @@
 #include "kernel/panic.h"
 #include "lib/libc.h"
 #include "kernel/assert.h"
+#include "kernel/spinlock.h"
+#include "kernel/stats.h"
+#include "kernel/thread.h"
 #include "proc/process.h"
+#include "proc/futex.h"
+#include "proc/usersem.h"
 #include "drivers/device.h"
 #include "drivers/gcd.h"
 #include "drivers/metadev.h"
 #include "fs/vfs.h"
 
+/* Statistics counter for system calls */
+static stat_id_t syscall_stat_count;
+
+void syscall_init(void)
+{
+    syscall_stat_count = stats_register("system calls");
+}
+
 void syscall_exit(int retval)
 {
     process_finish(retval);
@@ -54,6 +67,10 @@ int syscall_write(uint32_t fd, char *s, int len)
 {
     gcd_t *gcd;
     device_t *dev;
+
+    /* The drivers access the buffer with locks held */
+    process_prefault(s, len, 0);
+
     if (fd == FILEHANDLE_STDOUT || fd == FILEHANDLE_STDERR)
     {
         dev = device_get(YAMS_TYPECODE_TTY, 0);
@@ -69,6 +86,10 @@ int syscall_read(uint32_t fd, char *s, int len)
 {
     gcd_t *gcd;
     device_t *dev;
+
+    /* The drivers access the buffer with locks held */
+    process_prefault(s, len, 1);
+
     if (fd == FILEHANDLE_STDIN)
     {
         dev = device_get(YAMS_TYPECODE_TTY, 0);
@@ -80,6 +101,11 @@ int syscall_read(uint32_t fd, char *s, int len)
     return VFS_NOT_OPEN;
 }
 
+process_id_t syscall_fork(context_t *user_context)
+{
+    return process_fork(user_context);
+}
+
 int syscall_join(process_id_t pid)
 {
     return process_join(pid);
@@ -145,6 +171,7 @@ int syscall_filecount(char *path)
 
 int syscall_file(char *path, int idx, char *buffer)
 {
+    process_prefault(buffer, VFS_NAME_LENGTH, 1);
     return vfs_file(path, idx, buffer);
 }
 
@@ -152,6 +179,73 @@ int syscall_getclock(){
   return rtc_get_msec();
 }
 
+uint32_t syscall_memlimit(uint32_t heap_end)
+{
+    return process_memlimit(heap_end);
+}
+
+int syscall_rss(int pid)
+{
+    return process_get_rss(pid);
+}
+
+uint32_t syscall_shmem(int pages)
+{
+    return process_shmem(pages);
+}
+
+int syscall_sleep(int msec)
+{
+    if (msec < 0)
+        return -1;
+    thread_sleep(msec);
+    return 0;
+}
+
+int syscall_futex_wait(uint32_t *uaddr, uint32_t val)
+{
+    return futex_wait(uaddr, val);
+}
+
+int syscall_futex_wake(uint32_t *uaddr, int count)
+{
+    return futex_wake(uaddr, count);
+}
+
+int syscall_sem_create(int value)
+{
+    return usersem_create(value);
+}
+
+int syscall_sem_p(int handle)
+{
+    return usersem_P(handle);
+}
+
+int syscall_sem_v(int handle)
+{
+    return usersem_V(handle);
+}
+
+int syscall_sem_destroy(int handle)
+{
+    return usersem_destroy(handle);
+}
+
+int syscall_lockstat(spinlock_stat_t *stats, int max)
+{
+    if (max < 0)
+        return -1;
+    return spinlock_profile_get(stats, max);
+}
+
+int syscall_stats(stat_entry_t *entries, int max)
+{
+    if (max < 0)
+        return -1;
+    return stats_get_all(entries, max);
+}
+
 /**
  * Handle system calls. Interrupts are enabled when this function is
  * called.
@@ -173,6 +267,8 @@ void syscall_handle(context_t *user_context)
      * returning from this function the userland context will be
      * restored from user_context.
      */
+    stats_inc(syscall_stat_count);
+
     switch(user_context->cpu_regs[MIPS_REGISTER_A0]) {
         case SYSCALL_HALT:
             halt_kernel();
@@ -192,6 +288,10 @@ void syscall_handle(context_t *user_context)
             user_context->cpu_regs[MIPS_REGISTER_V0] =
                 syscall_join(A1);
             break;
+        case SYSCALL_FORK:
+            user_context->cpu_regs[MIPS_REGISTER_V0] =
+                syscall_fork(user_context);
+            break;
         case SYSCALL_EXEC:
             user_context->cpu_regs[MIPS_REGISTER_V0] =
                 syscall_exec((char *)A1, (int) A2);
@@ -228,6 +328,54 @@ void syscall_handle(context_t *user_context)
             user_context->cpu_regs[MIPS_REGISTER_V0] =
                 syscall_getclock();
             break;
+        case SYSCALL_MEMLIMIT:
+            user_context->cpu_regs[MIPS_REGISTER_V0] =
+                syscall_memlimit((uint32_t)A1);
+            break;
+        case SYSCALL_SLEEP:
+            user_context->cpu_regs[MIPS_REGISTER_V0] =
+                syscall_sleep(A1);
+            break;
+        case SYSCALL_RSS:
+            user_context->cpu_regs[MIPS_REGISTER_V0] =
+                syscall_rss(A1);
+            break;
+        case SYSCALL_SHMEM:
+            user_context->cpu_regs[MIPS_REGISTER_V0] =
+                syscall_shmem(A1);
+            break;
+        case SYSCALL_FUTEX_WAIT:
+            user_context->cpu_regs[MIPS_REGISTER_V0] =
+                syscall_futex_wait((uint32_t *)A1, A2);
+            break;
+        case SYSCALL_FUTEX_WAKE:
+            user_context->cpu_regs[MIPS_REGISTER_V0] =
+                syscall_futex_wake((uint32_t *)A1, A2);
+            break;
+        case SYSCALL_SEM_CREATE:
+            user_context->cpu_regs[MIPS_REGISTER_V0] =
+                syscall_sem_create(A1);
+            break;
+        case SYSCALL_SEM_P:
+            user_context->cpu_regs[MIPS_REGISTER_V0] =
+                syscall_sem_p(A1);
+            break;
+        case SYSCALL_SEM_V:
+            user_context->cpu_regs[MIPS_REGISTER_V0] =
+                syscall_sem_v(A1);
+            break;
+        case SYSCALL_SEM_DESTROY:
+            user_context->cpu_regs[MIPS_REGISTER_V0] =
+                syscall_sem_destroy(A1);
+            break;
+        case SYSCALL_STATS:
+            user_context->cpu_regs[MIPS_REGISTER_V0] =
+                syscall_stats((stat_entry_t *)A1, A2);
+            break;
+        case SYSCALL_LOCKSTAT:
+            user_context->cpu_regs[MIPS_REGISTER_V0] =
+                syscall_lockstat((spinlock_stat_t *)A1, A2);
+            break;
         default:
             KERNEL_PANIC("Unhandled system call\n");
     }
@@ -48,6 +48,9 @@
 #define SYSCALL_MEMLIMIT 0x105
 
 #define SYSCALL_GETCLOCK  0x10C
+#define SYSCALL_SLEEP     0x10D
+#define SYSCALL_RSS       0x10E
+#define SYSCALL_SHMEM     0x10F
 
 #define SYSCALL_OPEN      0x201
 #define SYSCALL_CLOSE     0x202
@@ -59,6 +62,16 @@
 #define SYSCALL_FILECOUNT 0x208
 #define SYSCALL_FILE      0x209
 
+#define SYSCALL_FUTEX_WAIT 0x301
+#define SYSCALL_FUTEX_WAKE 0x302
+#define SYSCALL_SEM_CREATE  0x303
+#define SYSCALL_SEM_P       0x304
+#define SYSCALL_SEM_V       0x305
+#define SYSCALL_SEM_DESTROY 0x306
+
+#define SYSCALL_LOCKSTAT   0x401
+#define SYSCALL_STATS      0x402
+
 /* When userland program reads or writes these already open files it
  * actually accesses the console.
  */
@@ -66,4 +79,9 @@
 #define FILEHANDLE_STDOUT 1
 #define FILEHANDLE_STDERR 2
 
+#ifndef __ASSEMBLER__
+/* Kernel side initialization of the system call handler */
+void syscall_init(void);
+#endif
+
 #endif
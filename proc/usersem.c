@@ -0,0 +1,198 @@
+/*
+ * Userland semaphores.
+ */
+
+#include "proc/usersem.h"
+#include "kernel/semaphore.h"
+#include "kernel/atomic.h"
+#include "kernel/slab.h"
+
+/** @name Userland semaphores
+ *
+ * Counting semaphores for userland programs. Each process has a small
+ * table of the semaphores it can use, and userland refers to them by
+ * their index in that table (the handle), much like file handles.
+ *
+ * A forked child inherits the table, so a semaphore created before
+ * the fork is shared by the parent and the child, and they can use it
+ * to wait for each other. The semaphore counts the handles referring
+ * to it, and the last handle to go destroys it. Handles left in the
+ * table go when the process finishes.
+ *
+ * The table is only accessed by the thread running the process, so
+ * it needs no locking. The reference count is updated atomically,
+ * since the handles of other processes come and go concurrently.
+ *
+ * @{
+ */
+
+/* Returns the semaphore of the current process with the given
+ * handle, or NULL if the handle is not valid. */
+static usersem_t *usersem_get(int handle)
+{
+    if (handle < 0 || handle >= PROCESS_MAX_SEMAPHORES)
+        return NULL;
+
+    return process_get_current_process_entry()->semaphores[handle];
+}
+
+/* Drops one reference to the semaphore, destroying it if this was
+ * the last one. Returns USERSEM_OK, or USERSEM_EBUSY if the semaphore
+ * could not be destroyed because threads are waiting on it, in which
+ * case the reference is kept. */
+static int usersem_put(usersem_t *usem)
+{
+    uint32_t refs;
+
+    for (;;) {
+        refs = usem->refs;
+        if (refs == 1)
+            break;
+        if (_atomic_cas(&usem->refs, refs, refs - 1) == refs)
+            return USERSEM_OK;
+    }
+
+    /* This is the only handle left, so no other process can reach
+       the semaphore any more. */
+    if (semaphore_destroy(usem->sem) < 0)
+        return USERSEM_EBUSY;
+
+    kmem_free(usem);
+    return USERSEM_OK;
+}
+
+/**
+ * Creates a semaphore for the current process.
+ *
+ * @param value Initial value of the semaphore, non-negative
+ *
+ * @return The handle of the semaphore, or a negative USERSEM_* error.
+ */
+int usersem_create(int value)
+{
+    process_table_t *process = process_get_current_process_entry();
+    usersem_t *usem;
+    int handle;
+
+    if (value < 0)
+        return USERSEM_EINVAL;
+
+    for (handle = 0; handle < PROCESS_MAX_SEMAPHORES; handle++)
+        if (process->semaphores[handle] == NULL)
+            break;
+
+    if (handle == PROCESS_MAX_SEMAPHORES)
+        return USERSEM_EFULL;
+
+    usem = (usersem_t *)kmem_alloc(sizeof(usersem_t));
+    if (usem == NULL)
+        return USERSEM_ENOMEM;
+
+    usem->sem = semaphore_create(value);
+    if (usem->sem == NULL) {
+        kmem_free(usem);
+        return USERSEM_ENOMEM;
+    }
+    usem->refs = 1;
+
+    process->semaphores[handle] = usem;
+    return handle;
+}
+
+/**
+ * Lowers the semaphore, blocking while its value is zero.
+ *
+ * @param handle Handle of the semaphore
+ *
+ * @return USERSEM_OK or USERSEM_EINVAL.
+ */
+int usersem_P(int handle)
+{
+    usersem_t *usem = usersem_get(handle);
+
+    if (usem == NULL)
+        return USERSEM_EINVAL;
+
+    semaphore_P(usem->sem);
+    return USERSEM_OK;
+}
+
+/**
+ * Raises the semaphore, waking one waiter if there are any.
+ *
+ * @param handle Handle of the semaphore
+ *
+ * @return USERSEM_OK or USERSEM_EINVAL.
+ */
+int usersem_V(int handle)
+{
+    usersem_t *usem = usersem_get(handle);
+
+    if (usem == NULL)
+        return USERSEM_EINVAL;
+
+    semaphore_V(usem->sem);
+    return USERSEM_OK;
+}
+
+/**
+ * Frees the handle of the semaphore. The semaphore itself is
+ * destroyed when no process has a handle to it any more.
+ *
+ * @param handle Handle of the semaphore
+ *
+ * @return USERSEM_OK, USERSEM_EINVAL or USERSEM_EBUSY if threads are
+ * waiting on the semaphore.
+ */
+int usersem_destroy(int handle)
+{
+    usersem_t *usem = usersem_get(handle);
+
+    if (usem == NULL)
+        return USERSEM_EINVAL;
+
+    if (usersem_put(usem) < 0)
+        return USERSEM_EBUSY;
+
+    process_get_current_process_entry()->semaphores[handle] = NULL;
+    return USERSEM_OK;
+}
+
+/**
+ * Gives the child of a fork handles to all semaphores of the current
+ * process, with the same handle numbers.
+ *
+ * @param child The process table entry of the child
+ */
+void usersem_fork(process_table_t *child)
+{
+    process_table_t *process = process_get_current_process_entry();
+    int handle;
+
+    for (handle = 0; handle < PROCESS_MAX_SEMAPHORES; handle++) {
+        if (process->semaphores[handle] != NULL)
+            _atomic_add(&process->semaphores[handle]->refs, 1);
+        child->semaphores[handle] = process->semaphores[handle];
+    }
+}
+
+/**
+ * Frees all semaphore handles left by the current process when it
+ * finishes. Semaphores shared with other processes stay alive for
+ * them. The others are only used by the finishing thread, so nobody
+ * can be waiting on them.
+ */
+void usersem_cleanup(void)
+{
+    process_table_t *process = process_get_current_process_entry();
+    int handle;
+
+    for (handle = 0; handle < PROCESS_MAX_SEMAPHORES; handle++) {
+        if (process->semaphores[handle] != NULL) {
+            usersem_put(process->semaphores[handle]);
+            process->semaphores[handle] = NULL;
+        }
+    }
+}
+
+/** @} */
@@ -0,0 +1,39 @@
+/*
+ * Userland semaphores.
+ */
+
+#ifndef BUENOS_PROC_USERSEM
+#define BUENOS_PROC_USERSEM
+
+#include "proc/process.h"
+#include "kernel/semaphore.h"
+
+/* Return values of the semaphore operations. Non-negative values
+ * mean success. */
+#define USERSEM_OK      0
+#define USERSEM_EINVAL -1 /* Invalid handle or initial value */
+#define USERSEM_EFULL  -2 /* The process has too many semaphores */
+#define USERSEM_ENOMEM -3 /* No memory for a new semaphore */
+#define USERSEM_EBUSY  -4 /* Threads are waiting on the semaphore */
+
+/* A semaphore of userland, shared by all handles referring to it */
+typedef struct usersem_struct {
+    semaphore_t *sem;
+    /* Number of handles, in all processes, referring to it */
+    uint32_t refs;
+} usersem_t;
+
+/* Create a semaphore with the given initial value. Returns a handle. */
+int usersem_create(int value);
+
+int usersem_P(int handle);
+int usersem_V(int handle);
+int usersem_destroy(int handle);
+
+/* Give the child of a fork the semaphores of the current process. */
+void usersem_fork(process_table_t *child);
+
+/* Destroy all semaphores of the current (finishing) process. */
+void usersem_cleanup(void);
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * Large address space test. The BSS array and the heap together need
+ * far more pages than fit in the TLB, so their entries must be loaded
+ * on TLB misses. Every page is written and then checked.
+ */
+
+#include "tests/lib.h"
+
+#define BSS_PAGES 128
+#define HEAP_PAGES 512
+
+static int bss[BSS_PAGES * 1024];
+
+int main(void)
+{
+  int *heap;
+  int i, errors = 0;
+
+  for (i = 0; i < BSS_PAGES; i++)
+    bss[i * 1024] = i;
+
+  heap = syscall_memlimit(NULL);
+  if (syscall_memlimit((char *)heap + HEAP_PAGES * 4096) == NULL) {
+    printf("Could not grow the heap to %d pages\n", HEAP_PAGES);
+    return 1;
+  }
+  for (i = 0; i < HEAP_PAGES; i++)
+    heap[i * 1024] = i;
+
+  for (i = 0; i < BSS_PAGES; i++)
+    if (bss[i * 1024] != i)
+      errors++;
+  for (i = 0; i < HEAP_PAGES; i++)
+    if (heap[i * 1024] != i)
+      errors++;
+
+  printf("Resident pages: %d\n", syscall_rss(-1));
+  printf("%d pages with wrong contents\n", errors);
+  printf("Test done.\n");
+  return errors != 0;
+}
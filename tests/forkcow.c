@@ -0,0 +1,74 @@
+/*
+ * Copy-on-write fork test. Fills a large heap, forks and times the
+ * fork: the pages are shared, so it should only cost the pagetable
+ * copy. The child changes a few pages, which are copied on the first
+ * write, and both processes check that they still see their own
+ * contents.
+ */
+
+#include "tests/lib.h"
+
+#define PAGES 256
+#define CHILD_WRITES 8
+
+/* Number of pages whose first word is not the given value plus the
+   page number */
+static int check(int *heap, int first, int count, int value)
+{
+  int i, errors = 0;
+
+  for (i = first; i < first + count; i++)
+    if (heap[i * 1024] != value + i)
+      errors++;
+  return errors;
+}
+
+int main(void)
+{
+  int *heap;
+  int i, start, time, copied, errors;
+  pid_t child;
+
+  heap = syscall_memlimit(NULL);
+  if (syscall_memlimit((char *)heap + PAGES * 4096) == NULL) {
+    printf("Could not grow the heap to %d pages\n", PAGES);
+    return 1;
+  }
+  for (i = 0; i < PAGES; i++)
+    heap[i * 1024] = i;
+
+  copied = syscall_stat_get("pages copied on write");
+  start = syscall_getclock();
+  child = syscall_fork();
+
+  if (child == 0) {
+    /* Pages written by the child get new contents, the rest must
+       still be shared with the parent */
+    for (i = 0; i < CHILD_WRITES; i++)
+      heap[i * 1024] = 1000 + i;
+    errors = check(heap, 0, CHILD_WRITES, 1000)
+      + check(heap, CHILD_WRITES, PAGES - CHILD_WRITES, 0);
+    syscall_exit(errors);
+  }
+
+  time = syscall_getclock() - start;
+  if (child < 0) {
+    printf("Fork failed: %d\n", child);
+    return 1;
+  }
+  printf("Forked a process with %d pages in %d ms\n",
+         syscall_rss(-1), time);
+
+  errors = syscall_join(child);
+  printf("Child saw %d pages with wrong contents\n", errors);
+
+  /* The child's writes must not show up here */
+  errors = check(heap, 0, PAGES, 0);
+  printf("Parent sees %d pages with wrong contents\n", errors);
+
+  printf("%d pages copied on write (at least %d)\n",
+         syscall_stat_get("pages copied on write") - copied, CHILD_WRITES);
+
+  printf("Test done.\n");
+  return errors != 0;
+}
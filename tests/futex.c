@@ -0,0 +1,41 @@
+/*
+ * Userland futex, mutex and condition variable test.
+ */
+
+#include "tests/lib.h"
+
+mutex_t mutex = MUTEX_INITIALIZER;
+cond_t cond = COND_INITIALIZER;
+uint32_t word = 1;
+
+int main(void)
+{
+  int ret;
+
+  /* Waiting on a futex which does not hold the expected value must
+     return immediately. */
+  ret = syscall_futex_wait(&word, 0);
+  printf("futex_wait on changed word returned %d (expected -1)\n", ret);
+
+  ret = syscall_futex_wait((uint32_t *)0x80000000, 0);
+  printf("futex_wait on kernel address returned %d (expected -2)\n", ret);
+
+  ret = syscall_futex_wake(&word, 1);
+  printf("futex_wake without waiters returned %d (expected 0)\n", ret);
+
+  /* Uncontended mutex and condition variable operations never enter
+     the kernel. */
+  mutex_lock(&mutex);
+  printf("trylock on held mutex returned %d (expected 0)\n",
+         mutex_trylock(&mutex));
+  cond_signal(&cond);
+  cond_broadcast(&cond);
+  mutex_unlock(&mutex);
+
+  printf("trylock on free mutex returned %d (expected 1)\n",
+         mutex_trylock(&mutex));
+  mutex_unlock(&mutex);
+
+  printf("Test done.\n");
+  return 0;
+}
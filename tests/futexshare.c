@@ -0,0 +1,90 @@
+/*
+ * Test of futexes shared by two processes. A mutex, a condition
+ * variable and a counter live in pages from syscall_shmem, which stay
+ * shared after the fork. The parent and the child take turns through
+ * the condition variable, so each of them sleeps until the other
+ * wakes it, and both add to a counter under the mutex.
+ */
+
+#include "tests/lib.h"
+
+#define ROUNDS 100
+#define INCREMENTS 1000
+
+typedef struct {
+  mutex_t mutex;
+  cond_t cond;
+  int turn;     /* 0 for the parent, 1 for the child */
+  int rounds;   /* turns taken by both */
+  int counter;
+} shared_t;
+
+/* Takes ROUNDS turns, waiting on the condition variable until it is
+   the turn of 'me' */
+static void take_turns(shared_t *s, int me)
+{
+  int i;
+
+  for (i = 0; i < ROUNDS; i++) {
+    mutex_lock(&s->mutex);
+    while (s->turn != me)
+      cond_wait(&s->cond, &s->mutex);
+    s->rounds++;
+    s->turn = !me;
+    cond_broadcast(&s->cond);
+    mutex_unlock(&s->mutex);
+  }
+}
+
+/* Adds INCREMENTS to the counter, one at a time under the mutex */
+static void add(shared_t *s)
+{
+  int i;
+
+  for (i = 0; i < INCREMENTS; i++) {
+    mutex_lock(&s->mutex);
+    s->counter++;
+    mutex_unlock(&s->mutex);
+  }
+}
+
+int main(void)
+{
+  shared_t *s;
+  pid_t child;
+  int ret;
+
+  s = syscall_shmem(1);
+  if (s == NULL) {
+    printf("Could not map a shared page\n");
+    return 1;
+  }
+  mutex_init(&s->mutex);
+  cond_init(&s->cond);
+  s->turn = 0;
+  s->rounds = 0;
+  s->counter = 0;
+
+  child = syscall_fork();
+  if (child == 0) {
+    take_turns(s, 1);
+    add(s);
+    syscall_exit(0);
+  }
+  if (child < 0) {
+    printf("Fork failed: %d\n", child);
+    return 1;
+  }
+
+  take_turns(s, 0);
+  add(s);
+
+  ret = syscall_join(child);
+  printf("Child returned %d (expected 0)\n", ret);
+  printf("%d turns taken (expected %d)\n", s->rounds, 2 * ROUNDS);
+  printf("Counter is %d (expected %d)\n", s->counter, 2 * INCREMENTS);
+
+  printf("Test done.\n");
+  return ret != 0 || s->rounds != 2 * ROUNDS
+    || s->counter != 2 * INCREMENTS;
+}
@@ -0,0 +1,55 @@
+/*
+ * Heap growth test. Allocates a megabyte in pieces, which only works
+ * if malloc can grow the heap with syscall_memlimit.
+ */
+
+#include "tests/lib.h"
+
+#define CHUNK 16384
+#define CHUNKS 64
+
+int main(void)
+{
+  int *chunks[CHUNKS];
+  void *start, *end;
+  int i, j, errors = 0;
+
+  heap_init();
+  start = syscall_memlimit(NULL);
+
+  for (i = 0; i < CHUNKS; i++) {
+    chunks[i] = malloc(CHUNK);
+    if (chunks[i] == NULL) {
+      printf("malloc failed after %d bytes\n", i * CHUNK);
+      return 1;
+    }
+    for (j = 0; j < CHUNK / 4; j++) {
+      chunks[i][j] = i + j;
+    }
+  }
+
+  for (i = 0; i < CHUNKS; i++) {
+    for (j = 0; j < CHUNK / 4; j++) {
+      if (chunks[i][j] != i + j) {
+        errors++;
+      }
+    }
+  }
+
+  end = syscall_memlimit(NULL);
+  printf("Heap grew by %d bytes, %d errors\n",
+         (int)((char *)end - (char *)start), errors);
+
+  /* Freed memory is reused without growing the heap */
+  for (i = 0; i < CHUNKS; i++) {
+    free(chunks[i]);
+  }
+  chunks[0] = malloc(CHUNK * 4);
+  printf("Reuse %s\n", syscall_memlimit(NULL) == end ? "ok" : "GREW");
+
+  printf("memlimit below heap start returned %p (expected 0)\n",
+         syscall_memlimit((char *)start - 4096));
+
+  printf("Test done.\n");
+  return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Lazy loading test. The read-only table below is stored in the
+ * executable but only loaded when touched, so the resident size
+ * should grow by a few pages at a time (the read ahead window) and
+ * the contents must still match the file.
+ */
+
+#include "tests/lib.h"
+
+#define TABLE_PAGES 8
+
+static const char table[TABLE_PAGES][4096] = {
+  "page 0", "page 1", "page 2", "page 3",
+  "page 4", "page 5", "page 6", "page 7"
+};
+
+int main(void)
+{
+  char expected[8] = "page 0";
+  int i, rss, errors = 0;
+
+  rss = syscall_rss(-1);
+  printf("Resident pages at start: %d\n", rss);
+
+  printf("Touching the last page of the table\n");
+  if (strcmp(table[TABLE_PAGES - 1], "page 7") != 0)
+    errors++;
+  printf("Resident pages: %d (at most %d more)\n", syscall_rss(-1), 4);
+
+  for (i = 0; i < TABLE_PAGES; i++) {
+    expected[5] = '0' + i;
+    if (strcmp(table[i], expected) != 0)
+      errors++;
+  }
+  printf("Resident pages after touching all: %d\n", syscall_rss(-1));
+
+  printf("%d pages with wrong contents\n", errors);
+  printf("Test done.\n");
+  return errors != 0;
+}
@@ -73,6 +73,17 @@ pid_t syscall_execp(const char *filename, int argc, const char **argv)
 }
 
 
+/* Create a copy of the current process. Both processes continue
+ * after the call: the child gets 0 as the return value, the parent
+ * the process ID of the child. Negative values are errors. The copy
+ * starts with the same memory contents, but without open files.
+ */
+pid_t syscall_fork(void)
+{
+  return (int)_syscall(SYSCALL_FORK, 0, 0, 0);
+}
+
+
 /* Exit the current process with exit code 'retval'. Note that
  * 'retval' must be non-negative since syscall_join's negative return
  * values are interpreted as errors in the join call itself. This
@@ -92,6 +103,15 @@ int syscall_getclock()
 }
 
 
+/* Sleep for at least 'msec' milliseconds without using the CPU.
+ * Returns 0 on success, or a negative value if 'msec' is negative.
+ */
+int syscall_sleep(int msec)
+{
+  return (int)_syscall(SYSCALL_SLEEP, (uint32_t)msec, 0, 0);
+}
+
+
 /* Wait until the execution of the process identified by 'pid' is
  * finished. Returns the exit code of the joined process, or a
  * negative value on error.
@@ -112,6 +132,27 @@ void *syscall_memlimit(void *heap_end)
 }
 
 
+/* Returns the number of physical pages mapped by the process
+ * identified by 'pid', or by the calling process if 'pid' is -1.
+ * Returns a negative value if there is no such process.
+ */
+int syscall_rss(pid_t pid)
+{
+  return (int)_syscall(SYSCALL_RSS, (uint32_t)pid, 0, 0);
+}
+
+
+/* Maps 'pages' zeroed pages which stay shared with the children
+ * forked after this call, instead of being copied. Futexes, and so
+ * mutexes and condition variables, in them work across the
+ * processes. Returns the address of the pages, or NULL on error.
+ */
+void *syscall_shmem(int pages)
+{
+  return (void*)_syscall(SYSCALL_SHMEM, (uint32_t)pages, 0, 0);
+}
+
+
 /* Open the file identified by 'filename' for reading and
  * writing. Returns the file handle of the opened file (positive
  * value), or a negative value on error.
@@ -193,6 +234,91 @@ int syscall_file(const char *pathname, int idx, char *buffer)
                        (uint32_t)idx, (uint32_t)buffer);
 }
 
+/* Sleep on the futex at 'uaddr' if it still contains 'val'. Returns 0
+ * when woken, or a negative value if the futex did not contain 'val'
+ * (-1) or 'uaddr' is not a valid address (-2).
+ */
+int syscall_futex_wait(uint32_t *uaddr, uint32_t val)
+{
+  return (int)_syscall(SYSCALL_FUTEX_WAIT, (uint32_t)uaddr, val, 0);
+}
+
+/* Wake at most 'count' threads sleeping on the futex at
+ * 'uaddr'. Returns the number of threads woken, or a negative value on
+ * error.
+ */
+int syscall_futex_wake(uint32_t *uaddr, int count)
+{
+  return (int)_syscall(SYSCALL_FUTEX_WAKE, (uint32_t)uaddr,
+                       (uint32_t)count, 0);
+}
+
+/* Create a counting semaphore with initial value 'value'. Returns a
+ * handle to the semaphore, or a negative value on error.
+ */
+usr_sem_t syscall_sem_create(int value)
+{
+  return (usr_sem_t)_syscall(SYSCALL_SEM_CREATE, (uint32_t)value, 0, 0);
+}
+
+/* Lower the semaphore 'sem', waiting while its value is zero. Returns
+ * 0 on success, or a negative value if the handle is invalid.
+ */
+int syscall_sem_p(usr_sem_t sem)
+{
+  return (int)_syscall(SYSCALL_SEM_P, (uint32_t)sem, 0, 0);
+}
+
+/* Raise the semaphore 'sem'. Returns 0 on success, or a negative
+ * value if the handle is invalid.
+ */
+int syscall_sem_v(usr_sem_t sem)
+{
+  return (int)_syscall(SYSCALL_SEM_V, (uint32_t)sem, 0, 0);
+}
+
+/* Destroy the semaphore 'sem'. Returns 0 on success, or a negative
+ * value if the handle is invalid or threads are waiting on it.
+ */
+int syscall_sem_destroy(usr_sem_t sem)
+{
+  return (int)_syscall(SYSCALL_SEM_DESTROY, (uint32_t)sem, 0, 0);
+}
+
+/* Copy the names and values of at most 'max' kernel statistics
+ * counters to 'entries'. Returns the number of counters copied.
+ */
+int syscall_stats(stat_entry_t *entries, int max)
+{
+  return (int)_syscall(SYSCALL_STATS, (uint32_t)entries, (uint32_t)max, 0);
+}
+
+#ifdef PROVIDE_STRING_FUNCTIONS
+/* Return the value of the kernel statistics counter called 'name',
+ * or 0 if there is no such counter.
+ */
+int syscall_stat_get(const char *name)
+{
+  static stat_entry_t entries[64];
+  int i, n;
+
+  n = syscall_stats(entries, 64);
+  for (i = 0; i < n; i++)
+    if (strcmp(entries[i].name, name) == 0)
+      return entries[i].value;
+  return 0;
+}
+#endif
+
+/* Copy the contention statistics of at most 'max' kernel spinlocks
+ * to 'stats'. Returns the number of entries copied, or a negative
+ * value if the kernel was built without the spinlock profiler.
+ */
+int syscall_lockstat(lockstat_t *stats, int max)
+{
+  return (int)_syscall(SYSCALL_LOCKSTAT, (uint32_t)stats, (uint32_t)max, 0);
+}
+
 /* The following functions are not system calls, but convenient
    library functions inspired by POSIX and the C standard library. */
 
@@ -686,6 +812,19 @@ int snprintf(char *str, int size, const  char  *fmt, ...) {
 /* Heap allocation. */
 #ifdef PROVIDE_HEAP_ALLOCATOR
 
+/* The heap allocator has two parts. Small blocks (at most
+   HEAP_SMALL_MAX bytes) are served from segregated free lists, one
+   per size class, so allocating and freeing them takes constant
+   time. Each block has a one word header holding its total size, so
+   free() can tell small blocks from large ones. When a size class
+   runs out of blocks, a run of HEAP_RUN_SIZE bytes is taken from the
+   large allocator and carved into blocks of that class. Runs are
+   never given back.
+
+   Large blocks come from a first-fit free list sorted by address,
+   which merges neighbouring free blocks. The heap itself grows with
+   syscall_memlimit. */
+
 typedef struct free_block {
   size_t size;
   struct free_block *next;
@@ -693,23 +832,59 @@ typedef struct free_block {
 
 static const size_t MIN_ALLOC_SIZE = sizeof(free_block_t);
 
+/* Free list of the large allocator, sorted by address. */
 free_block_t *free_list;
 
-byte heap[HEAP_SIZE];
+/* Free small blocks of each size class. The link is stored in the
+   first word after the header. */
+static free_block_t *heap_bins[HEAP_BINS];
 
-/* Initialise the heap - malloc et al won't work unless this is called
-   first. */
+static heap_stats_t heap_stats;
+
+/* Current end of the heap, as set with syscall_memlimit. */
+static byte *heap_end = NULL;
+
+/* Initialise the heap. The heap starts out empty and is grown with
+   syscall_memlimit as needed; the kernel maps the pages when they are
+   first touched. */
 void heap_init()
 {
-  free_list = (free_block_t*) heap;
-  free_list->size = HEAP_SIZE;
-  free_list->next = NULL;
+  int i;
+  free_list = NULL;
+  for (i = 0; i < HEAP_BINS; i++) {
+    heap_bins[i] = NULL;
+  }
+  heap_end = syscall_memlimit(NULL);
 }
 
+/* Grow the heap by at least size bytes and add the new space to the
+   free list. Returns 0 on success, or -1 if the kernel refused. */
+static int heap_grow(size_t size)
+{
+  free_block_t *block;
+  byte *new_end;
+
+  size = MAX(size, HEAP_GROW_SIZE);
+  size = (size + HEAP_GROW_SIZE - 1) & ~(HEAP_GROW_SIZE - 1);
 
-/* Return a block of at least size bytes, or NULL if no such block 
-   can be found.  */
-void *malloc(size_t size) {
+  new_end = syscall_memlimit(heap_end + size);
+  if (new_end == NULL) {
+    return -1;
+  }
+
+  block = (free_block_t*) heap_end;
+  block->size = new_end - heap_end;
+  heap_end = new_end;
+  heap_stats.heap_size += block->size;
+  /* Freeing merges the new space with a free block just below it. */
+  heap_firstfit_free(((byte*)block)+sizeof(size_t));
+  return 0;
+}
+
+/* Return a block of at least size bytes from the first-fit free
+   list, growing the heap if needed, or NULL if no such block can be
+   found. */
+void *heap_firstfit_malloc(size_t size) {
   free_block_t *block;
   free_block_t **prev_p; /* Previous link so we can remove an element */
   if (size == 0) {
@@ -724,6 +899,11 @@ void *malloc(size_t size) {
     size += 4;
   }
 
+  if (heap_end == NULL) {
+    heap_init();
+  }
+
+ retry:
   /* Iterate through list of free blocks, using the first that is
      big enough for the request. */
   for (block = free_list, prev_p = &free_list;
@@ -746,12 +926,15 @@ void *malloc(size_t size) {
     /* Else, check the next block. */
   }
 
-  /* No heap space left. */
+  /* No heap space left, ask the kernel for more. */
+  if (heap_grow(size + sizeof(size_t) + MIN_ALLOC_SIZE) == 0) {
+    goto retry;
+  }
   return NULL;
 }
 
-/* Return the block pointed to by ptr to the free pool. */
-void free(void *ptr)
+/* Return the block pointed to by ptr to the first-fit free list. */
+void heap_firstfit_free(void *ptr)
 {
   if (ptr != NULL) { /* Freeing NULL is a no-op */
     free_block_t *block = (free_block_t*)((byte*)ptr-sizeof(size_t));
@@ -793,6 +976,91 @@ void free(void *ptr)
   }
 }
 
+/* Carve a new run into blocks of size class bin. Returns 0 on
+   success, -1 if out of memory. */
+static int heap_refill_bin(int bin)
+{
+  size_t block_size = (bin + 1) * HEAP_SMALL_STEP + sizeof(size_t);
+  byte *run = heap_firstfit_malloc(HEAP_RUN_SIZE - sizeof(size_t));
+  free_block_t *block;
+  size_t offset;
+
+  if (run == NULL) {
+    return -1;
+  }
+  heap_stats.runs++;
+
+  for (offset = 0;
+       offset + block_size <= HEAP_RUN_SIZE - sizeof(size_t);
+       offset += block_size) {
+    block = (free_block_t*)(run + offset);
+    block->size = block_size;
+    block->next = heap_bins[bin];
+    heap_bins[bin] = block;
+  }
+  return 0;
+}
+
+/* Return a block of at least size bytes, or NULL if no such block 
+   can be found.  */
+void *malloc(size_t size) {
+  free_block_t *block;
+  void *ptr;
+  int bin;
+
+  if (size == 0) {
+    return NULL;
+  }
+
+  if (size > HEAP_SMALL_MAX) {
+    ptr = heap_firstfit_malloc(size);
+    if (ptr != NULL) {
+      heap_stats.allocs++;
+      heap_stats.large_allocs++;
+    }
+    return ptr;
+  }
+
+  bin = (size - 1) / HEAP_SMALL_STEP;
+  if (heap_bins[bin] == NULL && heap_refill_bin(bin) < 0) {
+    return NULL;
+  }
+
+  block = heap_bins[bin];
+  heap_bins[bin] = block->next;
+  heap_stats.allocs++;
+  heap_stats.small_allocs++;
+  return ((byte*)block)+sizeof(size_t);
+}
+
+/* Return the block pointed to by ptr to the free pool. */
+void free(void *ptr)
+{
+  free_block_t *block;
+  int bin;
+
+  if (ptr == NULL) { /* Freeing NULL is a no-op */
+    return;
+  }
+
+  heap_stats.frees++;
+  block = (free_block_t*)((byte*)ptr-sizeof(size_t));
+  if (block->size > HEAP_SMALL_MAX + sizeof(size_t)) {
+    heap_firstfit_free(ptr);
+    return;
+  }
+
+  bin = (block->size - sizeof(size_t) - 1) / HEAP_SMALL_STEP;
+  block->next = heap_bins[bin];
+  heap_bins[bin] = block;
+}
+
+/* Copy the allocation statistics to 'stats'. */
+void heap_get_stats(heap_stats_t *stats)
+{
+  *stats = heap_stats;
+}
+
 void *calloc(size_t nmemb, size_t size)
 {
   size_t i;
@@ -808,7 +1076,7 @@ void *calloc(size_t nmemb, size_t size)
 void *realloc(void *ptr, size_t size)
 {
   byte *new_ptr;
-  size_t i;
+  size_t i, old_size;
   if (ptr == NULL) {
     return malloc(size);
   }
@@ -818,12 +1086,19 @@ void *realloc(void *ptr, size_t size)
     return NULL;
   }
 
+  /* Nothing to do if the block is already big enough. */
+  old_size = ((free_block_t*)((byte*)ptr-sizeof(size_t)))->size
+    - sizeof(size_t);
+  if (size <= old_size) {
+    return ptr;
+  }
+
   /* Simple implementation: allocate new space and copy the contents
      over.  Exercise: Improve this by searching through the free
      list and seeing whether an actual enlargement is possible. */
   new_ptr = malloc(size);
   if (new_ptr != NULL) {
-    for (i = 0; i < size; i++) {
+    for (i = 0; i < old_size; i++) {
       new_ptr[i] = ((byte*)ptr)[i];
     }
     free(ptr);
@@ -850,3 +1125,90 @@ int atoi(const char *nptr)
 }
 
 #endif
+
+#ifdef PROVIDE_SYNCHRONIZATION
+
+/* Mutexes and condition variables built on futexes. A mutex or
+   condition variable that nobody is waiting for is handled entirely
+   with atomic operations, the kernel is only entered to sleep and to
+   wake sleepers. */
+
+void mutex_init(mutex_t *mutex)
+{
+  mutex->state = 0;
+}
+
+/* Lock the mutex if it is free. Returns 1 if the lock was taken,
+   0 otherwise. */
+int mutex_trylock(mutex_t *mutex)
+{
+  return _atomic_cas(&mutex->state, 0, 1) == 0;
+}
+
+void mutex_lock(mutex_t *mutex)
+{
+  uint32_t c;
+
+  if ((c = _atomic_cas(&mutex->state, 0, 1)) == 0) {
+    return;
+  }
+
+  /* Contended: mark the mutex as having waiters and sleep until
+     it is released. */
+  if (c != 2) {
+    c = _atomic_swap(&mutex->state, 2);
+  }
+  while (c != 0) {
+    syscall_futex_wait(&mutex->state, 2);
+    c = _atomic_swap(&mutex->state, 2);
+  }
+}
+
+void mutex_unlock(mutex_t *mutex)
+{
+  if (_atomic_swap(&mutex->state, 0) == 2) {
+    syscall_futex_wake(&mutex->state, 1);
+  }
+}
+
+void cond_init(cond_t *cond)
+{
+  cond->seq = 0;
+  cond->waiters = 0;
+}
+
+/* Atomically release the mutex and wait for the condition to be
+   signalled. The mutex is held again when this function returns. As
+   with any condition variable, wake-ups may be spurious. */
+void cond_wait(cond_t *cond, mutex_t *mutex)
+{
+  uint32_t seq = cond->seq;
+
+  _atomic_add(&cond->waiters, 1);
+  mutex_unlock(mutex);
+
+  /* If the condition was signalled after seq was read, the futex no
+     longer contains seq and we return immediately. */
+  syscall_futex_wait(&cond->seq, seq);
+
+  _atomic_add(&cond->waiters, -1);
+  mutex_lock(mutex);
+}
+
+void cond_signal(cond_t *cond)
+{
+  _atomic_add(&cond->seq, 1);
+  if (cond->waiters > 0) {
+    syscall_futex_wake(&cond->seq, 1);
+  }
+}
+
+void cond_broadcast(cond_t *cond)
+{
+  _atomic_add(&cond->seq, 1);
+  if (cond->waiters > 0) {
+    syscall_futex_wake(&cond->seq, 0x7fffffff);
+  }
+}
+
+#endif
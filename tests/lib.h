@@ -47,6 +47,7 @@
 #define PROVIDE_FORMATTED_OUTPUT
 #define PROVIDE_HEAP_ALLOCATOR
 #define PROVIDE_MISC
+#define PROVIDE_SYNCHRONIZATION
 
 #include <stdarg.h>
 #include <stddef.h>
@@ -82,6 +83,7 @@ pid_t syscall_execp(const char *filename, int argc, const char **argv);
 int syscall_join(pid_t pid);
 void syscall_exit(int retval);
 int syscall_getclock();
+int syscall_sleep(int msec);
 
 int syscall_open(const char *filename);
 int syscall_close(int filehandle);
@@ -94,8 +96,50 @@ int syscall_delete(const char *filename);
 int syscall_filecount(const char *pathname);
 int syscall_file(const char *pathname, int index, char *buffer);
 
-int syscall_fork(void (*func)(int), int arg);
+pid_t syscall_fork(void);
 void *syscall_memlimit(void *heap_end);
+int syscall_rss(pid_t pid);
+void *syscall_shmem(int pages);
+
+int syscall_futex_wait(uint32_t *uaddr, uint32_t val);
+int syscall_futex_wake(uint32_t *uaddr, int count);
+
+/* Spinlock contention statistics of one kernel lock, as returned by
+   syscall_lockstat (same layout as the kernel's spinlock_stat_t).
+   Times are in CPU cycles. */
+typedef struct {
+  char name[32];
+  uint32_t acquisitions;
+  uint32_t contended;
+  uint32_t spin_cycles;
+  uint32_t max_hold;
+} lockstat_t;
+
+int syscall_lockstat(lockstat_t *stats, int max);
+
+/* Name and value of a kernel statistics counter, as returned by
+   syscall_stats. */
+typedef struct {
+  char name[32];
+  uint32_t value;
+} stat_entry_t;
+
+int syscall_stats(stat_entry_t *entries, int max);
+#ifdef PROVIDE_STRING_FUNCTIONS
+int syscall_stat_get(const char *name);
+#endif
+
+typedef int usr_sem_t;
+
+usr_sem_t syscall_sem_create(int value);
+int syscall_sem_p(usr_sem_t sem);
+int syscall_sem_v(usr_sem_t sem);
+int syscall_sem_destroy(usr_sem_t sem);
+
+/* Atomic operations (in _atomic.S). All return the previous value. */
+uint32_t _atomic_cas(uint32_t *ptr, uint32_t old, uint32_t new);
+uint32_t _atomic_swap(uint32_t *ptr, uint32_t value);
+uint32_t _atomic_add(uint32_t *ptr, int delta);
 
 #ifdef PROVIDE_STRING_FUNCTIONS
 size_t strlen(const char *s);
@@ -125,16 +169,61 @@ int snprintf(char *, int, const char *, ...);
 #endif
 
 #ifdef PROVIDE_HEAP_ALLOCATOR
-#define HEAP_SIZE 256 /* 256 byte heap - puny! */
+#define HEAP_GROW_SIZE 4096 /* the heap grows by at least this much */
+#define HEAP_SMALL_MAX 256  /* larger blocks come from the first-fit list */
+#define HEAP_SMALL_STEP 8   /* size difference of small size classes */
+#define HEAP_BINS (HEAP_SMALL_MAX / HEAP_SMALL_STEP)
+#define HEAP_RUN_SIZE 4096  /* bytes carved into small blocks at a time */
+
+/* Allocation statistics, see heap_get_stats. */
+typedef struct {
+  int allocs;       /* successful calls to malloc */
+  int frees;        /* calls to free with a non-NULL pointer */
+  int small_allocs; /* allocations served from the size classes */
+  int large_allocs; /* allocations served from the first-fit list */
+  int runs;         /* runs carved into small blocks */
+  int heap_size;    /* bytes obtained with syscall_memlimit */
+} heap_stats_t;
+
 void heap_init();
 void *calloc(size_t nmemb, size_t size);
 void *malloc(size_t size);
 void free(void *ptr);
 void *realloc(void *ptr, size_t size);
+void heap_get_stats(heap_stats_t *stats);
+/* The first-fit allocator used for large blocks. Blocks from it must
+   be freed with heap_firstfit_free. */
+void *heap_firstfit_malloc(size_t size);
+void heap_firstfit_free(void *ptr);
 #endif
 
 #ifdef PROVIDE_MISC
 int atoi(const char *nptr);
 #endif
 
+#ifdef PROVIDE_SYNCHRONIZATION
+/* 0 = unlocked, 1 = locked, 2 = locked and possibly contended */
+typedef struct {
+  uint32_t state;
+} mutex_t;
+
+typedef struct {
+  uint32_t seq;     /* Incremented on every signal */
+  uint32_t waiters; /* Number of threads in cond_wait */
+} cond_t;
+
+#define MUTEX_INITIALIZER {0}
+#define COND_INITIALIZER {0, 0}
+
+void mutex_init(mutex_t *mutex);
+int mutex_trylock(mutex_t *mutex);
+void mutex_lock(mutex_t *mutex);
+void mutex_unlock(mutex_t *mutex);
+
+void cond_init(cond_t *cond);
+void cond_wait(cond_t *cond, mutex_t *mutex);
+void cond_signal(cond_t *cond);
+void cond_broadcast(cond_t *cond);
+#endif
+
 #endif /* BUENOS_USERLAND_LIB_H */
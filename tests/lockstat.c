@@ -0,0 +1,31 @@
+/*
+ * Prints kernel spinlock contention statistics.
+ */
+
+#include "tests/lib.h"
+
+#define MAX_LOCKS 64
+
+lockstat_t stats[MAX_LOCKS];
+
+int main(void)
+{
+  int i, n;
+
+  n = syscall_lockstat(stats, MAX_LOCKS);
+  if (n < 0) {
+    printf("Kernel was built without CONFIG_SPINLOCK_PROFILE.\n");
+    return 1;
+  }
+
+  printf("%s: acquired/contended/spin/max hold\n", "lock");
+  for (i = 0; i < n; i++) {
+    if (stats[i].acquisitions == 0)
+      continue;
+    printf("%s: %d/%d/%d/%d\n", stats[i].name,
+           stats[i].acquisitions, stats[i].contended,
+           stats[i].spin_cycles, stats[i].max_hold);
+  }
+
+  return 0;
+}
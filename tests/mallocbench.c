@@ -0,0 +1,81 @@
+/*
+ * Heap allocator benchmark. Runs the same random sequence of
+ * allocations and frees with malloc (size classes in front of the
+ * first-fit list) and with the plain first-fit allocator, and prints
+ * the time taken by each.
+ */
+
+#include "tests/lib.h"
+
+#define SLOTS 256
+#define ROUNDS 20000
+
+static void *slots[SLOTS];
+static uint32_t seed;
+
+static uint32_t next_random(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) & 0x7fff;
+}
+
+/* Mostly small blocks with an occasional large one. */
+static size_t random_size(void)
+{
+  uint32_t r = next_random();
+  if (r % 16 == 0) {
+    return 512 + r % 2048;
+  }
+  return 8 + r % 200;
+}
+
+static int run(const char *name, void *(*alloc)(size_t),
+               void (*release)(void *))
+{
+  int i, slot, start, failures = 0;
+
+  seed = 42;
+  start = syscall_getclock();
+
+  for (i = 0; i < ROUNDS; i++) {
+    slot = next_random() % SLOTS;
+    if (slots[slot] != NULL) {
+      release(slots[slot]);
+      slots[slot] = NULL;
+    } else {
+      slots[slot] = alloc(random_size());
+      if (slots[slot] == NULL) {
+        failures++;
+      }
+    }
+  }
+
+  for (slot = 0; slot < SLOTS; slot++) {
+    release(slots[slot]);
+    slots[slot] = NULL;
+  }
+
+  printf("%-10s %d operations in %d ms, %d failures\n", name, ROUNDS,
+         syscall_getclock() - start, failures);
+  return failures;
+}
+
+int main(void)
+{
+  heap_stats_t stats;
+  int failures;
+
+  heap_init();
+
+  failures = run("first-fit", heap_firstfit_malloc, heap_firstfit_free);
+  failures += run("malloc", malloc, free);
+
+  heap_get_stats(&stats);
+  printf("malloc: %d allocs (%d small, %d large), %d frees, "
+         "%d runs, heap %d bytes\n",
+         stats.allocs, stats.small_allocs, stats.large_allocs,
+         stats.frees, stats.runs, stats.heap_size);
+
+  printf("Test done.\n");
+  return failures != 0;
+}
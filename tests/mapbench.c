@@ -0,0 +1,50 @@
+/*
+ * Mapping benchmark. Grows the heap in steps and maps each step by
+ * touching its pages, printing the time per page as the address space
+ * grows. Mapping a page and loading its TLB entry should cost the same
+ * no matter how many pages are already mapped.
+ */
+
+#include "tests/lib.h"
+
+#define STEP_PAGES 256
+#define STEPS 4
+#define ROUNDS 100
+
+int main(void)
+{
+  char *heap;
+  volatile char *p;
+  int step, i, round, start, map_time, refill_time;
+
+  heap = syscall_memlimit(NULL);
+
+  for (step = 0; step < STEPS; step++) {
+    p = heap + step * STEP_PAGES * 4096;
+    if (syscall_memlimit((char *)p + STEP_PAGES * 4096) == NULL) {
+      printf("Could not grow the heap\n");
+      return 1;
+    }
+
+    /* First touch: page fault and mapping */
+    start = syscall_getclock();
+    for (i = 0; i < STEP_PAGES; i++)
+      p[i * 4096] = 1;
+    map_time = syscall_getclock() - start;
+
+    /* Mapped pages, every other one: each access is to a new page
+       pair, and the step has more pairs than the TLB has entries */
+    start = syscall_getclock();
+    for (round = 0; round < ROUNDS; round++)
+      for (i = 0; i < STEP_PAGES; i += 2)
+        p[i * 4096]++;
+    refill_time = syscall_getclock() - start;
+
+    printf("%4d pages mapped: %d us/page to map, %d ms for %d misses\n",
+           (step + 1) * STEP_PAGES, map_time * 1000 / STEP_PAGES,
+           refill_time, ROUNDS * STEP_PAGES / 2);
+  }
+
+  printf("Test done.\n");
+  return 0;
+}
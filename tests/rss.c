@@ -0,0 +1,51 @@
+/*
+ * Resident set size test. Checks that touching the heap grows the
+ * resident size of the process, and that the pages of exited children
+ * are given back to the kernel.
+ */
+
+#include "tests/lib.h"
+
+#define ROUNDS 20
+
+static const char prog[] = "[disk1]hw"; /* The child to start. */
+
+/* Pages allocated minus pages freed by the kernel. */
+static int pages_in_use(void)
+{
+  return syscall_stat_get("pages allocated") - syscall_stat_get("pages freed");
+}
+
+int main(void)
+{
+  char *heap;
+  int i, before, after, rss;
+  pid_t child;
+
+  rss = syscall_rss(-1);
+  printf("Resident pages at start: %d\n", rss);
+
+  heap = syscall_memlimit(NULL);
+  syscall_memlimit(heap + 4 * 4096);
+  for (i = 0; i < 4; i++)
+    heap[i * 4096] = 1;
+  printf("After touching 4 heap pages: %d (expected %d)\n",
+         syscall_rss(-1), rss + 4);
+
+  /* Warm up, so that the caches of the kernel are filled */
+  syscall_join(syscall_exec(prog, -1));
+
+  before = pages_in_use();
+  for (i = 0; i < ROUNDS; i++) {
+    child = syscall_exec(prog, -1);
+    syscall_join(child);
+  }
+  after = pages_in_use();
+
+  printf("Pages in use changed by %d over %d children\n",
+         after - before, ROUNDS);
+  printf("RSS of a joined child: %d (expected -1)\n", syscall_rss(child));
+
+  printf("Test done.\n");
+  return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * Userland semaphore test.
+ */
+
+#include "tests/lib.h"
+
+int main(void)
+{
+  usr_sem_t sem, sems[20];
+  int i, n;
+
+  sem = syscall_sem_create(2);
+  printf("sem_create(2) returned %d\n", sem);
+
+  /* The value is 2, so two P operations must not block */
+  syscall_sem_p(sem);
+  syscall_sem_p(sem);
+  syscall_sem_v(sem);
+  syscall_sem_p(sem);
+  printf("P, P, V, P done without blocking\n");
+
+  printf("sem_p on bad handle returned %d (expected -1)\n",
+         syscall_sem_p(sem + 100));
+  printf("sem_create(-1) returned %d (expected -1)\n",
+         syscall_sem_create(-1));
+  printf("sem_destroy returned %d (expected 0)\n", syscall_sem_destroy(sem));
+  printf("second sem_destroy returned %d (expected -1)\n",
+         syscall_sem_destroy(sem));
+
+  /* Fill the handle table; leftover semaphores are cleaned up at exit */
+  for (n = 0; n < 20; n++) {
+    sems[n] = syscall_sem_create(0);
+    if (sems[n] < 0)
+      break;
+  }
+  printf("created %d semaphores before running out of handles\n", n);
+  for (i = 0; i < n; i += 2)
+    syscall_sem_destroy(sems[i]);
+
+  printf("Test done.\n");
+  return 0;
+}
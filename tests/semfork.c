@@ -0,0 +1,64 @@
+/*
+ * Test of semaphores shared across fork. The parent and the child
+ * take turns through two semaphores created before the fork, so each
+ * of them blocks until the other wakes it. The child also destroys
+ * its handles, which must not take the semaphores from the parent.
+ */
+
+#include "tests/lib.h"
+
+#define ROUNDS 100
+
+int main(void)
+{
+  usr_sem_t ping, pong;
+  int i, turns, errors;
+  pid_t child;
+
+  ping = syscall_sem_create(0);
+  pong = syscall_sem_create(0);
+  if (ping < 0 || pong < 0) {
+    printf("Could not create the semaphores\n");
+    return 1;
+  }
+
+  turns = 0;
+  child = syscall_fork();
+
+  if (child == 0) {
+    /* turns is private after the fork: it counts the child's turns */
+    for (i = 0; i < ROUNDS; i++) {
+      syscall_sem_p(ping);
+      turns++;
+      syscall_sem_v(pong);
+    }
+    errors = (turns != ROUNDS);
+    if (syscall_sem_destroy(ping) != 0 || syscall_sem_destroy(pong) != 0)
+      errors++;
+    syscall_exit(errors);
+  }
+
+  if (child < 0) {
+    printf("Fork failed: %d\n", child);
+    return 1;
+  }
+
+  for (i = 0; i < ROUNDS; i++) {
+    syscall_sem_v(ping);
+    syscall_sem_p(pong);
+    turns++;
+  }
+  printf("Parent and child took %d turns each\n", turns);
+
+  errors = syscall_join(child);
+  printf("Child reported %d errors\n", errors);
+
+  /* The child's handles are gone, the parent's must still work */
+  syscall_sem_v(ping);
+  syscall_sem_p(ping);
+  printf("sem_destroy returned %d and %d (expected 0 and 0)\n",
+         syscall_sem_destroy(ping), syscall_sem_destroy(pong));
+
+  printf("Test done.\n");
+  return errors != 0 || turns != ROUNDS;
+}
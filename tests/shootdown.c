@@ -0,0 +1,49 @@
+/*
+ * TLB shootdown benchmark. Grows the heap, touches it and shrinks it
+ * again, so that the kernel unmaps the pages and removes them from
+ * the TLBs. The process sleeps between rounds, so it is likely to run
+ * on a different CPU each time and shootdowns need to interrupt the
+ * CPUs it ran on before. Run with 1 to 4 CPUs in yams.conf to compare
+ * the cost.
+ */
+
+#include "tests/lib.h"
+
+#define PAGES 64
+#define ROUNDS 100
+
+int main(void)
+{
+  char *heap;
+  volatile char *p;
+  int i, round, start, time = 0, shootdowns, ipis, rss;
+
+  heap = syscall_memlimit(NULL);
+  p = heap;
+  rss = syscall_rss(-1);
+
+  shootdowns = syscall_stat_get("TLB shootdowns");
+  ipis = syscall_stat_get("TLB shootdown IPIs");
+
+  for (round = 0; round < ROUNDS; round++) {
+    syscall_memlimit(heap + PAGES * 4096);
+    for (i = 0; i < PAGES; i++)
+      p[i * 4096] = 1;
+
+    syscall_sleep(1);
+
+    start = syscall_getclock();
+    syscall_memlimit(heap);
+    time += syscall_getclock() - start;
+  }
+
+  shootdowns = syscall_stat_get("TLB shootdowns") - shootdowns;
+  ipis = syscall_stat_get("TLB shootdown IPIs") - ipis;
+
+  printf("%d shrinks of %d pages in %d ms\n", ROUNDS, PAGES, time);
+  printf("%d shootdowns, %d IPIs\n", shootdowns, ipis);
+  printf("Resident pages: %d (expected %d)\n", syscall_rss(-1), rss);
+
+  printf("Test done.\n");
+  return 0;
+}
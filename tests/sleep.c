@@ -0,0 +1,24 @@
+/*
+ * Sleep system call test.
+ */
+
+#include "tests/lib.h"
+
+int main(void)
+{
+  int msecs[] = {0, 1, 10, 100, 1000};
+  int i, start, slept;
+
+  for (i = 0; i < 5; i++) {
+    start = syscall_getclock();
+    syscall_sleep(msecs[i]);
+    slept = syscall_getclock() - start;
+    printf("Asked to sleep %d ms, slept %d ms%s\n", msecs[i], slept,
+           slept < msecs[i] ? " (TOO SHORT)" : "");
+  }
+
+  printf("sleep(-1) returned %d (expected -1)\n", syscall_sleep(-1));
+
+  printf("Test done.\n");
+  return 0;
+}
@@ -0,0 +1,20 @@
+/*
+ * Prints the kernel statistics counters.
+ */
+
+#include "tests/lib.h"
+
+#define MAX_STATS 64
+
+stat_entry_t stats[MAX_STATS];
+
+int main(void)
+{
+  int i, n;
+
+  n = syscall_stats(stats, MAX_STATS);
+  for (i = 0; i < n; i++)
+    printf("%s: %d\n", stats[i].name, stats[i].value);
+
+  return 0;
+}
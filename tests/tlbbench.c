@@ -0,0 +1,41 @@
+/*
+ * TLB miss benchmark. Walks over more page pairs than fit in the TLB,
+ * so that nearly every access misses, and prints the time per miss
+ * and how many misses the kernel handled in C. Boot once normally and
+ * once with "tlb_refill=slow" to compare the refill fast path with
+ * the generic exception path.
+ */
+
+#include "tests/lib.h"
+
+#define PAGES 512
+#define ROUNDS 200
+
+static char area[PAGES * 4096];
+
+int main(void)
+{
+  int i, round, start, time, misses, slow;
+  volatile char *p = area;
+
+  /* Map every page first, so that only refills are measured */
+  for (i = 0; i < PAGES; i++)
+    p[i * 4096] = 1;
+
+  slow = syscall_stat_get("TLB misses (slow path)");
+  start = syscall_getclock();
+  /* Every other page, so that each access is to a new page pair */
+  for (round = 0; round < ROUNDS; round++)
+    for (i = 0; i < PAGES; i += 2)
+      p[i * 4096]++;
+  time = syscall_getclock() - start;
+  slow = syscall_stat_get("TLB misses (slow path)") - slow;
+
+  misses = ROUNDS * PAGES / 2;
+  printf("%d accesses in %d ms (%d ns each)\n", misses, time,
+         time * 1000 / (misses / 1000));
+  printf("%d of them handled in C\n", slow);
+
+  printf("Test done.\n");
+  return 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * Kernel virtual mapping area purge test. Pipe buffers are allocated
+ * with vmalloc, so creating and deleting pipes over and over leaves
+ * stale pages in the area until a purge reclaims them. Each round
+ * sends a different string through a new pipe and reads it back,
+ * which fails if a buffer address is reused while an old mapping is
+ * still in a TLB.
+ */
+
+#include "tests/lib.h"
+
+/* More than the purge threshold, a quarter of the area */
+#define ROUNDS 1500
+
+int main(void)
+{
+  char out[3], in[3];
+  int i, fd, purges, errors = 0;
+
+  purges = syscall_stat_get("vmap purges");
+
+  for (i = 0; i < ROUNDS; i++) {
+    if (syscall_create("[pipe]purge", 0) < 0) {
+      printf("Could not create the pipe in round %d\n", i);
+      return 1;
+    }
+    fd = syscall_open("[pipe]purge");
+    if (fd < 0) {
+      printf("Could not open the pipe in round %d\n", i);
+      return 1;
+    }
+
+    out[0] = 'a' + i % 26;
+    out[1] = 'a' + i / 26 % 26;
+    out[2] = 'a' + i / 676 % 26;
+    if (syscall_write(fd, out, 3) != 3
+        || syscall_read(fd, in, 3) != 3
+        || in[0] != out[0] || in[1] != out[1] || in[2] != out[2])
+      errors++;
+
+    syscall_close(fd);
+    syscall_delete("[pipe]purge");
+  }
+
+  printf("%d rounds with wrong data (expected 0)\n", errors);
+  printf("%d vmap purges (expected at least 1)\n",
+         syscall_stat_get("vmap purges") - purges);
+  printf("%d waits for a purge\n", syscall_stat_get("vmap purge waits"));
+
+  printf("Test done.\n");
+  return errors != 0;
+}
@@ -35,22 +35,99 @@
  */
 
 #include "vm/pagepool.h"
-#include "lib/bitmap.h"
 #include "kernel/kmalloc.h"
 #include "kernel/spinlock.h"
 #include "kernel/interrupt.h"
 #include "kernel/assert.h"
+#include "kernel/stats.h"
+#include "kernel/config.h"
+#include "kernel/thread.h"
+#include "kernel/sleepq.h"
+#include "kernel/atomic.h"
+#include "kernel/scheduler.h"
+#include "drivers/bootargs.h"
+#include "drivers/metadev.h"
 
 /** @name Page pool
  *
  * Functions and data structures for handling physical page reservation.
  *
+ * Free pages are managed with a buddy allocator. Free memory is kept
+ * as blocks of 2^order contiguous pages, aligned to their size, with
+ * one free list per order. An allocation takes a block from the
+ * smallest non-empty list of sufficient order and splits it in
+ * halves until it has the requested size; the unused halves go to
+ * the free lists. A freed block is merged with its buddy (the other
+ * half of the block of the next order) for as long as the buddy is
+ * free too. Both take O(log n) steps.
+ *
+ * Memory is split in two zones with their own free lists. Pages in
+ * the first 512MB are reachable through KSEG0, so the kernel can use
+ * them directly; pagepool_get_phys_page and pagepool_get_phys_pages
+ * only return such pages. Pages above that (high memory) are only
+ * handed out by pagepool_get_high_page, for users which map the page
+ * themselves, e.g. vmalloc. The zone boundary is aligned to the
+ * largest block, so buddies are always in the same zone.
+ *
+ * Single pages, by far the most common request, are served from
+ * per-CPU magazines of free pages in front of the buddy allocator.
+ * A CPU takes the pool lock only when its magazine runs empty or
+ * full, and then moves a batch of pages at once. Pages in magazines
+ * count as allocated as far as the buddy allocator is concerned.
+ *
+ * A background thread, which runs only when the CPU would otherwise
+ * be idle, keeps a stock of pages which are already filled with
+ * zeros. pagepool_get_zeroed_page hands these out, so callers that
+ * need clean pages do not have to clear them on their critical path.
+ *
+ * When the number of free pages falls below the low watermark, a
+ * reclaim thread asks the registered shrinkers (caches which can give
+ * memory back) for pages, cheapest first, until the high watermark is
+ * reached. An allocation of a single page which finds no free pages
+ * runs the shrinkers itself before giving up (direct reclaim), so
+ * pagepool_get_phys_page and the allocators built on it must not be
+ * called with spinlocks held. Caches kept per CPU, like the page
+ * magazines, are drained on their own CPUs: a shrinker empties the
+ * cache of the CPU it runs on and queues the others to be emptied by
+ * their schedulers.
+ *
+ * Allocated pages have a reference count, which starts at one.
+ * Pages shared by several owners are referenced with
+ * pagepool_page_ref, and each owner drops its reference with
+ * pagepool_page_unref; the page is freed with the last reference.
+ *
  * @{
  */
 
-/* Bitmap field of physical pages. Length is number of physical pages
-   rounded up to a word boundary */
-static bitmap_t *pagepool_free_pages;
+/* Descriptor of one physical page. Free list links are page numbers,
+   -1 terminates a list. */
+typedef struct {
+    int next;
+    int prev;
+    /* Order of the block starting at this page, if the page starts
+       a free or allocated block */
+    uint8_t order;
+    /* 1 if the page starts a free block */
+    uint8_t free;
+    /* Number of references to an allocated page, e.g. the page tables
+       it is mapped in. Zero for free pages. */
+    uint32_t refcount;
+} pagepool_page_t;
+
+/* Page descriptors, indexed by physical page number */
+static pagepool_page_t *pagepool_pages;
+
+/* Zones: pages reachable through KSEG0 and high memory */
+#define PAGEPOOL_ZONE_LOW 0
+#define PAGEPOOL_ZONE_HIGH 1
+#define PAGEPOOL_ZONES 2
+
+#define PAGEPOOL_ZONE_OF(i) \
+    ((i) < PAGEPOOL_LOWMEM_PAGES ? PAGEPOOL_ZONE_LOW : PAGEPOOL_ZONE_HIGH)
+
+/* First page of a free block of each order in each zone, -1 if
+   none */
+static int pagepool_free_lists[PAGEPOOL_ZONES][PAGEPOOL_MAX_ORDER + 1];
 
 /* Number of physical pages */
 static int pagepool_num_pages;
@@ -63,103 +140,903 @@ static int pagepool_num_free_pages;
    purpose).  */
 static int pagepool_static_end;
 
-/* Spinlock to handle synchronous access to pagepool_free_pages */
+/* Spinlock to handle synchronous access to the free lists */
 static spinlock_t pagepool_slock;
 
+/* Number of pages in a full magazine, and the number moved between a
+   magazine and the free lists at a time */
+#define PAGEPOOL_MAGAZINE_SIZE 16
+#define PAGEPOOL_MAGAZINE_BATCH (PAGEPOOL_MAGAZINE_SIZE / 2)
+
+/* Free single pages cached by one CPU, on its own cache lines. Only
+   accessed by the owning CPU with interrupts disabled. */
+typedef struct {
+    int count;
+    int pages[PAGEPOOL_MAGAZINE_SIZE];
+} __attribute__((aligned(CONFIG_CACHE_LINE_SIZE))) pagepool_magazine_t;
+
+static pagepool_magazine_t pagepool_magazines[CONFIG_MAX_CPUS];
+
+/* Requests to empty the magazine of a CPU, run by its scheduler (see
+   pagepool_shrink_magazine). pending is 1 while the request is
+   queued. */
+static struct {
+    deferred_work_t work;
+    uint32_t pending;
+} pagepool_drains[CONFIG_MAX_CPUS];
+
+static int pagepool_num_cpus;
+
+/* Number of pre-zeroed pages the zeroing thread keeps in stock, and
+   the stock level below which consumers wake it up */
+#define PAGEPOOL_ZEROED_TARGET 32
+#define PAGEPOOL_ZEROED_LOW (PAGEPOOL_ZEROED_TARGET / 2)
+
+/* Stock of pre-zeroed pages, linked through the next field of their
+   descriptors. The zeroing thread sleeps on pagepool_zeroed when the
+   stock is full. */
+static struct {
+    spinlock_t slock;
+    int head;
+    int count;
+} pagepool_zeroed;
+
+/* Free page counts below which the reclaim thread is woken up, and up
+   to which it reclaims. Set at boot from the memory size, the low one
+   can be given with the boot argument pagepool_low. */
+static int pagepool_watermark_low;
+static int pagepool_watermark_high;
+
+/* Number of pages reclaimed at a time when an allocation fails */
+#define PAGEPOOL_RECLAIM_BATCH 8
+
+/* Registered shrinkers, sorted by cost */
+static pagepool_shrinker_t *pagepool_shrinkers;
+static spinlock_t pagepool_shrinkers_slock;
+
+/* The reclaim thread sleeps on pagepool_reclaimer while it is not
+   running. */
+static struct {
+    spinlock_t slock;
+    int running;
+} pagepool_reclaimer;
+
+/* Statistics counters */
+static stat_id_t pagepool_stat_allocs;
+static stat_id_t pagepool_stat_frees;
+static stat_id_t pagepool_stat_magazine_hits;
+static stat_id_t pagepool_stat_magazine_misses;
+static stat_id_t pagepool_stat_zeroed_hits;
+static stat_id_t pagepool_stat_zeroed_misses;
+static stat_id_t pagepool_stat_reclaim_direct;
+static stat_id_t pagepool_stat_reclaim_background;
+static stat_id_t pagepool_stat_reclaimed;
+static stat_id_t pagepool_stat_reclaim_failed;
+
+static int pagepool_shrink_magazine(int pages);
+static int pagepool_shrink_zeroed(int pages);
+static void pagepool_drain_cpu(uint32_t cpu);
+
+/* Shrinkers of the page pool itself. Emptying the magazine of a CPU
+   costs nothing, but the zeroed pages have to be zeroed again. */
+static pagepool_shrinker_t pagepool_magazine_shrinker =
+    { "page magazines", 0, &pagepool_shrink_magazine, NULL };
+static pagepool_shrinker_t pagepool_zeroed_shrinker =
+    { "zeroed pages", 2, &pagepool_shrink_zeroed, NULL };
+
+/* Puts the block starting at page i on the free list of its order. */
+static void pagepool_list_add(int i, int order)
+{
+    pagepool_pages[i].order = order;
+    pagepool_pages[i].free = 1;
+    pagepool_pages[i].prev = -1;
+    pagepool_pages[i].next = pagepool_free_lists[PAGEPOOL_ZONE_OF(i)][order];
+    if (pagepool_pages[i].next >= 0)
+        pagepool_pages[pagepool_pages[i].next].prev = i;
+    pagepool_free_lists[PAGEPOOL_ZONE_OF(i)][order] = i;
+}
+
+/* Removes the free block starting at page i from its free list. */
+static void pagepool_list_remove(int i)
+{
+    pagepool_page_t *page = &pagepool_pages[i];
+
+    if (page->prev >= 0)
+        pagepool_pages[page->prev].next = page->next;
+    else
+        pagepool_free_lists[PAGEPOOL_ZONE_OF(i)][page->order] = page->next;
+    if (page->next >= 0)
+        pagepool_pages[page->next].prev = page->prev;
+
+    page->free = 0;
+}
+
+/* Frees the block of 2^order pages starting at page i, merging it
+   with its buddies. The pool must be locked. */
+static void pagepool_free_block(int i, int order)
+{
+    int buddy;
+
+    pagepool_num_free_pages += 1 << order;
+
+    while (order < PAGEPOOL_MAX_ORDER) {
+        buddy = i ^ (1 << order);
+        if (buddy >= pagepool_num_pages
+            || !pagepool_pages[buddy].free
+            || pagepool_pages[buddy].order != order)
+            break;
+        pagepool_list_remove(buddy);
+        i = MIN(i, buddy);
+        order++;
+    }
+
+    pagepool_list_add(i, order);
+}
+
+/* Allocates a block of 2^order pages from the given zone and returns
+   its first page, or -1 if there is no block big enough. The pool
+   must be locked. */
+static int pagepool_alloc_block(int zone, int order)
+{
+    int i, j;
+
+    for (j = order; j <= PAGEPOOL_MAX_ORDER; j++)
+        if (pagepool_free_lists[zone][j] >= 0)
+            break;
+
+    if (j > PAGEPOOL_MAX_ORDER)
+        return -1;
+
+    i = pagepool_free_lists[zone][j];
+    pagepool_list_remove(i);
+
+    /* Split the block, giving back the upper halves */
+    while (j > order) {
+        j--;
+        pagepool_list_add(i + (1 << j), j);
+    }
+
+    pagepool_pages[i].order = order;
+    pagepool_num_free_pages -= 1 << order;
+
+    /* Check that the pagepool internal variables are in synch. */
+    KERNEL_ASSERT(i >= pagepool_static_end && pagepool_num_free_pages >= 0);
+
+    return i;
+}
+
+/* Frees a single page directly to the free lists, bypassing the
+   magazines. */
+static void pagepool_release_page(int i)
+{
+    interrupt_status_t intr_status;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagepool_slock);
+
+    KERNEL_ASSERT(!pagepool_pages[i].free && pagepool_pages[i].order == 0);
+    pagepool_pages[i].refcount = 0;
+    pagepool_free_block(i, 0);
+
+    spinlock_release(&pagepool_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/* Wakes up the reclaim thread if free pages are running low. The
+   count is read without locking, a stale value only delays or hastens
+   the reclaim a little. */
+static void pagepool_check_watermark(void)
+{
+    interrupt_status_t intr_status;
+
+    if (pagepool_num_free_pages >= pagepool_watermark_low
+        || pagepool_reclaimer.running)
+        return;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagepool_reclaimer.slock);
+
+    if (!pagepool_reclaimer.running) {
+        pagepool_reclaimer.running = 1;
+        sleepq_wake(&pagepool_reclaimer);
+    }
+
+    spinlock_release(&pagepool_reclaimer.slock);
+    _interrupt_set_state(intr_status);
+}
+
 /**
  * Pagepool initialization. Finds out number of physical pages and
- * number of staticly reserved physical pages. Marks reserved pages
- * reserved in pagepool_free_pages.
+ * number of staticly reserved physical pages. Puts the pages which
+ * are not reserved on the free lists.
  */
 void pagepool_init(void)
 {
     int num_res_pages;
-    int i;
+    int i, order;
 
     pagepool_num_pages = kmalloc_get_numpages();
 
-    pagepool_free_pages = 
-        (uint32_t *)kmalloc(bitmap_sizeof(pagepool_num_pages));
-    bitmap_init(pagepool_free_pages, pagepool_num_pages);
+    pagepool_pages = (pagepool_page_t *)
+        kmalloc(pagepool_num_pages * sizeof(pagepool_page_t));
 
     /* Note that number of reserved pages must be get after we have 
-       (staticly) reserved memory for bitmap. */
+       (staticly) reserved memory for the page descriptors. */
     num_res_pages = kmalloc_get_reserved_pages();
-    pagepool_num_free_pages = pagepool_num_pages - num_res_pages;
+    pagepool_num_free_pages = 0;
     pagepool_static_end = num_res_pages;
 
-    for (i = 0; i < num_res_pages; i++)
-        bitmap_set(pagepool_free_pages, i, 1);
+    for (i = 0; i < PAGEPOOL_ZONES; i++)
+        for (order = 0; order <= PAGEPOOL_MAX_ORDER; order++)
+            pagepool_free_lists[i][order] = -1;
+
+    pagepool_num_cpus = cpustatus_count();
+    for (i = 0; i < CONFIG_MAX_CPUS; i++) {
+        pagepool_magazines[i].count = 0;
+        pagepool_drains[i].work.func = &pagepool_drain_cpu;
+        pagepool_drains[i].work.arg = i;
+        pagepool_drains[i].pending = 0;
+    }
+
+    for (i = 0; i < pagepool_num_pages; i++) {
+        pagepool_pages[i].free = 0;
+        pagepool_pages[i].order = 0;
+        pagepool_pages[i].refcount = 0;
+    }
+
+    /* Free the rest of memory in the largest aligned blocks that fit */
+    i = num_res_pages;
+    while (i < pagepool_num_pages) {
+        order = 0;
+        while (order < PAGEPOOL_MAX_ORDER
+               && (i & ((2 << order) - 1)) == 0
+               && i + (2 << order) <= pagepool_num_pages)
+            order++;
+        pagepool_free_block(i, order);
+        i += 1 << order;
+    }
 
     spinlock_reset(&pagepool_slock);
 
+    spinlock_reset(&pagepool_zeroed.slock);
+    pagepool_zeroed.head = -1;
+    pagepool_zeroed.count = 0;
+
+    pagepool_watermark_low = MAX(pagepool_num_free_pages / 64,
+                                 2 * PAGEPOOL_MAGAZINE_SIZE);
+    if (bootargs_get("pagepool_low") != NULL)
+        pagepool_watermark_low = atoi(bootargs_get("pagepool_low"));
+    pagepool_watermark_high = 2 * pagepool_watermark_low;
+
+    pagepool_shrinkers = NULL;
+    spinlock_reset(&pagepool_shrinkers_slock);
+    spinlock_reset(&pagepool_reclaimer.slock);
+    pagepool_reclaimer.running = 0;
+    pagepool_register_shrinker(&pagepool_magazine_shrinker);
+    pagepool_register_shrinker(&pagepool_zeroed_shrinker);
+
+    pagepool_stat_allocs = stats_register("pages allocated");
+    pagepool_stat_frees = stats_register("pages freed");
+    pagepool_stat_magazine_hits = stats_register("page magazine hits");
+    pagepool_stat_magazine_misses = stats_register("page magazine misses");
+    pagepool_stat_zeroed_hits = stats_register("pre-zeroed pages used");
+    pagepool_stat_zeroed_misses = stats_register("pages zeroed on demand");
+    pagepool_stat_reclaim_direct = stats_register("direct reclaims");
+    pagepool_stat_reclaim_background = stats_register("background reclaims");
+    pagepool_stat_reclaimed = stats_register("pages reclaimed");
+    pagepool_stat_reclaim_failed = stats_register("reclaims without progress");
+
     kprintf("Pagepool: Found %d pages of size %d\n", pagepool_num_pages,
             PAGE_SIZE);
     kprintf("Pagepool: Static allocation for kernel: %d pages\n", 
             num_res_pages);
+    if (pagepool_num_pages > PAGEPOOL_LOWMEM_PAGES)
+        kprintf("Pagepool: %d pages of high memory\n",
+                pagepool_num_pages - PAGEPOOL_LOWMEM_PAGES);
+    kprintf("Pagepool: Reclaiming below %d free pages, up to %d\n",
+            pagepool_watermark_low, pagepool_watermark_high);
 
 }
 
 /**
- * Finds first free physical page and marks it reserved.  
+ * Allocates 2^order physically contiguous pages. The block is
+ * aligned to its size.
+ *
+ * @param order Logarithm of the number of pages, at most
+ * PAGEPOOL_MAX_ORDER
  *
- * @return Address of first free physical page, zero if no free pages
- * are available.
+ * @return Physical address of the first page of the block, zero if
+ * no block of the requested size is available.
  */
-uint32_t pagepool_get_phys_page(void)
+uint32_t pagepool_get_phys_pages(int order)
 {
     interrupt_status_t intr_status;
     int i;
 
+    KERNEL_ASSERT(order >= 0 && order <= PAGEPOOL_MAX_ORDER);
+
     intr_status = _interrupt_disable();
     spinlock_acquire(&pagepool_slock);
-    
-    if (pagepool_num_free_pages > 0) {
-	i = bitmap_findnset(pagepool_free_pages,pagepool_num_pages);
-	pagepool_num_free_pages--;
 
-        /* There should have been a free page. Check that the pagepool
-           internal variables are in synch. */
-	KERNEL_ASSERT(i >= 0 && pagepool_num_free_pages >= 0);
-    } else {
-        i = 0;
+    i = pagepool_alloc_block(PAGEPOOL_ZONE_LOW, order);
+
+    spinlock_release(&pagepool_slock);
+    _interrupt_set_state(intr_status);
+
+    if (i < 0)
+        return 0;
+
+    pagepool_pages[i].refcount = 1;
+    stats_add(pagepool_stat_allocs, 1 << order);
+    pagepool_check_watermark();
+
+    return i*PAGE_SIZE;
+}
+
+/**
+ * Frees a block of pages allocated with pagepool_get_phys_pages.
+ *
+ * @param phys_addr Physical address of the first page of the block
+ *
+ * @param order The order the block was allocated with
+ */
+void pagepool_free_phys_pages(uint32_t phys_addr, int order)
+{
+    interrupt_status_t intr_status;
+    int i;
+
+    i = phys_addr / PAGE_SIZE;
+
+    /* A page allocated by kmalloc should not be freed. */
+    KERNEL_ASSERT(i >= pagepool_static_end && i < pagepool_num_pages);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagepool_slock);
+
+    /* Check that the block was reserved with this order, is not
+       freed twice and nobody else still references it. */
+    KERNEL_ASSERT(!pagepool_pages[i].free
+                  && pagepool_pages[i].order == order
+                  && pagepool_pages[i].refcount == 1);
+
+    pagepool_pages[i].refcount = 0;
+    pagepool_free_block(i, order);
+
+    spinlock_release(&pagepool_slock);
+    _interrupt_set_state(intr_status);
+
+    stats_add(pagepool_stat_frees, 1 << order);
+}
+
+/* Takes a page from the stock of pre-zeroed pages, waking up the
+   zeroing thread if the stock runs low. Returns 0 if the stock is
+   empty. */
+static uint32_t pagepool_take_zeroed_page(void)
+{
+    interrupt_status_t intr_status;
+    int i;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagepool_zeroed.slock);
+
+    i = pagepool_zeroed.head;
+    if (i >= 0) {
+        pagepool_zeroed.head = pagepool_pages[i].next;
+        pagepool_zeroed.count--;
+    }
+
+    if (pagepool_zeroed.count < PAGEPOOL_ZEROED_LOW)
+        sleepq_wake(&pagepool_zeroed);
+
+    spinlock_release(&pagepool_zeroed.slock);
+    _interrupt_set_state(intr_status);
+
+    return i < 0 ? 0 : i*PAGE_SIZE;
+}
+
+/* Allocates one physical page from the magazine of this CPU,
+   refilling the magazine from the free lists if it is empty. Returns
+   zero if no free pages are available. Never reclaims, so it can be
+   used with spinlocks held. */
+static uint32_t pagepool_alloc_page(void)
+{
+    interrupt_status_t intr_status;
+    pagepool_magazine_t *mag;
+    int i = 0, hit = 1;
+
+    intr_status = _interrupt_disable();
+    mag = &pagepool_magazines[_interrupt_getcpu()];
+
+    if (mag->count == 0) {
+        hit = 0;
+        spinlock_acquire(&pagepool_slock);
+        while (mag->count < PAGEPOOL_MAGAZINE_BATCH) {
+            i = pagepool_alloc_block(PAGEPOOL_ZONE_LOW, 0);
+            if (i < 0)
+                break;
+            mag->pages[mag->count++] = i;
+        }
+        spinlock_release(&pagepool_slock);
     }
 
+    /* Page 0 is always reserved by the kernel, so 0 means failure */
+    i = 0;
+    if (mag->count > 0)
+        i = mag->pages[--mag->count];
+
+    _interrupt_set_state(intr_status);
+
+    stats_inc(hit ? pagepool_stat_magazine_hits
+              : pagepool_stat_magazine_misses);
+    if (!hit)
+        pagepool_check_watermark();
+
+    /* Out of memory, but the zeroing thread may hold some. Those
+       pages were counted as allocated when the thread got them. */
+    if (i == 0)
+        return pagepool_take_zeroed_page();
+
+    pagepool_pages[i].refcount = 1;
+    stats_inc(pagepool_stat_allocs);
+
+    return i*PAGE_SIZE;
+}
+
+/**
+ * Allocates one physical page. If no pages are free, the shrinkers
+ * are run to get some back before giving up, so this must not be
+ * called with spinlocks held.
+ *
+ * @return Address of the allocated physical page, zero if no free
+ * pages are available.
+ */
+uint32_t pagepool_get_phys_page(void)
+{
+    uint32_t phys;
+
+    phys = pagepool_alloc_page();
+    if (phys == 0) {
+        stats_inc(pagepool_stat_reclaim_direct);
+        if (pagepool_reclaim(PAGEPOOL_RECLAIM_BATCH) > 0)
+            phys = pagepool_alloc_page();
+    }
+
+    return phys;
+}
+
+/**
+ * Allocates one physical page, preferring pages of high memory. The
+ * page is not necessarily reachable through KSEG0, so it must be
+ * mapped before the kernel can access it (see vmap). Falls back to
+ * pagepool_get_phys_page, so this must not be called with spinlocks
+ * held.
+ *
+ * @return Address of the allocated physical page, zero if no free
+ * pages are available.
+ */
+uint32_t pagepool_get_high_page(void)
+{
+    interrupt_status_t intr_status;
+    int i;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagepool_slock);
+    i = pagepool_alloc_block(PAGEPOOL_ZONE_HIGH, 0);
     spinlock_release(&pagepool_slock);
     _interrupt_set_state(intr_status);
+
+    if (i < 0)
+        return pagepool_get_phys_page();
+
+    pagepool_pages[i].refcount = 1;
+    stats_inc(pagepool_stat_allocs);
+    pagepool_check_watermark();
+
     return i*PAGE_SIZE;
 }
 
+/* Frees the given page, whose last reference has been dropped. The
+   page goes to the magazine of this CPU; if the magazine is full,
+   half of it is returned to the free lists first. */
+static void pagepool_free_page(int i)
+{
+    interrupt_status_t intr_status;
+    pagepool_magazine_t *mag;
+    int page;
+
+    pagepool_pages[i].refcount = 0;
+
+    intr_status = _interrupt_disable();
+
+    /* Magazines only hold pages of the low zone */
+    if (PAGEPOOL_ZONE_OF(i) == PAGEPOOL_ZONE_HIGH) {
+        _interrupt_set_state(intr_status);
+        pagepool_release_page(i);
+        stats_inc(pagepool_stat_frees);
+        return;
+    }
+
+    mag = &pagepool_magazines[_interrupt_getcpu()];
+
+    if (mag->count == PAGEPOOL_MAGAZINE_SIZE) {
+        spinlock_acquire(&pagepool_slock);
+        while (mag->count > PAGEPOOL_MAGAZINE_BATCH) {
+            page = mag->pages[--mag->count];
+            /* Check that the page was reserved. */
+            KERNEL_ASSERT(!pagepool_pages[page].free
+                          && pagepool_pages[page].order == 0);
+            pagepool_free_block(page, 0);
+        }
+        spinlock_release(&pagepool_slock);
+    }
+
+    mag->pages[mag->count++] = i;
+
+    _interrupt_set_state(intr_status);
+
+    stats_inc(pagepool_stat_frees);
+}
+
 /**
  * Frees given page. Given page should be reserved, but not staticly
- * reserved.
+ * reserved. The page goes to the magazine of this CPU; if the
+ * magazine is full, half of it is returned to the free lists first.
  *
  * @param phys_addr Page to be freed.
  */
 void pagepool_free_phys_page(uint32_t phys_addr)
 {
-    interrupt_status_t intr_status;
     int i;
 
     i = phys_addr / PAGE_SIZE;
 
     /* A page allocated by kmalloc should not be freed. */
-    KERNEL_ASSERT(i >= pagepool_static_end);
+    KERNEL_ASSERT(i >= pagepool_static_end && i < pagepool_num_pages);
+    /* Pages in magazines and free lists have no references, so this
+       catches double frees, which the magazines would otherwise hand
+       out twice. Shared pages must be released with
+       pagepool_page_unref. */
+    KERNEL_ASSERT(pagepool_pages[i].refcount == 1);
 
-    intr_status = _interrupt_disable();
-    spinlock_acquire(&pagepool_slock);
-    
-    /* Check that the page was reserved. */
-    KERNEL_ASSERT(bitmap_get(pagepool_free_pages, i) == 1);
+    pagepool_free_page(i);
+}
+
+/**
+ * Adds a reference to an allocated page, e.g. when the page is mapped
+ * to a second address space.
+ *
+ * @param phys_addr Physical address of the page
+ */
+void pagepool_page_ref(uint32_t phys_addr)
+{
+    int i = phys_addr / PAGE_SIZE;
+
+    KERNEL_ASSERT(i >= pagepool_static_end && i < pagepool_num_pages);
+    KERNEL_ASSERT(pagepool_pages[i].refcount > 0);
+
+    _atomic_add(&pagepool_pages[i].refcount, 1);
+}
+
+/**
+ * Drops a reference to an allocated page, freeing the page when the
+ * last reference is dropped.
+ *
+ * @param phys_addr Physical address of the page
+ *
+ * @return 1 if the page was freed, 0 if it is still referenced.
+ */
+int pagepool_page_unref(uint32_t phys_addr)
+{
+    int i = phys_addr / PAGE_SIZE;
+
+    KERNEL_ASSERT(i >= pagepool_static_end && i < pagepool_num_pages);
+    KERNEL_ASSERT(pagepool_pages[i].refcount > 0);
+
+    if (_atomic_add(&pagepool_pages[i].refcount, -1) > 1)
+        return 0;
+
+    pagepool_free_page(i);
+    return 1;
+}
+
+/**
+ * Returns the number of references to an allocated page.
+ *
+ * @param phys_addr Physical address of the page
+ */
+uint32_t pagepool_page_refcount(uint32_t phys_addr)
+{
+    return pagepool_pages[phys_addr / PAGE_SIZE].refcount;
+}
+
+/**
+ * Allocates one physical page filled with zeros. Uses a pre-zeroed
+ * page if one is available and clears a fresh page otherwise. Like
+ * pagepool_get_phys_page, this must not be called with spinlocks
+ * held.
+ *
+ * @return Address of the allocated physical page, zero if no free
+ * pages are available.
+ */
+uint32_t pagepool_get_zeroed_page(void)
+{
+    uint32_t phys;
+
+    phys = pagepool_take_zeroed_page();
+    if (phys != 0) {
+        stats_inc(pagepool_stat_zeroed_hits);
+        return phys;
+    }
+
+    phys = pagepool_get_phys_page();
+    if (phys != 0) {
+        memoryset((void *)ADDR_PHYS_TO_KERNEL(phys), 0, PAGE_SIZE);
+        stats_inc(pagepool_stat_zeroed_misses);
+    }
+
+    return phys;
+}
+
+/* Main function of the zeroing thread. Tops up the stock of zeroed
+   pages and sleeps while the stock is full. Since it is a background
+   thread, it only gets CPU time nobody else wants. */
+static void pagepool_zero_thread(uint32_t arg)
+{
+    interrupt_status_t intr_status;
+    uint32_t phys;
+    int i;
+
+    arg = arg;
+
+    while (1) {
+        intr_status = _interrupt_disable();
+        spinlock_acquire(&pagepool_zeroed.slock);
+
+        if (pagepool_zeroed.count >= PAGEPOOL_ZEROED_TARGET) {
+            sleepq_add(&pagepool_zeroed);
+            spinlock_release(&pagepool_zeroed.slock);
+            thread_switch();
+        } else {
+            spinlock_release(&pagepool_zeroed.slock);
+        }
+
+        _interrupt_set_state(intr_status);
+
+        /* Do not compete with the reclaim for free pages */
+        if (pagepool_num_free_pages < pagepool_watermark_low) {
+            thread_sleep(100);
+            continue;
+        }
+
+        /* Zeroing ahead is not worth reclaiming memory for */
+        phys = pagepool_alloc_page();
+        if (phys == 0) {
+            /* Out of memory, try again later */
+            thread_sleep(100);
+            continue;
+        }
+
+        memoryset((void *)ADDR_PHYS_TO_KERNEL(phys), 0, PAGE_SIZE);
+        i = phys / PAGE_SIZE;
+
+        intr_status = _interrupt_disable();
+        spinlock_acquire(&pagepool_zeroed.slock);
+
+        pagepool_pages[i].next = pagepool_zeroed.head;
+        pagepool_zeroed.head = i;
+        pagepool_zeroed.count++;
+
+        spinlock_release(&pagepool_zeroed.slock);
+        _interrupt_set_state(intr_status);
+    }
+}
+
+/**
+ * Starts the background thread which keeps a stock of zeroed
+ * pages. Called once during boot, after the page pool and the
+ * threading system are initialized.
+ */
+void pagepool_start_zeroing(void)
+{
+    TID_t tid;
+
+    tid = thread_create_background(&pagepool_zero_thread, 0);
+    KERNEL_ASSERT(tid >= 0);
+    thread_run(tid);
+}
+
+/* Returns up to the given number of pages from the magazine of this
+   CPU to the free lists. Must be called with interrupts disabled. */
+static int pagepool_empty_magazine(int pages)
+{
+    pagepool_magazine_t *mag;
+    int freed = 0;
 
-    bitmap_set(pagepool_free_pages, i, 0);
-    pagepool_num_free_pages++;
+    mag = &pagepool_magazines[_interrupt_getcpu()];
 
+    spinlock_acquire(&pagepool_slock);
+    while (mag->count > 0 && freed < pages) {
+        pagepool_free_block(mag->pages[--mag->count], 0);
+        freed++;
+    }
     spinlock_release(&pagepool_slock);
+
+    return freed;
+}
+
+/* Deferred work which empties the magazine of a CPU, queued by
+   pagepool_shrink_magazine. */
+static void pagepool_drain_cpu(uint32_t cpu)
+{
+    int freed;
+
+    pagepool_drains[cpu].pending = 0;
+    freed = pagepool_empty_magazine(PAGEPOOL_MAGAZINE_SIZE);
+    stats_add(pagepool_stat_reclaimed, freed);
+}
+
+/* Shrinker of the magazines. The magazine of this CPU is emptied
+   right away. The magazines of other CPUs can only be touched by
+   their owners, so they are queued to be emptied by the schedulers of
+   those CPUs; their pages show up as free pages later and are not
+   included in the count returned. */
+static int pagepool_shrink_magazine(int pages)
+{
+    interrupt_status_t intr_status;
+    int freed, cpu, i;
+
+    intr_status = _interrupt_disable();
+    cpu = _interrupt_getcpu();
+
+    freed = pagepool_empty_magazine(pages);
+
+    for (i = 0; i < pagepool_num_cpus; i++) {
+        if (i == cpu || pagepool_magazines[i].count == 0)
+            continue;
+        if (_atomic_cas(&pagepool_drains[i].pending, 0, 1) == 0)
+            scheduler_defer_work(i, &pagepool_drains[i].work);
+    }
+
     _interrupt_set_state(intr_status);
+
+    return freed;
 }
 
+/* Shrinker which returns pages from the stock of zeroed pages to the
+   free lists. */
+static int pagepool_shrink_zeroed(int pages)
+{
+    interrupt_status_t intr_status;
+    int freed = 0;
+    int i;
 
+    while (freed < pages) {
+        intr_status = _interrupt_disable();
+        spinlock_acquire(&pagepool_zeroed.slock);
 
-/** @} */
+        i = pagepool_zeroed.head;
+        if (i >= 0) {
+            pagepool_zeroed.head = pagepool_pages[i].next;
+            pagepool_zeroed.count--;
+        }
+
+        spinlock_release(&pagepool_zeroed.slock);
+        _interrupt_set_state(intr_status);
+
+        if (i < 0)
+            break;
+
+        pagepool_release_page(i);
+        freed++;
+    }
+
+    return freed;
+}
+
+/**
+ * Registers a shrinker, which the page pool asks for pages when free
+ * memory runs low. Shrinkers are asked in the order of their cost,
+ * cheapest first.
+ *
+ * @param shrinker The shrinker. The storage is owned by the caller
+ * and must stay valid forever.
+ */
+void pagepool_register_shrinker(pagepool_shrinker_t *shrinker)
+{
+    interrupt_status_t intr_status;
+    pagepool_shrinker_t **prev;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&pagepool_shrinkers_slock);
+
+    prev = &pagepool_shrinkers;
+    while (*prev != NULL && (*prev)->cost <= shrinker->cost)
+        prev = &(*prev)->next;
+    shrinker->next = *prev;
+    *prev = shrinker;
+
+    spinlock_release(&pagepool_shrinkers_slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Asks the shrinkers for pages, cheapest first, until the given
+ * number of pages has been freed or all shrinkers have been asked.
+ * Shrinkers take their own locks, so this must not be called with
+ * spinlocks held.
+ *
+ * @param pages Number of pages wanted
+ *
+ * @return The number of pages freed.
+ */
+int pagepool_reclaim(int pages)
+{
+    pagepool_shrinker_t *shrinker;
+    int freed = 0;
+
+    /* Shrinkers are only ever added, in front of or after existing
+       ones, so the list can be walked without the lock. */
+    for (shrinker = pagepool_shrinkers;
+         shrinker != NULL && freed < pages;
+         shrinker = shrinker->next)
+        freed += shrinker->shrink(pages - freed);
 
+    stats_add(pagepool_stat_reclaimed, freed);
+    if (freed == 0)
+        stats_inc(pagepool_stat_reclaim_failed);
+
+    return freed;
+}
+
+/* Main function of the reclaim thread. Sleeps until free pages fall
+   below the low watermark, and then reclaims up to the high
+   watermark. */
+static void pagepool_reclaim_thread(uint32_t arg)
+{
+    interrupt_status_t intr_status;
+    int wanted;
+
+    arg = arg;
+
+    while (1) {
+        intr_status = _interrupt_disable();
+        spinlock_acquire(&pagepool_reclaimer.slock);
+
+        if (pagepool_num_free_pages >= pagepool_watermark_low) {
+            pagepool_reclaimer.running = 0;
+            sleepq_add(&pagepool_reclaimer);
+            spinlock_release(&pagepool_reclaimer.slock);
+            thread_switch();
+        } else {
+            spinlock_release(&pagepool_reclaimer.slock);
+        }
+
+        _interrupt_set_state(intr_status);
+
+        wanted = pagepool_watermark_high - pagepool_num_free_pages;
+        if (wanted <= 0)
+            continue;
+
+        stats_inc(pagepool_stat_reclaim_background);
+        if (pagepool_reclaim(wanted) == 0) {
+            /* Nothing to give back now, try again later */
+            thread_sleep(100);
+        }
+    }
+}
+
+/**
+ * Starts the thread which reclaims memory from the shrinkers when
+ * free pages run low. Called once during boot, after the threading
+ * system is initialized.
+ */
+void pagepool_start_reclaim(void)
+{
+    TID_t tid;
+
+    tid = thread_create(&pagepool_reclaim_thread, 0);
+    KERNEL_ASSERT(tid >= 0);
+    thread_run(tid);
+}
+
+/** @} */
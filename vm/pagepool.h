@@ -42,9 +42,41 @@
 #define ADDR_PHYS_TO_KERNEL(addr) ((addr) | 0x80000000)
 #define ADDR_KERNEL_TO_PHYS(addr) ((addr) & 0x7fffffff)
 
+/* Number of pages reachable through KSEG0 (512MB). Pages above this
+   are high memory, which the kernel can only access through vmap. */
+#define PAGEPOOL_LOWMEM_PAGES (0x20000000 / PAGE_SIZE)
+
+/* Largest block allocated by pagepool_get_phys_pages is
+   2^PAGEPOOL_MAX_ORDER pages */
+#define PAGEPOOL_MAX_ORDER 10
+
+/* A cache which can give pages back to the page pool when memory
+   runs low. The storage is owned by the subsystem and must stay valid
+   forever. */
+typedef struct pagepool_shrinker_struct {
+    const char *name;
+    /* Relative cost of losing the cached data, cheaper shrinkers are
+       asked first */
+    int cost;
+    /* Frees up to the given number of pages and returns the number
+       freed. Must not sleep; called without spinlocks held. */
+    int (*shrink)(int pages);
+    struct pagepool_shrinker_struct *next;
+} pagepool_shrinker_t;
 
 void pagepool_init(void);
 uint32_t pagepool_get_phys_page(void);
 void pagepool_free_phys_page(uint32_t phys_addr);
+uint32_t pagepool_get_phys_pages(int order);
+void pagepool_free_phys_pages(uint32_t phys_addr, int order);
+uint32_t pagepool_get_zeroed_page(void);
+uint32_t pagepool_get_high_page(void);
+void pagepool_page_ref(uint32_t phys_addr);
+int pagepool_page_unref(uint32_t phys_addr);
+uint32_t pagepool_page_refcount(uint32_t phys_addr);
+void pagepool_start_zeroing(void);
+void pagepool_register_shrinker(pagepool_shrinker_t *shrinker);
+int pagepool_reclaim(int pages);
+void pagepool_start_reclaim(void);
 
 #endif /* BUENOS_VM_PAGEPOOL_H */
@@ -37,21 +37,90 @@
 #ifndef BUENOS_VM_PAGETABLE_H
 #define BUENOS_VM_PAGETABLE_H
 
+/* Offset of the leaves field in pagetable_t, used by the TLB refill
+   handler in vm/_tlb.S. The field comes before the regions, so the
+   offset does not depend on their layout. */
+#define PAGETABLE_LEAVES 12
+
+#ifndef __ASSEMBLER__
+
 #include "lib/libc.h"
 #include "vm/tlb.h"
 
-/* Number of mapping entries in one pagetable. This is the number
-   of entries that fits on a single hardware memory page (4k). */
-#define PAGETABLE_ENTRIES 340
+/* A pagetable is a two-level table indexed by VPN2. The directory in
+   the pagetable points to leaf tables, each of which fills one
+   hardware memory page (4k) and maps 4MB of the address space. Leaves
+   are allocated when the first page in their range is mapped, so
+   sparse address spaces stay small. The directory covers the whole
+   userland segment (2GB). */
+#define PAGETABLE_LEAF_ENTRIES 512
+#define PAGETABLE_LEAF_SHIFT 22
+#define PAGETABLE_DIRECTORY_ENTRIES 512
+
+/* Leaf table and entry of a userland virtual address */
+#define PAGETABLE_DIRECTORY_INDEX(vaddr) ((vaddr) >> PAGETABLE_LEAF_SHIFT)
+#define PAGETABLE_LEAF_INDEX(vaddr) \
+    (((vaddr) >> 13) & (PAGETABLE_LEAF_ENTRIES - 1))
+
+/* Number of demand paged regions in one pagetable */
+#define PAGETABLE_REGIONS 4
+
+/* A reserved range of pages, [start, end), which is mapped on first
+   touch (demand paging). Both ends are page aligned. The first
+   filesize bytes of the region are loaded from the executable of the
+   process, starting at offset, and the rest is zero-filled. */
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+    /* Dirty (writable) bit for the pages of the region */
+    uint32_t dirty;
+    /* Location in the executable of the file-backed part */
+    uint32_t offset;
+    /* Number of file-backed bytes, 0 for a zero-fill region */
+    uint32_t filesize;
+    /* 1 if the pages stay shared, instead of becoming copy-on-write,
+       when the address space is forked */
+    uint32_t shared;
+} pagetable_region_t;
+
+/* Mapping of one page pair in a leaf table. The VPN2 is given by the
+   position in the table, so only the EntryLo0 and EntryLo1 words are
+   stored. The fields are the same as in tlb_entry_t. */
+typedef struct {
+    unsigned int dummy2:6   __attribute__ ((packed));
+    unsigned int PFN0:20    __attribute__ ((packed));
+    unsigned int C0:3       __attribute__ ((packed));
+    unsigned int D0:1       __attribute__ ((packed));
+    unsigned int V0:1       __attribute__ ((packed));
+    unsigned int G0:1       __attribute__ ((packed));
+
+    unsigned int dummy3:6   __attribute__ ((packed));
+    unsigned int PFN1:20    __attribute__ ((packed));
+    unsigned int C1:3       __attribute__ ((packed));
+    unsigned int D1:1       __attribute__ ((packed));
+    unsigned int V1:1       __attribute__ ((packed));
+    unsigned int G1:1       __attribute__ ((packed));
+} pagetable_entry_t;
+
+/* A leaf table. This structure fills one physical page (4k). */
+typedef struct {
+    pagetable_entry_t entries[PAGETABLE_LEAF_ENTRIES];
+} pagetable_leaf_t;
 
 /* A pagetable. This structure fits on one physical page (4k). */
 typedef struct pagetable_struct_t{
     /* Address space identifier. We use Thread Ids in Buenos. */
     uint32_t ASID;
-    /* Number of valid consecutive mappings in this pagetable. */
+    /* Number of valid page mappings in this pagetable. */
     uint32_t valid_count;
-    /* Actual virtual memory mapping entries*/
-    tlb_entry_t entries[PAGETABLE_ENTRIES];
+    /* Number of valid consecutive regions */
+    uint32_t region_count;
+    /* Leaf tables, NULL where nothing is mapped. Leaves are in KSEG0.
+       At offset PAGETABLE_LEAVES. */
+    pagetable_leaf_t *leaves[PAGETABLE_DIRECTORY_ENTRIES];
+    pagetable_region_t regions[PAGETABLE_REGIONS];
 } pagetable_t;
 
+#endif /* __ASSEMBLER__ */
+
 #endif /* BUENOS_VM_PAGETABLE_H */
@@ -40,20 +40,322 @@
 #include "vm/tlb.h"
 #include "vm/pagetable.h"
 #include "vm/vm.h"
+#include "vm/vmap.h"
 #include "proc/process.h"
+#include "kernel/stats.h"
+#include "kernel/interrupt.h"
+#include "kernel/atomic.h"
+#include "drivers/bootargs.h"
+#include "drivers/device.h"
+#include "drivers/metadev.h"
+#include "drivers/yams.h"
 
+/* The TLB refill vector, see _tlb_refill in _tlb.S */
+#define TLB_REFILL_VECTOR 0x80000000
+#define TLB_REFILL_VECTOR_LENGTH 8
+
+/* Number of ASIDs, the size of the ASID field in EntryHi */
+#define TLB_ASIDS 256
+
+/* Entries are kept in the TLB across context switches, tagged with
+   their ASID. When an ASID is given to a new address space, the
+   entries of the old one must not be used, but invalidating them on
+   every CPU right away would need a broadcast. Instead the generation
+   of the ASID is bumped, and each CPU invalidates the entries of an
+   ASID when it switches to a generation it has not seen yet. */
+static uint32_t tlb_asid_generation[TLB_ASIDS];
+static uint32_t tlb_cpu_generation[CONFIG_MAX_CPUS][TLB_ASIDS];
+
+/* Whether a CPU may have entries of an ASID in its TLB: it has
+   switched to the ASID since it last flushed it. Each CPU only writes
+   its own row. */
+static uint8_t tlb_asid_cached[CONFIG_MAX_CPUS][TLB_ASIDS];
+
+/* Unmapping more page pairs than this scans the whole TLB once
+   instead of probing each pair. */
+#define TLB_PROBE_LIMIT 16
+
+/* A shootdown request sent by one CPU to the others, indexed by the
+   sending CPU. A CPU waits for its request to be handled before
+   sending another one. */
+typedef struct {
+    uint32_t asid;
+    /* Address range to invalidate, [start, end) */
+    uint32_t start;
+    uint32_t end;
+    /* Bitmask of the CPUs which have not handled the request yet */
+    uint32_t targets;
+} tlb_shootdown_t;
+
+static tlb_shootdown_t tlb_shootdowns[CONFIG_MAX_CPUS];
+
+static int tlb_num_cpus;
+
+/* Misses handled in C, i.e. not by the refill fast path */
+static stat_id_t tlb_stat_slow;
+static stat_id_t tlb_stat_asid_flushes;
+static stat_id_t tlb_stat_shootdowns;
+static stat_id_t tlb_stat_shootdown_ipis;
+
+/**
+ * Installs the assembly TLB refill handler in the refill vector,
+ * replacing the generic exception code put there by interrupt_init.
+ * The boot argument "tlb_refill=slow" keeps the generic code, so
+ * that every miss is handled in C (e.g. for comparing the two).
+ */
+void tlb_init(void)
+{
+    uint32_t *vector = (uint32_t *)TLB_REFILL_VECTOR;
+    char *mode;
+    int i;
+
+    /* The refill handler uses these offsets directly */
+    KERNEL_ASSERT((uint32_t)&((thread_table_t *)0)->pagetable == 16);
+    KERNEL_ASSERT((uint32_t)&((pagetable_t *)0)->leaves
+                  == PAGETABLE_LEAVES);
+
+    tlb_num_cpus = cpustatus_count();
+
+    tlb_stat_slow = stats_register("TLB misses (slow path)");
+    tlb_stat_asid_flushes = stats_register("TLB ASID flushes");
+    tlb_stat_shootdowns = stats_register("TLB shootdowns");
+    tlb_stat_shootdown_ipis = stats_register("TLB shootdown IPIs");
+
+    mode = bootargs_get("tlb_refill");
+    if (mode != NULL && stringcmp(mode, "slow") == 0)
+        return;
+
+    for (i = 0; i < TLB_REFILL_VECTOR_LENGTH; i++)
+        vector[i] = ((uint32_t *)&_tlb_refill_code)[i];
+}
+
+/* Switches the TLB of this CPU to the address space of the given
+   pagetable. Nothing is loaded: entries stay in the TLB while other
+   threads run and missing ones are loaded by the refill handler (see
+   _tlb_refill) or tlb_store_exception. Entries left by an earlier
+   owner of the ASID are invalidated first. Must be called with
+   interrupts disabled. */
 void tlb_fill(pagetable_t *pagetable){
+    uint32_t asid, generation;
+    int cpu;
+
+    if (pagetable == NULL) return;
+
+    asid = pagetable->ASID;
+    cpu = _interrupt_getcpu();
+    generation = tlb_asid_generation[asid];
+    if (tlb_cpu_generation[cpu][asid] != generation) {
+        tlb_flush_asid(asid);
+        tlb_cpu_generation[cpu][asid] = generation;
+        stats_inc(tlb_stat_asid_flushes);
+    }
+    tlb_asid_cached[cpu][asid] = 1;
+    _tlb_set_asid(asid);
+}
+
+/**
+ * Gives the ASID to a new address space. TLB entries of the previous
+ * address space with the ASID are invalidated lazily, by each CPU
+ * before it next switches to the ASID (see tlb_fill). Called when a
+ * pagetable is created.
+ *
+ * @param asid The ASID
+ */
+void tlb_asid_recycle(uint32_t asid)
+{
+    KERNEL_ASSERT(asid < TLB_ASIDS);
+    tlb_asid_generation[asid]++;
+}
+
+/* Invalidates the entries of the given address space in the TLB of
+   this CPU, so that pages freed from the address space can not be
+   reached through stale entries. Must be called with interrupts
+   disabled. */
+void tlb_flush_asid(uint32_t asid) {
+    tlb_entry_t entry;
+    uint32_t i, max, current;
+
+    tlb_asid_cached[_interrupt_getcpu()][asid] = 0;
+
+    /* Reading and writing entries changes the current ASID */
+    current = _tlb_get_asid();
+    max = _tlb_get_maxindex();
+    for(i=0; i<=max; i++) {
+        _tlb_read(&entry, i, 1);
+        if(entry.ASID == asid && !entry.G0) {
+            entry.V0 = 0;
+            entry.V1 = 0;
+            _tlb_write(&entry, i, 1);
+        }
+    }
+    _tlb_set_asid(current);
+}
+
+/* Invalidates the entries of the pages [start, end) of the given
+   address space in the TLB of this CPU. A few page pairs are probed
+   one by one, more are dropped with one pass over the TLB. Must be
+   called with interrupts disabled. */
+static void tlb_invalidate_range(uint32_t asid, uint32_t start,
+                                 uint32_t end)
+{
+    tlb_entry_t entry;
+    uint32_t vpn2, first, last, i, max, current;
+    int index;
+
+    first = start >> 13;
+    last = (end - 1) >> 13;
+
+    /* Reading and writing entries changes the current ASID */
+    current = _tlb_get_asid();
+
+    if (last - first < TLB_PROBE_LIMIT) {
+        memoryset(&entry, 0, sizeof(entry));
+        entry.ASID = asid;
+        for (vpn2 = first; vpn2 <= last; vpn2++) {
+            entry.VPN2 = vpn2;
+            index = _tlb_probe(&entry);
+            if (index >= 0)
+                _tlb_write(&entry, index, 1);
+        }
+    } else {
+        max = _tlb_get_maxindex();
+        for (i = 0; i <= max; i++) {
+            _tlb_read(&entry, i, 1);
+            if (entry.ASID == asid && !entry.G0
+                && entry.VPN2 >= first && entry.VPN2 <= last) {
+                entry.V0 = 0;
+                entry.V1 = 0;
+                _tlb_write(&entry, i, 1);
+            }
+        }
+    }
+
+    _tlb_set_asid(current);
+}
+
+/**
+ * Handles the shootdown requests sent to this CPU by the others (see
+ * tlb_shootdown). Called on every interrupt, and by CPUs waiting for
+ * their own shootdown, with interrupts disabled.
+ */
+void tlb_shootdown_handle(void)
+{
+    tlb_shootdown_t *request;
+    uint32_t bit;
+    int i;
+
+    bit = 1 << _interrupt_getcpu();
+
+    for (i = 0; i < tlb_num_cpus; i++) {
+        request = &tlb_shootdowns[i];
+        if ((*(volatile uint32_t *)&request->targets & bit) == 0)
+            continue;
+        tlb_invalidate_range(request->asid, request->start, request->end);
+        _atomic_add(&request->targets, -(int)bit);
+    }
+}
+
+/**
+ * Removes the entries of the pages [start, end) of the given address
+ * space from the TLBs of all CPUs. The TLB of this CPU is handled
+ * directly. The other CPUs which may have entries of the address
+ * space get an inter-processor interrupt and invalidate the entries
+ * in tlb_shootdown_handle. Returns when all of them are done, so the
+ * unmapped pages can be freed. Must not be called with spinlocks held.
+ *
+ * @param asid The address space
+ *
+ * @param start First address of the range, page aligned
+ *
+ * @param end Address after the range, page aligned
+ */
+void tlb_shootdown(uint32_t asid, uint32_t start, uint32_t end)
+{
+    interrupt_status_t intr_status;
+    tlb_shootdown_t *request;
+    uint32_t targets = 0;
+    int cpu, i;
+
+    if (start >= end)
+        return;
+
+    intr_status = _interrupt_disable();
+    cpu = _interrupt_getcpu();
+
+    tlb_invalidate_range(asid, start, end);
+    stats_inc(tlb_stat_shootdowns);
+
+    for (i = 0; i < tlb_num_cpus; i++) {
+        if (i != cpu && tlb_asid_cached[i][asid])
+            targets |= 1 << i;
+    }
+
+    if (targets != 0) {
+        request = &tlb_shootdowns[cpu];
+        request->asid = asid;
+        request->start = start;
+        request->end = end;
+        _atomic_swap(&request->targets, targets);
+
+        for (i = 0; i < tlb_num_cpus; i++) {
+            if (targets & (1 << i)) {
+                cpustatus_generate_irq(device_get(YAMS_TYPECODE_CPUSTATUS,
+                                                  i));
+                stats_inc(tlb_stat_shootdown_ipis);
+            }
+        }
 
-  if (pagetable == NULL) return;
-  KERNEL_ASSERT(pagetable->valid_count <= (_tlb_get_maxindex()+1));
-  _tlb_write(pagetable->entries,0,pagetable->valid_count);
-  _tlb_set_asid(pagetable->ASID);
+        /* Serve requests of other CPUs while waiting, they may be
+           waiting for this CPU with interrupts disabled as well. */
+        while (*(volatile uint32_t *)&request->targets != 0)
+            tlb_shootdown_handle();
+    }
+
+    _interrupt_set_state(intr_status);
+}
+
+/* Writes the entry to the TLB, replacing the entry of the same page
+   pair if the TLB already has one (e.g. with only the other page
+   valid). Two matching entries in the TLB would be an error. */
+void tlb_write_entry(tlb_entry_t *entry) {
+    int index;
+
+    index = _tlb_probe(entry);
+    if(index >= 0) {
+        _tlb_write(entry, index, 1);
+    } else {
+        _tlb_write_random(entry);
+    }
 }
 
+/* A write to a page whose entry is not dirty: either a copy-on-write
+   page shared after a fork, which is copied, or a read-only page, in
+   which case the process is terminated. */
 void tlb_modified_exception(void) {
-    /* A correct handling of this exception would be to send a terminate
-       signal to the process that caused it. For now, just panic. */
-    KERNEL_PANIC("TLB modified exception.");
+    tlb_exception_state_t tes;
+    tlb_entry_t entry;
+    _tlb_get_exception_state(&tes);
+
+    pagetable_t *ptable = thread_get_current_thread_entry()->pagetable;
+    if(ptable == NULL) {
+        KERNEL_PANIC("TLB modified exception without a pagetable.");
+    }
+
+    switch(process_write_fault(tes.badvaddr)) {
+    case 0:
+        kprintf("Write to read-only page 0x%8.8x, "
+                "terminating process\n", tes.badvaddr);
+        process_finish(-1);
+        break;
+    case -1:
+        kprintf("Could not copy page 0x%8.8x, "
+                "terminating process\n", tes.badvaddr);
+        process_finish(-1);
+        break;
+    }
+
+    KERNEL_ASSERT(vm_get_tlb_entry(ptable, tes.badvaddr, &entry));
+    tlb_write_entry(&entry);
 }
 
 void tlb_load_exception(void) {
@@ -62,25 +364,40 @@ void tlb_load_exception(void) {
 
 void tlb_store_exception(void) {
     tlb_exception_state_t tes;
+    tlb_entry_t entry;
     _tlb_get_exception_state(&tes);
+    stats_inc(tlb_stat_slow);
+
+    /* Kernel virtual mapping area, see vmap.c */
+    if(ADDR_IS_VMAP(tes.badvaddr)) {
+        if(!vmap_fill_tlb(tes.badvaddr))
+            KERNEL_PANIC("Access to unmapped kernel virtual address.");
+        return;
+    }
 
     pagetable_t *ptable = thread_get_current_thread_entry()->pagetable;
     if(ptable == NULL) {
         KERNEL_PANIC("No pagetable associated with thread.");
     }
-    uint32_t i;
-    for(i=0; i<ptable->valid_count; i++) {
-        tlb_entry_t *entry = &ptable->entries[i];
-        if(entry->VPN2 == tes.badvpn2) {
-            /* Remove this assertion and handle invalid pages properly. */
-            KERNEL_ASSERT(tlb_entry_is_valid(entry, tes.badvaddr));
-
-            /* place matching tlb entry somewhere in TLB */
-            _tlb_write_random(&ptable->entries[i]);
-            return;
+
+    if(!vm_get_tlb_entry(ptable, tes.badvaddr, &entry)) {
+        /* Not mapped yet, but it may be a demand paged page which is
+           mapped on first touch. */
+        switch(process_page_fault(tes.badvaddr)) {
+        case 0:
+            KERNEL_PANIC("Page not found in pagetable.");
+            break;
+        case -1:
+            kprintf("Could not load page 0x%8.8x, "
+                    "terminating process\n", tes.badvaddr);
+            process_finish(-1);
+            break;
         }
+        KERNEL_ASSERT(vm_get_tlb_entry(ptable, tes.badvaddr, &entry));
     }
-    KERNEL_PANIC("Page not found in pagetable.");
+
+    /* place matching tlb entry somewhere in TLB */
+    tlb_write_entry(&entry);
 }
 
 /** 
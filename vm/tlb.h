@@ -89,7 +89,13 @@ typedef struct {
     uint32_t asid; /* ASID of the causing process, only 8 lowest bits used */
 } tlb_exception_state_t;
 struct pagetable_struct_t;
+void tlb_init(void);
 void tlb_fill(struct pagetable_struct_t *pagetable);
+void tlb_asid_recycle(uint32_t asid);
+void tlb_flush_asid(uint32_t asid);
+void tlb_shootdown(uint32_t asid, uint32_t start, uint32_t end);
+void tlb_shootdown_handle(void);
+void tlb_write_entry(tlb_entry_t *entry);
 
 /* exception handlers */
 void tlb_modified_exception(void);
@@ -105,6 +111,7 @@ void tlb_entry_set_valid(tlb_entry_t *entry, uint32_t vaddr, int valid);
 /* assembler function wrappers */
 void _tlb_get_exception_state(tlb_exception_state_t *state);
 void _tlb_set_asid(uint32_t asid);
+uint32_t _tlb_get_asid(void);
 uint32_t _tlb_get_maxindex(void);
 
 int _tlb_probe(tlb_entry_t *entry);
@@ -112,5 +119,8 @@ int _tlb_read(tlb_entry_t *entries, uint32_t index, uint32_t num);
 int _tlb_write(tlb_entry_t *entries, uint32_t index, uint32_t num);
 void _tlb_write_random(tlb_entry_t *entry);
 
+/* Code to be inserted to the TLB refill vector */
+void _tlb_refill_code(void);
+
 
 #endif /* BUENOS_VM_TLB_H */
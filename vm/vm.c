@@ -37,6 +37,7 @@
 #include "vm/pagetable.h"
 #include "vm/vm.h"
 #include "vm/pagepool.h"
+#include "vm/vmap.h"
 #include "kernel/kmalloc.h"
 #include "kernel/assert.h"
 
@@ -47,6 +48,9 @@
  * @{
  */
 
+/* Pages unmapped between two TLB shootdowns in vm_unmap_range */
+#define VM_UNMAP_BATCH 32
+
 
 /* Check whether given (virtual) address is even or odd mapping
    in a pair of mappings for TLB. */
@@ -56,7 +60,8 @@
 
 /**
  * Initializes virtual memory system. Initialization consists of page
- * pool initialization and disabling static memory reservation. After
+ * pool and kernel virtual mapping area initialization, installing the
+ * TLB refill handler and disabling static memory reservation. After
  * this kmalloc() may not be used anymore.
  */ 
 void vm_init(void)
@@ -67,14 +72,21 @@ void vm_init(void)
        Any extensions to pagetables should also provide this information
        in this form. */
     KERNEL_ASSERT(sizeof(tlb_entry_t) == 12);
+    KERNEL_ASSERT(sizeof(pagetable_entry_t) == 8);
+    KERNEL_ASSERT(sizeof(pagetable_leaf_t) == PAGE_SIZE);
+    KERNEL_ASSERT(sizeof(pagetable_t) <= PAGE_SIZE);
 
     pagepool_init();
+    vmap_init();
+    tlb_init();
     kmalloc_disable();
 }
 
 /**
  *  Creates a new page table. Reserves memory (one page) for the table
  *  and sets the address space identifier for the created page table.
+ *  TLB entries left by an earlier user of the identifier are
+ *  invalidated before they could be used (see tlb_asid_recycle).
  *
  *  @param asid Address space identifier
  *
@@ -95,18 +107,23 @@ pagetable_t *vm_create_pagetable(uint32_t asid)
     /* Convert physical page address to kernel unmapped
        segmented address. Since the size of that segment is 512MB,
        this way works only for pages allocated in the first 512MB of
-       physical memory. */
+       physical memory, which is where pagepool_get_phys_page takes
+       its pages from. */
     table = (pagetable_t *) (ADDR_PHYS_TO_KERNEL(addr));
 
     table->ASID        = asid;
     table->valid_count = 0;
+    tlb_asid_recycle(asid);
+    table->region_count = 0;
+    memoryset(table->leaves, 0, sizeof(table->leaves));
 
     return table;
 }
 
 /**
- * Destroys given pagetable. Frees the memory (one page) allocated for
- * the pagetable. Does not remove mappings from the TLB.
+ * Destroys given pagetable. Frees the memory allocated for the
+ * pagetable and its leaf tables, but not the mapped pages (see
+ * vm_release_pages). Does not remove mappings from the TLB.
  *
  * @param pagetable Page table to destroy
  *
@@ -114,9 +131,33 @@ pagetable_t *vm_create_pagetable(uint32_t asid)
 
 void vm_destroy_pagetable(pagetable_t *pagetable)
 {
+    unsigned int i;
+
+    for(i=0; i<PAGETABLE_DIRECTORY_ENTRIES; i++) {
+        if(pagetable->leaves[i] != NULL)
+            pagepool_free_phys_page(
+                ADDR_KERNEL_TO_PHYS((uint32_t) pagetable->leaves[i]));
+    }
+
     pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t) pagetable));
 }
 
+/* Returns the entry of the page pair of vaddr, or NULL if vaddr is
+   not a userland address or its leaf table has not been allocated. */
+static pagetable_entry_t *vm_lookup(pagetable_t *pagetable, uint32_t vaddr)
+{
+    pagetable_leaf_t *leaf;
+
+    if(vaddr >= 0x80000000)
+        return NULL;
+
+    leaf = pagetable->leaves[PAGETABLE_DIRECTORY_INDEX(vaddr)];
+    if(leaf == NULL)
+        return NULL;
+
+    return &leaf->entries[PAGETABLE_LEAF_INDEX(vaddr)];
+}
+
 /**
  * Maps given virtual address to given physical address in given page
  * table. Does not modify TLB. The mapping is done in 4k chunks (pages).
@@ -124,7 +165,7 @@ void vm_destroy_pagetable(pagetable_t *pagetable)
  * @param pagetable Page table in which to do the mapping
  *
  * @param vaddr Virtual address to map. This address should be in the
- * beginning of a page boundary (4k).
+ * beginning of a page boundary (4k) in the userland segment.
  *
  * @param physaddr Physical address to map to given virtual address.
  * This address should be in the beginning of a page boundary (4k).
@@ -133,95 +174,479 @@ void vm_destroy_pagetable(pagetable_t *pagetable)
  * page is not dirty (write-protected). The terminology comes
  * from hardware, in reality, this is write enabling bit.
  *
+ * @return 0 on success, -1 if no memory was available for the leaf
+ * table.
  */
 
-void vm_map(pagetable_t *pagetable, 
-	    uint32_t physaddr, 
-	    uint32_t vaddr,
-            int dirty)
+int vm_map(pagetable_t *pagetable, 
+           uint32_t physaddr, 
+           uint32_t vaddr,
+           int dirty)
 {
-    unsigned int i;
+    pagetable_entry_t *entry;
+    uint32_t leaf;
 
     KERNEL_ASSERT(dirty == 0 || dirty == 1);
+    KERNEL_ASSERT(vaddr < 0x80000000);
 
-    for(i=0; i<pagetable->valid_count; i++) {
-	if(pagetable->entries[i].VPN2 == (vaddr >> 13)) {
-	    /* TLB has separate mappings for even and odd 
-	       virtual pages. Let's handle them separately here,
-	       and we have much more fun when updating the TLB later.*/
-	    if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
-		if(pagetable->entries[i].V0 == 1) {
-		    KERNEL_PANIC("Tried to re-map same virtual page");
-		} else {
-		    /* Map the page on a pair entry */
-		    pagetable->entries[i].PFN0 = physaddr >> 12;
-		    pagetable->entries[i].V0 = 1;
-		    pagetable->entries[i].G0 = 0;
-		    pagetable->entries[i].D0 = dirty;
-		    return;
-		}
-	    } else {
-		if(pagetable->entries[i].V1 == 1) {
-		    KERNEL_PANIC("Tried to re-map same virtual page");
-		} else {
-		    /* Map the page on a pair entry */
-		    pagetable->entries[i].PFN1 = physaddr >> 12;
-		    pagetable->entries[i].V1 = 1;
-		    pagetable->entries[i].G1 = 0;
-		    pagetable->entries[i].D1 = dirty;
-		    return;
-		}
-	    }
-	}
-    }
-    /* No previous or pairing mapping was found */
-
-    /* Make sure that pagetable is not full */
-    if(pagetable->valid_count >= PAGETABLE_ENTRIES) {
-	kprintf("Thread with ASID=%d run out of pagetable mapping entries\n",
-		pagetable->ASID);
-	kprintf("during an attempt to map vaddr 0x%8.8x => phys 0x%8.8x.\n",
-		vaddr, physaddr);
-	KERNEL_PANIC("Thread run out of pagetable mapping entries.");
+    if(pagetable->leaves[PAGETABLE_DIRECTORY_INDEX(vaddr)] == NULL) {
+        /* All entries of a zeroed leaf are invalid */
+        leaf = pagepool_get_zeroed_page();
+        if(leaf == 0)
+            return -1;
+        pagetable->leaves[PAGETABLE_DIRECTORY_INDEX(vaddr)] =
+            (pagetable_leaf_t *) ADDR_PHYS_TO_KERNEL(leaf);
     }
 
-    /* Map the page on a new entry */
-
-    pagetable->entries[pagetable->valid_count].VPN2 = vaddr >> 13;
-    pagetable->entries[pagetable->valid_count].ASID = pagetable->ASID;
+    entry = vm_lookup(pagetable, vaddr);
 
+    /* TLB has separate mappings for even and odd virtual pages. */
     if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
-	pagetable->entries[pagetable->valid_count].PFN0 = physaddr >> 12;
-	pagetable->entries[pagetable->valid_count].D0   = dirty;
-	pagetable->entries[pagetable->valid_count].V0   = 1;
-	pagetable->entries[pagetable->valid_count].G0   = 0;
-	pagetable->entries[pagetable->valid_count].V1   = 0;
+        if(entry->V0 == 1)
+            KERNEL_PANIC("Tried to re-map same virtual page");
+        entry->PFN0 = physaddr >> 12;
+        entry->D0   = dirty;
+        entry->V0   = 1;
+        entry->G0   = 0;
     } else {
-	pagetable->entries[pagetable->valid_count].PFN1 = physaddr >> 12;
-	pagetable->entries[pagetable->valid_count].D1   = dirty;
-	pagetable->entries[pagetable->valid_count].V1   = 1;
-	pagetable->entries[pagetable->valid_count].G1   = 0;
-	pagetable->entries[pagetable->valid_count].V0   = 0;
+        if(entry->V1 == 1)
+            KERNEL_PANIC("Tried to re-map same virtual page");
+        entry->PFN1 = physaddr >> 12;
+        entry->D1   = dirty;
+        entry->V1   = 1;
+        entry->G1   = 0;
     }
 
     pagetable->valid_count++;
+
+    return 0;
+}
+
+/**
+ * Unmaps given virtual address from given pagetable. Does not modify
+ * TLB and does not free the page, see vm_unmap_range.
+ *
+ * @param pagetable Page table to operate on
+ *
+ * @param vaddr Virtual addres to unmap
+ *
+ * @return The physical address the page was mapped to, or 0 if it
+ * was not mapped.
+ */
+
+uint32_t vm_unmap(pagetable_t *pagetable, uint32_t vaddr)
+{
+    pagetable_entry_t *entry;
+    uint32_t physaddr = 0;
+
+    entry = vm_lookup(pagetable, vaddr);
+    if(entry == NULL)
+        return 0;
+
+    if(ADDR_IS_ON_EVEN_PAGE(vaddr) && entry->V0) {
+        physaddr = entry->PFN0 << 12;
+        entry->V0 = 0;
+    } else if(ADDR_IS_ON_ODD_PAGE(vaddr) && entry->V1) {
+        physaddr = entry->PFN1 << 12;
+        entry->V1 = 0;
+    }
+
+    if(physaddr != 0)
+        pagetable->valid_count--;
+
+    return physaddr;
+}
+
+/**
+ * Unmaps the pages [start, end) from given pagetable, removes them
+ * from the TLBs of all CPUs and drops the pagetable's references to
+ * them, freeing pages nobody else references. The pages are handled
+ * in batches, with one TLB shootdown per batch. Must be called in the
+ * address space's own thread, without spinlocks held.
+ *
+ * @param pagetable Page table to operate on
+ *
+ * @param start First address of the range, page aligned
+ *
+ * @param end Address after the range, page aligned
+ *
+ * @return The number of pages unmapped.
+ */
+int vm_unmap_range(pagetable_t *pagetable, uint32_t start, uint32_t end)
+{
+    uint32_t pages[VM_UNMAP_BATCH];
+    uint32_t vaddr, batch_start, phys;
+    int count = 0, n, i;
+
+    KERNEL_ASSERT((start & ~PAGE_SIZE_MASK) == 0
+                  && (end & ~PAGE_SIZE_MASK) == 0);
+
+    vaddr = start;
+    while(vaddr < end) {
+        /* Take pages out of the pagetable... */
+        batch_start = vaddr;
+        n = 0;
+        while(vaddr < end && n < VM_UNMAP_BATCH) {
+            phys = vm_unmap(pagetable, vaddr);
+            if(phys != 0)
+                pages[n++] = phys;
+            vaddr += PAGE_SIZE;
+        }
+
+        if(n == 0)
+            continue;
+
+        /* ...make sure no CPU can reach them any more... */
+        tlb_shootdown(pagetable->ASID, batch_start, vaddr);
+
+        /* ...and give them back. */
+        for(i=0; i<n; i++)
+            pagepool_page_unref(pages[i]);
+        count += n;
+    }
+
+    return count;
 }
 
 /**
- * Unmaps given virtual address from given pagetable.
+ * Unmaps one page from given pagetable like vm_unmap_range.
  *
  * @param pagetable Page table to operate on
  *
  * @param vaddr Virtual addres to unmap
+ */
+void vm_unmap_and_free(pagetable_t *pagetable, uint32_t vaddr)
+{
+    vm_unmap_range(pagetable, vaddr & PAGE_SIZE_MASK,
+                   (vaddr & PAGE_SIZE_MASK) + PAGE_SIZE);
+}
+
+/**
+ * Drops the page table's reference to every physical page mapped in
+ * it, freeing pages nobody else references, and empties the page
+ * table, including its leaf tables. Used when an address space is
+ * torn down. Does not remove mappings from the TLB.
+ *
+ * @param pagetable Page table whose pages to release
+ *
+ * @return The number of pages unmapped.
+ */
+int vm_release_pages(pagetable_t *pagetable)
+{
+    pagetable_leaf_t *leaf;
+    unsigned int i, j;
+    int count = 0;
+
+    for(i=0; i<PAGETABLE_DIRECTORY_ENTRIES; i++) {
+        leaf = pagetable->leaves[i];
+        if(leaf == NULL)
+            continue;
+
+        for(j=0; j<PAGETABLE_LEAF_ENTRIES; j++) {
+            if(leaf->entries[j].V0) {
+                pagepool_page_unref(leaf->entries[j].PFN0 << 12);
+                count++;
+            }
+            if(leaf->entries[j].V1) {
+                pagepool_page_unref(leaf->entries[j].PFN1 << 12);
+                count++;
+            }
+        }
+
+        pagepool_free_phys_page(ADDR_KERNEL_TO_PHYS((uint32_t) leaf));
+        pagetable->leaves[i] = NULL;
+    }
+
+    pagetable->valid_count = 0;
+    pagetable->region_count = 0;
+
+    return count;
+}
+
+/**
+ * Creates a copy of the given pagetable for a forked address space.
+ * The copy maps the same physical pages and has the same demand paged
+ * regions. No page is copied: the pages become shared copy-on-write.
+ * Both pagetables lose their dirty bits and each page gets a reference
+ * for the copy, so the first write to a page through either pagetable
+ * gives the writer its own copy (see vm_copy_on_write). Pages of
+ * shared regions (see vm_reserve_shared) keep their dirty bits, so
+ * writes through either pagetable go to the same page. The old
+ * writable entries of the original are removed from the TLBs of all
+ * CPUs. Must be called in the original's own thread, without
+ * spinlocks held.
+ *
+ * @param pagetable Page table to copy
+ *
+ * @param asid Address space identifier for the copy
+ *
+ * @return The copy, or NULL if no memory was available.
+ */
+pagetable_t *vm_copy_pagetable(pagetable_t *pagetable, uint32_t asid)
+{
+    pagetable_t *copy;
+    pagetable_leaf_t *leaf;
+    pagetable_entry_t *entry;
+    pagetable_region_t *region;
+    uint32_t addr, vaddr;
+    unsigned int i, j;
+
+    copy = vm_create_pagetable(asid);
+    if(copy == NULL)
+        return NULL;
+
+    copy->region_count = pagetable->region_count;
+    memcopy(sizeof(pagetable->regions), copy->regions, pagetable->regions);
+
+    for(i=0; i<PAGETABLE_DIRECTORY_ENTRIES; i++) {
+        leaf = pagetable->leaves[i];
+        if(leaf == NULL)
+            continue;
+
+        addr = pagepool_get_phys_page();
+        if(addr == 0) {
+            vm_release_pages(copy);
+            vm_destroy_pagetable(copy);
+            return NULL;
+        }
+
+        for(j=0; j<PAGETABLE_LEAF_ENTRIES; j++) {
+            entry = &leaf->entries[j];
+            vaddr = (i << PAGETABLE_LEAF_SHIFT) | (j << 13);
+            if(entry->V0) {
+                region = vm_find_region(pagetable, vaddr);
+                if(region == NULL || !region->shared)
+                    entry->D0 = 0;
+                pagepool_page_ref(entry->PFN0 << 12);
+                copy->valid_count++;
+            }
+            if(entry->V1) {
+                region = vm_find_region(pagetable, vaddr + PAGE_SIZE);
+                if(region == NULL || !region->shared)
+                    entry->D1 = 0;
+                pagepool_page_ref(entry->PFN1 << 12);
+                copy->valid_count++;
+            }
+        }
+
+        copy->leaves[i] = (pagetable_leaf_t *) ADDR_PHYS_TO_KERNEL(addr);
+        memcopy(PAGE_SIZE, copy->leaves[i], leaf);
+    }
+
+    tlb_shootdown(pagetable->ASID, 0, 0x80000000);
+
+    return copy;
+}
+
+/**
+ * Reserves the pages [start, end) in the given pagetable as a
+ * zero-fill region. No memory is allocated; the pages are mapped when
+ * first touched (see process_page_fault). A region directly after an
+ * existing one with the same dirty bit extends it.
+ *
+ * @param pagetable Page table to operate on
+ *
+ * @param start First address of the region, page aligned
+ *
+ * @param end Address after the region, page aligned
+ *
+ * @param dirty 1 if the pages are writable, 0 if read-only
+ *
+ * @return 0 on success, -1 if the pagetable has no free region slots.
+ */
+int vm_reserve(pagetable_t *pagetable, uint32_t start, uint32_t end,
+               int dirty)
+{
+    return vm_reserve_file(pagetable, start, end, dirty, 0, 0);
+}
+
+/**
+ * Reserves the pages [start, end) in the given pagetable as a region
+ * whose first filesize bytes are loaded from the executable of the
+ * process when touched. The rest of the region is zero-filled.
+ *
+ * @param pagetable Page table to operate on
+ *
+ * @param start First address of the region, page aligned
+ *
+ * @param end Address after the region, page aligned
+ *
+ * @param dirty 1 if the pages are writable, 0 if read-only
+ *
+ * @param offset Location of the data in the executable
+ *
+ * @param filesize Number of bytes loaded from the executable, 0 for a
+ * zero-fill region
+ *
+ * @return 0 on success, -1 if the pagetable has no free region slots.
+ */
+int vm_reserve_file(pagetable_t *pagetable, uint32_t start, uint32_t end,
+                    int dirty, uint32_t offset, uint32_t filesize)
+{
+    pagetable_region_t *region;
+    unsigned int i;
+
+    KERNEL_ASSERT((start & ~PAGE_SIZE_MASK) == 0
+                  && (end & ~PAGE_SIZE_MASK) == 0);
+    KERNEL_ASSERT(filesize <= end - start);
+
+    if (start >= end)
+        return 0;
+
+    /* Only zero-fill ranges can extend a region, the file-backed
+       part of a region is always at its beginning. */
+    for(i=0; i<pagetable->region_count && filesize == 0; i++) {
+        region = &pagetable->regions[i];
+        if(region->end == start && region->dirty == (uint32_t)dirty
+           && !region->shared) {
+            region->end = end;
+            return 0;
+        }
+    }
+
+    if(pagetable->region_count >= PAGETABLE_REGIONS)
+        return -1;
+
+    region = &pagetable->regions[pagetable->region_count++];
+    region->start    = start;
+    region->end      = end;
+    region->dirty    = dirty;
+    region->offset   = offset;
+    region->filesize = filesize;
+    region->shared   = 0;
+
+    return 0;
+}
+
+/**
+ * Reserves the pages [start, end) in the given pagetable as a
+ * writable zero-fill region which is shared with forked copies of
+ * the pagetable instead of becoming copy-on-write (see
+ * vm_copy_pagetable). Only the pages mapped at the time of the fork
+ * are shared, so the caller should map the whole region before.
+ *
+ * @param pagetable Page table to operate on
+ *
+ * @param start First address of the region, page aligned
+ *
+ * @param end Address after the region, page aligned
+ *
+ * @return 0 on success, -1 if the pagetable has no free region slots.
+ */
+int vm_reserve_shared(pagetable_t *pagetable, uint32_t start, uint32_t end)
+{
+    pagetable_region_t *region;
+
+    KERNEL_ASSERT((start & ~PAGE_SIZE_MASK) == 0
+                  && (end & ~PAGE_SIZE_MASK) == 0);
+
+    if (start >= end)
+        return 0;
+
+    if(pagetable->region_count >= PAGETABLE_REGIONS)
+        return -1;
+
+    region = &pagetable->regions[pagetable->region_count++];
+    region->start    = start;
+    region->end      = end;
+    region->dirty    = 1;
+    region->offset   = 0;
+    region->filesize = 0;
+    region->shared   = 1;
+
+    return 0;
+}
+
+/* Moves the beginning of the region to start, skipping the file data
+   of the pages removed. */
+static void vm_region_set_start(pagetable_region_t *region, uint32_t start)
+{
+    uint32_t skip = start - region->start;
+
+    if(region->filesize > skip) {
+        region->offset   += skip;
+        region->filesize -= skip;
+    } else {
+        region->filesize = 0;
+    }
+    region->start = start;
+}
+
+/* Moves the end of the region to end. */
+static void vm_region_set_end(pagetable_region_t *region, uint32_t end)
+{
+    region->end = end;
+    if(region->filesize > end - region->start)
+        region->filesize = end - region->start;
+}
+
+/**
+ * Removes the pages [start, end) from the demand paged regions of the
+ * given pagetable. Pages which have already been mapped stay mapped.
+ *
+ * @param pagetable Page table to operate on
+ *
+ * @param start First address of the range, page aligned
+ *
+ * @param end Address after the range, page aligned
  *
+ * @return 0 on success, -1 if a region would have to be split and
+ * the pagetable has no free region slots.
  */
+int vm_unreserve(pagetable_t *pagetable, uint32_t start, uint32_t end)
+{
+    pagetable_region_t *region;
+    unsigned int i = 0;
+
+    while(i < pagetable->region_count) {
+        region = &pagetable->regions[i];
+
+        if(end <= region->start || start >= region->end) {
+            /* No overlap */
+        } else if(start <= region->start && end >= region->end) {
+            /* Whole region, replace it with the last one */
+            *region = pagetable->regions[--pagetable->region_count];
+            continue;
+        } else if(start <= region->start) {
+            vm_region_set_start(region, end);
+        } else if(end >= region->end) {
+            vm_region_set_end(region, start);
+        } else {
+            /* The middle of the region, split it in two */
+            if(pagetable->region_count >= PAGETABLE_REGIONS)
+                return -1;
+            pagetable->regions[pagetable->region_count] = *region;
+            vm_region_set_start(&pagetable->regions[pagetable->region_count],
+                                end);
+            pagetable->region_count++;
+            vm_region_set_end(region, start);
+        }
+        i++;
+    }
 
-void vm_unmap(pagetable_t *pagetable, uint32_t vaddr)
+    return 0;
+}
+
+/**
+ * Finds the demand paged region containing the given address.
+ *
+ * @param pagetable Page table to operate on
+ *
+ * @param vaddr The address
+ *
+ * @return The region, or NULL if vaddr is not reserved.
+ */
+pagetable_region_t *vm_find_region(pagetable_t *pagetable, uint32_t vaddr)
 {
-    pagetable = pagetable;
-    vaddr     = vaddr;
-    
-    /* Not implemented */
+    unsigned int i;
+
+    for(i=0; i<pagetable->region_count; i++) {
+        if(vaddr >= pagetable->regions[i].start
+           && vaddr < pagetable->regions[i].end)
+            return &pagetable->regions[i];
+    }
+
+    return NULL;
 }
 
 /**
@@ -238,35 +663,146 @@ void vm_unmap(pagetable_t *pagetable, uint32_t vaddr)
  */
 void vm_set_dirty(pagetable_t *pagetable, uint32_t vaddr, int dirty)
 {
-    unsigned int i;
+    pagetable_entry_t *entry;
 
     KERNEL_ASSERT(dirty == 0 || dirty == 1);
 
-    for(i=0; i<pagetable->valid_count; i++) {
-	if(pagetable->entries[i].VPN2 == (vaddr >> 13)) {
-            /* Check whether this is an even or odd page */
-	    if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
-		if(pagetable->entries[i].V0 == 0) {
-		    KERNEL_PANIC("Tried to set dirty bit of an unmapped "
-                                 "entry");
-		} else {
-		    pagetable->entries[i].D0 = dirty;
-		    return;
-		}
-	    } else {
-		if(pagetable->entries[i].V1 == 0) {
-		    KERNEL_PANIC("Tried to set dirty bit of an unmapped "
-                                 "entry");
-		} else {
-		    pagetable->entries[i].D1 = dirty;
-		    return;
-		}
-	    }
-	}
+    entry = vm_lookup(pagetable, vaddr);
+
+    /* Check whether this is an even or odd page */
+    if(entry != NULL && ADDR_IS_ON_EVEN_PAGE(vaddr) && entry->V0) {
+        entry->D0 = dirty;
+    } else if(entry != NULL && ADDR_IS_ON_ODD_PAGE(vaddr) && entry->V1) {
+        entry->D1 = dirty;
+    } else {
+        KERNEL_PANIC("Tried to set dirty bit of an unmapped entry");
+    }
+}
+
+/**
+ * Makes the mapped page at the given virtual address writable after a
+ * write to a copy-on-write page (see vm_copy_pagetable). If other
+ * pagetables still map the physical page, it is copied and the copy
+ * is mapped in its place, otherwise the page is just marked dirty.
+ * The old page is removed from the TLBs of all CPUs before the
+ * pagetable's reference to it is dropped. Must be called in the
+ * address space's own thread, without spinlocks held.
+ *
+ * @param pagetable The pagetable where the mapping resides.
+ *
+ * @param vaddr The address which was written to.
+ *
+ * @return 1 on success, 0 if vaddr is not mapped and -1 if no memory
+ * was available for the copy.
+ */
+int vm_copy_on_write(pagetable_t *pagetable, uint32_t vaddr)
+{
+    pagetable_entry_t *entry;
+    uint32_t page, phys, copy;
+
+    page = vaddr & PAGE_SIZE_MASK;
+    phys = vm_translate(pagetable, page);
+    if(phys == 0)
+        return 0;
+
+    /* The last user of a page can have it without copying */
+    copy = phys;
+    if(pagepool_page_refcount(phys) > 1) {
+        copy = pagepool_get_phys_page();
+        if(copy == 0)
+            return -1;
+        memcopy(PAGE_SIZE, (void *) ADDR_PHYS_TO_KERNEL(copy),
+                (void *) ADDR_PHYS_TO_KERNEL(phys));
+    }
+
+    entry = vm_lookup(pagetable, page);
+    if(ADDR_IS_ON_EVEN_PAGE(page)) {
+        entry->PFN0 = copy >> 12;
+        entry->D0   = 1;
+    } else {
+        entry->PFN1 = copy >> 12;
+        entry->D1   = 1;
+    }
+
+    if(copy != phys) {
+        tlb_shootdown(pagetable->ASID, page, page + PAGE_SIZE);
+        pagepool_page_unref(phys);
+    }
+
+    return 1;
+}
+
+/**
+ * Translates the given virtual address to a physical address using
+ * the given pagetable. The TLB is not consulted.
+ *
+ * @param pagetable The pagetable where the mapping resides.
+ *
+ * @param vaddr The virtual address to translate.
+ *
+ * @return The physical address corresponding to vaddr, or 0 if vaddr
+ * is not mapped in the pagetable.
+ */
+uint32_t vm_translate(pagetable_t *pagetable, uint32_t vaddr)
+{
+    pagetable_entry_t *entry;
+
+    entry = vm_lookup(pagetable, vaddr);
+    if(entry == NULL)
+        return 0;
+
+    if(ADDR_IS_ON_EVEN_PAGE(vaddr)) {
+        if(!entry->V0)
+            return 0;
+        return (entry->PFN0 << 12) | (vaddr & ~PAGE_SIZE_MASK);
+    } else {
+        if(!entry->V1)
+            return 0;
+        return (entry->PFN1 << 12) | (vaddr & ~PAGE_SIZE_MASK);
     }
-    /* No mapping was found */
+}
+
+/**
+ * Builds the TLB entry for the page pair of the given virtual
+ * address, for loading it into the TLB on a miss.
+ *
+ * @param pagetable The pagetable where the mapping resides.
+ *
+ * @param vaddr The virtual address which missed.
+ *
+ * @param entry Where to store the TLB entry.
+ *
+ * @return 1 if the page of vaddr is mapped, 0 if it is not (entry is
+ * then undefined).
+ */
+int vm_get_tlb_entry(pagetable_t *pagetable, uint32_t vaddr,
+                     tlb_entry_t *entry)
+{
+    pagetable_entry_t *pair;
+
+    pair = vm_lookup(pagetable, vaddr);
+    if(pair == NULL)
+        return 0;
+    if(ADDR_IS_ON_EVEN_PAGE(vaddr) ? !pair->V0 : !pair->V1)
+        return 0;
+
+    memoryset(entry, 0, sizeof(tlb_entry_t));
+    entry->VPN2 = vaddr >> 13;
+    entry->ASID = pagetable->ASID;
+
+    entry->PFN0 = pair->PFN0;
+    entry->C0   = pair->C0;
+    entry->D0   = pair->D0;
+    entry->V0   = pair->V0;
+    entry->G0   = pair->G0;
+
+    entry->PFN1 = pair->PFN1;
+    entry->C1   = pair->C1;
+    entry->D1   = pair->D1;
+    entry->V1   = pair->V1;
+    entry->G1   = pair->G1;
 
-    KERNEL_PANIC("Tried to set dirty bit of an unmapped entry");
+    return 1;
 }
 
 /** @} */
@@ -47,12 +47,28 @@ void vm_init(void);
 
 pagetable_t *vm_create_pagetable(uint32_t asid);
 void vm_destroy_pagetable(pagetable_t *pagetable);
+pagetable_t *vm_copy_pagetable(pagetable_t *pagetable, uint32_t asid);
 
-void vm_map(pagetable_t *pagetable, uint32_t physaddr, 
-	    uint32_t vaddr, int dirty);
-void vm_unmap(pagetable_t *pagetable, uint32_t vaddr);
+int vm_map(pagetable_t *pagetable, uint32_t physaddr, 
+           uint32_t vaddr, int dirty);
+uint32_t vm_unmap(pagetable_t *pagetable, uint32_t vaddr);
+int vm_unmap_range(pagetable_t *pagetable, uint32_t start, uint32_t end);
 void vm_unmap_and_free(pagetable_t *pagetable, uint32_t vaddr);
+int vm_release_pages(pagetable_t *pagetable);
+
+int vm_reserve(pagetable_t *pagetable, uint32_t start, uint32_t end,
+               int dirty);
+int vm_reserve_file(pagetable_t *pagetable, uint32_t start, uint32_t end,
+                    int dirty, uint32_t offset, uint32_t filesize);
+int vm_reserve_shared(pagetable_t *pagetable, uint32_t start, uint32_t end);
+int vm_unreserve(pagetable_t *pagetable, uint32_t start, uint32_t end);
+pagetable_region_t *vm_find_region(pagetable_t *pagetable, uint32_t vaddr);
 
 void vm_set_dirty(pagetable_t *pagetable, uint32_t vaddr, int dirty);
+int vm_copy_on_write(pagetable_t *pagetable, uint32_t vaddr);
+
+uint32_t vm_translate(pagetable_t *pagetable, uint32_t vaddr);
+int vm_get_tlb_entry(pagetable_t *pagetable, uint32_t vaddr,
+                     tlb_entry_t *entry);
 
 #endif /* BUENOS_VM_VM_H */
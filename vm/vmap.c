@@ -0,0 +1,440 @@
+/*
+ * Kernel virtual mapping area.
+ */
+
+#include "vm/vmap.h"
+#include "vm/pagepool.h"
+#include "kernel/spinlock.h"
+#include "kernel/interrupt.h"
+#include "kernel/scheduler.h"
+#include "kernel/sleepq.h"
+#include "kernel/thread.h"
+#include "kernel/assert.h"
+#include "kernel/stats.h"
+#include "drivers/metadev.h"
+
+/** @name Kernel virtual mapping area
+ *
+ * A region of KSEG2 in which the kernel maps pages itself. Physically
+ * scattered pages can be mapped at consecutive addresses, so kernel
+ * buffers can be larger than a page without needing contiguous
+ * physical memory, and pages of high memory, which are not reachable
+ * through KSEG0, can be used too.
+ *
+ * The mappings are kept in a kernel page table with one entry per
+ * page pair, indexed directly by the address, so a TLB miss in the
+ * area is served in constant time. The entries are global: they match
+ * in every address space and survive context switches.
+ *
+ * Since the entries may be in the TLB of any CPU, an unmapped range
+ * can not be reused right away. Unmapped pages are marked stale and
+ * reclaimed in batches: a purge asks every CPU to drop the entries of
+ * the area from its TLB, and when the last CPU has done so, the stale
+ * addresses and the physical pages allocated by vmalloc are freed.
+ * A mapping which finds no room waits for the purge of the stale
+ * pages and tries again, so mapping may sleep.
+ *
+ * TLB misses are handled by the exception handlers, so memory in the
+ * area must not be touched from interrupt handlers.
+ *
+ * @{
+ */
+
+/* State of a page of the area */
+#define VMAP_PAGE_FREE    0
+#define VMAP_PAGE_USED    1
+/* Unmapped, waiting for the next purge */
+#define VMAP_PAGE_STALE   2
+/* Unmapped, waiting for the purge in progress */
+#define VMAP_PAGE_PURGING 3
+#define VMAP_PAGE_STATE   0x0f
+/* The physical page was allocated by vmalloc */
+#define VMAP_PAGE_OWNED   0x10
+/* Last page of a mapping */
+#define VMAP_PAGE_LAST    0x20
+
+/* Number of stale pages which triggers a purge */
+#define VMAP_PURGE_THRESHOLD (CONFIG_VMAP_PAGES / 4)
+
+#define VMAP_PAGE_INDEX(addr) (((addr) - VMAP_START) / PAGE_SIZE)
+
+static struct {
+    spinlock_t slock;
+    uint8_t state[CONFIG_VMAP_PAGES];
+    /* Number of stale pages */
+    int stale;
+    /* Number of CPUs which have not yet flushed their TLB in the
+       purge in progress, 0 if there is none */
+    int purge_pending;
+    int num_cpus;
+    deferred_work_t purge_work[CONFIG_MAX_CPUS];
+} vmap_area;
+
+/* Kernel page table of the area, one entry per page pair */
+static tlb_entry_t vmap_entries[CONFIG_VMAP_PAGES / 2];
+
+static stat_id_t vmap_stat_mapped;
+static stat_id_t vmap_stat_purges;
+static stat_id_t vmap_stat_purge_waits;
+
+static void vmap_purge_cpu(uint32_t arg);
+
+/**
+ * Initializes the kernel virtual mapping area. Called by vm_init.
+ */
+void vmap_init(void)
+{
+    int i;
+
+    KERNEL_ASSERT(CONFIG_VMAP_PAGES % 2 == 0);
+
+    spinlock_reset(&vmap_area.slock);
+    vmap_area.stale = 0;
+    vmap_area.purge_pending = 0;
+    vmap_area.num_cpus = cpustatus_count();
+
+    for (i = 0; i < CONFIG_VMAP_PAGES; i++)
+        vmap_area.state[i] = VMAP_PAGE_FREE;
+
+    for (i = 0; i < CONFIG_VMAP_PAGES / 2; i++) {
+        memoryset(&vmap_entries[i], 0, sizeof(tlb_entry_t));
+        vmap_entries[i].VPN2 = (VMAP_START >> 13) + i;
+        vmap_entries[i].G0 = 1;
+        vmap_entries[i].G1 = 1;
+    }
+
+    for (i = 0; i < CONFIG_MAX_CPUS; i++) {
+        vmap_area.purge_work[i].func = &vmap_purge_cpu;
+        vmap_area.purge_work[i].arg = i;
+    }
+
+    vmap_stat_mapped = stats_register("vmap pages mapped");
+    vmap_stat_purges = stats_register("vmap purges");
+    vmap_stat_purge_waits = stats_register("vmap purge waits");
+}
+
+/* Sets the mapping of the given page of the area. */
+static void vmap_set_entry(int page, uint32_t phys)
+{
+    tlb_entry_t *entry = &vmap_entries[page / 2];
+
+    if (page & 1) {
+        entry->PFN1 = phys >> 12;
+        entry->D1 = 1;
+        entry->V1 = 1;
+    } else {
+        entry->PFN0 = phys >> 12;
+        entry->D0 = 1;
+        entry->V0 = 1;
+    }
+}
+
+/* Physical address of the given page of the area. The address is kept
+   after the page is unmapped, until the page is purged. */
+static uint32_t vmap_get_phys(int page)
+{
+    tlb_entry_t *entry = &vmap_entries[page / 2];
+
+    return (page & 1) ? entry->PFN1 << 12 : entry->PFN0 << 12;
+}
+
+/* Starts a purge of the stale pages, unless one is already in
+   progress. The area must be locked. */
+static void vmap_purge_start(void)
+{
+    int i;
+
+    if (vmap_area.purge_pending > 0 || vmap_area.stale == 0)
+        return;
+
+    for (i = 0; i < CONFIG_VMAP_PAGES; i++) {
+        if ((vmap_area.state[i] & VMAP_PAGE_STATE) == VMAP_PAGE_STALE)
+            vmap_area.state[i] = (vmap_area.state[i] & VMAP_PAGE_OWNED)
+                | VMAP_PAGE_PURGING;
+    }
+
+    vmap_area.stale = 0;
+    vmap_area.purge_pending = vmap_area.num_cpus;
+
+    for (i = 0; i < vmap_area.num_cpus; i++)
+        scheduler_defer_work(i, &vmap_area.purge_work[i]);
+
+    stats_inc(vmap_stat_purges);
+}
+
+/* Deferred work of a purge. Drops the entries of the area from the
+   TLB of this CPU, and frees the purged pages if this was the last
+   CPU to do so. */
+static void vmap_purge_cpu(uint32_t arg)
+{
+    tlb_entry_t entry;
+    uint32_t i, max, asid;
+    int page;
+
+    arg = arg;
+
+    /* Reading and writing entries changes the current ASID */
+    asid = _tlb_get_asid();
+    max = _tlb_get_maxindex();
+    for (i = 0; i <= max; i++) {
+        _tlb_read(&entry, i, 1);
+        if (ADDR_IS_VMAP((uint32_t)entry.VPN2 << 13)) {
+            entry.V0 = 0;
+            entry.V1 = 0;
+            _tlb_write(&entry, i, 1);
+        }
+    }
+    _tlb_set_asid(asid);
+
+    spinlock_acquire(&vmap_area.slock);
+
+    if (--vmap_area.purge_pending == 0) {
+        for (page = 0; page < CONFIG_VMAP_PAGES; page++) {
+            if ((vmap_area.state[page] & VMAP_PAGE_STATE)
+                != VMAP_PAGE_PURGING)
+                continue;
+            if (vmap_area.state[page] & VMAP_PAGE_OWNED)
+                pagepool_free_phys_page(vmap_get_phys(page));
+            vmap_area.state[page] = VMAP_PAGE_FREE;
+        }
+
+        /* Mappings waiting for room may find it now */
+        sleepq_wake_all(&vmap_area);
+
+        /* More pages may have gone stale during the purge */
+        if (vmap_area.stale >= VMAP_PURGE_THRESHOLD)
+            vmap_purge_start();
+    }
+
+    spinlock_release(&vmap_area.slock);
+}
+
+/* Finds count consecutive free pages of the area and returns the
+   index of the first one, or -1 if there are none. The area must be
+   locked. */
+static int vmap_find_free(int count)
+{
+    int i, run = 0;
+
+    for (i = 0; i < CONFIG_VMAP_PAGES; i++) {
+        if (vmap_area.state[i] != VMAP_PAGE_FREE)
+            run = 0;
+        else if (++run == count)
+            return i - count + 1;
+    }
+
+    return -1;
+}
+
+/* Reserves count consecutive pages of the area and returns the index
+   of the first one. If there is no room, the stale pages are purged
+   and the reservation tried again. Returns -1 if there is no room
+   even with nothing left to purge. May sleep. */
+static int vmap_reserve(int count)
+{
+    interrupt_status_t intr_status;
+    int i, first;
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&vmap_area.slock);
+
+    for (;;) {
+        first = vmap_find_free(count);
+        if (first >= 0
+            || (vmap_area.stale == 0 && vmap_area.purge_pending == 0))
+            break;
+
+        /* Wait for the purge, which frees the stale pages when every
+           CPU has run its scheduler (this one included, when this
+           thread switches away) */
+        vmap_purge_start();
+        stats_inc(vmap_stat_purge_waits);
+        sleepq_add(&vmap_area);
+        spinlock_release(&vmap_area.slock);
+        thread_switch();
+        spinlock_acquire(&vmap_area.slock);
+    }
+
+    if (first >= 0) {
+        for (i = first; i < first + count; i++)
+            vmap_area.state[i] = VMAP_PAGE_USED;
+        vmap_area.state[first + count - 1] |= VMAP_PAGE_LAST;
+    }
+
+    spinlock_release(&vmap_area.slock);
+    _interrupt_set_state(intr_status);
+
+    return first;
+}
+
+/**
+ * Maps the given physical pages at consecutive addresses in the
+ * kernel virtual mapping area. The pages stay owned by the caller.
+ * May sleep waiting for a purge, so this must not be called with
+ * spinlocks held or from interrupt handlers.
+ *
+ * @param pages Physical addresses of the pages
+ *
+ * @param count Number of pages
+ *
+ * @return Address of the first page, or NULL if there is no room in
+ * the area.
+ */
+void *vmap(uint32_t *pages, int count)
+{
+    int first, i;
+
+    KERNEL_ASSERT(count > 0);
+
+    first = vmap_reserve(count);
+    if (first < 0)
+        return NULL;
+
+    for (i = 0; i < count; i++)
+        vmap_set_entry(first + i, pages[i]);
+
+    stats_add(vmap_stat_mapped, count);
+
+    return (void *)(VMAP_START + first * PAGE_SIZE);
+}
+
+/**
+ * Unmaps a mapping made with vmap. The address range is reused after
+ * the next purge.
+ *
+ * @param addr Address returned by vmap
+ */
+void vunmap(void *addr)
+{
+    interrupt_status_t intr_status;
+    int page, last;
+
+    KERNEL_ASSERT(ADDR_IS_VMAP((uint32_t)addr)
+                  && ((uint32_t)addr & (PAGE_SIZE - 1)) == 0);
+
+    page = VMAP_PAGE_INDEX((uint32_t)addr);
+
+    intr_status = _interrupt_disable();
+    spinlock_acquire(&vmap_area.slock);
+
+    do {
+        KERNEL_ASSERT((vmap_area.state[page] & VMAP_PAGE_STATE)
+                      == VMAP_PAGE_USED);
+        last = vmap_area.state[page] & VMAP_PAGE_LAST;
+        vmap_area.state[page] = (vmap_area.state[page] & VMAP_PAGE_OWNED)
+            | VMAP_PAGE_STALE;
+        /* Keep the physical address for the purge */
+        if (page & 1)
+            vmap_entries[page / 2].V1 = 0;
+        else
+            vmap_entries[page / 2].V0 = 0;
+        vmap_area.stale++;
+        page++;
+    } while (!last);
+
+    if (vmap_area.stale >= VMAP_PURGE_THRESHOLD)
+        vmap_purge_start();
+
+    spinlock_release(&vmap_area.slock);
+    _interrupt_set_state(intr_status);
+}
+
+/**
+ * Allocates virtually contiguous kernel memory. The pages are taken
+ * from high memory when possible and need not be physically
+ * contiguous, so the memory must not be used for DMA. May sleep, like
+ * vmap.
+ *
+ * @param bytes Number of bytes to allocate
+ *
+ * @return The allocated memory, or NULL if out of memory or out of
+ * room in the area. The contents of the memory are undefined.
+ */
+void *vmalloc(int bytes)
+{
+    uint32_t phys;
+    int first, count, i;
+
+    KERNEL_ASSERT(bytes > 0);
+
+    count = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+    first = vmap_reserve(count);
+    if (first < 0)
+        return NULL;
+
+    for (i = 0; i < count; i++) {
+        phys = pagepool_get_high_page();
+        if (phys == 0) {
+            /* The pages allocated so far are freed by the purge */
+            vunmap((void *)(VMAP_START + first * PAGE_SIZE));
+            return NULL;
+        }
+        vmap_area.state[first + i] |= VMAP_PAGE_OWNED;
+        vmap_set_entry(first + i, phys);
+    }
+
+    stats_add(vmap_stat_mapped, count);
+
+    return (void *)(VMAP_START + first * PAGE_SIZE);
+}
+
+/**
+ * Frees memory allocated with vmalloc.
+ *
+ * @param addr The memory to free, or NULL
+ */
+void vfree(void *addr)
+{
+    if (addr != NULL)
+        vunmap(addr);
+}
+
+/**
+ * Translates an address in the kernel virtual mapping area to a
+ * physical address.
+ *
+ * @param vaddr The address to translate
+ *
+ * @return The physical address, or 0 if vaddr is not mapped.
+ */
+uint32_t vmap_translate(uint32_t vaddr)
+{
+    tlb_entry_t *entry;
+
+    if (!ADDR_IS_VMAP(vaddr))
+        return 0;
+
+    entry = &vmap_entries[VMAP_PAGE_INDEX(vaddr) / 2];
+    if (!tlb_entry_is_valid(entry, vaddr))
+        return 0;
+
+    return tlb_entry_get_paddr(entry, vaddr) | (vaddr & ~PAGE_SIZE_MASK);
+}
+
+/**
+ * Loads the mapping of an address in the kernel virtual mapping area
+ * to the TLB. Called from the TLB exception handlers.
+ *
+ * @param vaddr The faulting address
+ *
+ * @return 1 if the mapping was loaded, 0 if vaddr is not mapped.
+ */
+int vmap_fill_tlb(uint32_t vaddr)
+{
+    tlb_entry_t entry;
+
+    if (!ADDR_IS_VMAP(vaddr))
+        return 0;
+
+    entry = vmap_entries[VMAP_PAGE_INDEX(vaddr) / 2];
+    if (!tlb_entry_is_valid(&entry, vaddr))
+        return 0;
+
+    /* The entry is global, but writing it sets the current ASID */
+    entry.ASID = _tlb_get_asid();
+    tlb_write_entry(&entry);
+
+    return 1;
+}
+
+/** @} */
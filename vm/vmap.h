@@ -0,0 +1,30 @@
+/*
+ * Kernel virtual mapping area.
+ */
+
+#ifndef BUENOS_VM_VMAP_H
+#define BUENOS_VM_VMAP_H
+
+#include "lib/libc.h"
+#include "kernel/config.h"
+#include "vm/tlb.h"
+
+/* The area is at the beginning of KSEG2, which is mapped through the
+   TLB in kernel mode only. */
+#define VMAP_START 0xc0000000
+#define VMAP_END   (VMAP_START + CONFIG_VMAP_PAGES * PAGE_SIZE)
+
+#define ADDR_IS_VMAP(addr) ((addr) >= VMAP_START && (addr) < VMAP_END)
+
+void vmap_init(void);
+
+void *vmap(uint32_t *pages, int count);
+void vunmap(void *addr);
+
+void *vmalloc(int bytes);
+void vfree(void *addr);
+
+uint32_t vmap_translate(uint32_t vaddr);
+int vmap_fill_tlb(uint32_t vaddr);
+
+#endif /* BUENOS_VM_VMAP_H */